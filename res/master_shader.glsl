@@ -6,7 +6,8 @@ uniform mat4 proj;
 uniform mat4 view;
 uniform mat4 model;
 uniform mat4 model_norm;
-uniform sampler2D tex;
+uniform sampler2DArray tex;
+uniform int layer;
 
 uniform int num_bones;
 uniform mat4 bones[MAX_JOINTS];
@@ -21,30 +22,33 @@ uniform vec3 ambient_color;
 #ifdef VERT
 layout(location=0) in vec3 pos;
 layout(location=1) in vec2 uv;
-layout(location=2) in vec3 norm;
-layout(location=3) in vec2 weight1;
-layout(location=4) in vec2 weight2;
-layout(location=5) in vec2 weight3;
+layout(location=2) in vec2 packed_norm;
+layout(location=3) in uvec4 bone_indicies;
+layout(location=4) in vec4 bone_weights;
 
 out vec2 pass_uv;
 out vec3 pass_norm;
 out vec3 pass_pos;
+
+// The normals are octahedral encoded, see Mesh::Vertex::pack.
+vec3 decode_normal(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0) {
+        vec2 s = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        n.xy = (1.0 - abs(n.yx)) * s;
+    }
+    return normalize(n);
+}
+
 void main() {
-    ivec3 bone_indicies;
-    bone_indicies[0] = int(weight1.x);
-    bone_indicies[1] = int(weight2.x);
-    bone_indicies[2] = int(weight3.x);
-    vec3 bone_weights;
-    bone_weights[0] = weight1.y;
-    bone_weights[1] = weight2.y;
-    bone_weights[2] = weight3.y;
+    vec3 norm = decode_normal(packed_norm);
 
     vec4 final_norm;
     vec4 final_pos;
     if (num_bones != 0) {
         final_norm = vec4(0.0);
         final_pos = vec4(0.0);
-        for (int i = 0; i < 3; i++) {
+        for (int i = 0; i < 4; i++) {
             mat4 bone_trans = bones[bone_indicies[i]];
 
             vec4 p = bone_trans * vec4(pos, 1.0);
@@ -74,7 +78,7 @@ in vec3 pass_norm;
 in vec3 pass_pos;
 void main() {
     float sun_lightness = max(0, dot(sun_dir, pass_norm));
-    vec4 albedo = texture(tex, pass_uv);
+    vec4 albedo = texture(tex, vec3(pass_uv, layer));
     vec4 light_color = sun_lightness * vec4(sun_color, 1.0) + vec4(ambient_color, 1.0);
 
     for (int i = 0; i < MAX_LIGHTS; i++) {
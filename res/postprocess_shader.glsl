@@ -4,7 +4,7 @@ uniform sampler2D tex;
 #ifdef VERT
 layout(location=0) in vec3 pos;
 layout(location=1) in vec2 uv;
-layout(location=2) in vec3 norm;
+layout(location=2) in vec2 packed_norm;
 
 out vec2 pass_uv;
 void main() {
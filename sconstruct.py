@@ -236,6 +236,10 @@ VariantDir(tests_dir, "src", duplicate=0)
 
 asset_gen = Builder(action="./tools/asset-gen.py -o $TARGET -f $SOURCES $ASSETS_VERBOSE")
 env.Append(BUILDERS={"Assets": asset_gen})
+# The main pack also writes the AssetID constants, which the
+# sources include, so it's packed before they're compiled.
+asset_ids_gen = Builder(action="./tools/asset-gen.py -o ${TARGETS[0]} -H ${TARGETS[1]} -f $SOURCES $ASSETS_VERBOSE")
+env.Append(BUILDERS={"AssetsWithIDs": asset_ids_gen})
 
 def all_asset_targets(build_dir):
     asset_files = defaultdict(list)
@@ -247,12 +251,24 @@ def all_asset_targets(build_dir):
             continue
         else:
             asset_files["{}-{}".format("assets", "-".join(os.path.normcase(f).split("/")[1:-1]))].append(f)
-    assets = [env.Assets(build_dir + "assets.bin", global_asset_files)]
+    assets = [env.AssetsWithIDs([build_dir + "assets.bin", "src/asset/asset_ids.h"], global_asset_files)]
+    depends_on_entities(assets[0], global_asset_files)
     for out_file, files in asset_files.items():
         assets.append(env.Assets(build_dir + out_file + ".bin", files))
+        depends_on_entities(assets[-1], files)
     return assets
 
+def depends_on_entities(target, files):
+    """ Levels are compiled with the entity fields, so they're repacked when the entities change. """
+    if any(f.endswith(".lvl") for f in files):
+        headers = [h for h in glob("src/**/*.h", recursive=True) if not h.endswith("asset_ids.h")]
+        Depends(target, ["./tools/typesystem-gen.py"] + headers)
+
 tests_assets = env.Assets(tests_dir + "assets-tests.bin", glob("res/tests/*.*"))
+depends_on_entities(tests_assets, glob("res/tests/*.*"))
+# The tests pack with some assets edited, for the reload tests,
+# and mounted on top of it by the pack tests.
+tests_patch_assets = env.Assets(tests_dir + "assets-tests-patch.bin", glob("res/tests/patch/*.*"))
 assets = all_asset_targets(smek_dir)
 env.Alias("assets", assets)
 if native and PLATFORMS["linux"]:
@@ -378,6 +394,7 @@ if native:
     tests_target = env.Alias("tests", tests, "cd " + tests_dir + "; " + tests[0].abspath + " " + " ".join(tests_runtime_flags))
 
     Depends(tests_target, tests_assets)
+    Depends(tests_target, tests_patch_assets)
     Depends(tests_target, tests)
     AlwaysBuild(tests_target)
 
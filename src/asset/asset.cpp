@@ -1,17 +1,129 @@
+#include <algorithm>
+#include <bit>
 #include <cstdio>
+#include <cstring>
+
+#ifndef WINDOWS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "../util/log.h"
 
 #include "asset.h"
 #include "../game.h"
 
-AssetID::AssetID(const char *str) {
-    id = hash(str);
+namespace Asset {
+
+// Fibonacci hashing, the low bits of the name hashes
+// are too similar to use them directly.
+static u64 index_bucket(u64 name_hash, u64 capacity) {
+    u32 bits = std::countr_zero(capacity);
+    return (name_hash * 0x9E3779B97F4A7C15ull) >> (64 - bits);
 }
 
-namespace Asset {
+// Returns the header slot of the name hash, or
+// EMPTY_INDEX_SLOT if it isn't in the pack.
+static u32 probe_index(const IndexEntry *index, u64 capacity, u64 name_hash) {
+    u64 mask = capacity - 1;
+    u64 bucket = index_bucket(name_hash, capacity);
+    for (u64 probes = 0; probes < capacity; probes++) {
+        const IndexEntry *entry = index + ((bucket + probes) & mask);
+        if (entry->slot == EMPTY_INDEX_SLOT) break;
+        if (entry->name_hash == name_hash) return entry->slot;
+    }
+    return EMPTY_INDEX_SLOT;
+}
+
+// Finds the pack with the highest priority that has the asset,
+// and the header of the asset in it. False if no pack has it.
+static bool find_owner(System *system, u64 name_hash, Pack **owner, u32 *header) {
+    for (u32 i = 0; i < system->num_packs; i++) {
+        Pack *pack = system->packs[i];
+        *header = probe_index(pack->index, pack->file_header.index_capacity, name_hash);
+        if (*header == EMPTY_INDEX_SLOT) continue;
+        *owner = pack;
+        return true;
+    }
+    return false;
+}
+
+static AssetSlot *lookup(System *system, AssetID id) {
+    if (!system->table) return nullptr;
+    // The first pack that has the asset is the one it's read from.
+    for (u32 i = 0; i < system->num_packs; i++) {
+        Pack *pack = system->packs[i];
+        u32 header = probe_index(pack->index, pack->file_header.index_capacity, id);
+        if (header == EMPTY_INDEX_SLOT) continue;
+        if (pack->header_slots[header] == NO_SLOT) return nullptr;
+        // The slot might have been given to another asset since.
+        AssetSlot *slot = system->table->at(pack->header_slots[header]);
+        if (!slot->used || slot->asset.header->name_hash != id) return nullptr;
+        return slot;
+    }
+    return nullptr;
+}
+
+bool is_valid(AssetID id) {
+    return lookup(&GAMESTATE()->asset_system, id) != nullptr;
+}
 
-bool is_valid(AssetID id) { return GAMESTATE()->asset_system.assets.contains(id); }
+UsableAsset *find(AssetID id) {
+    AssetSlot *slot = lookup(&GAMESTATE()->asset_system, id);
+    ASSERT(slot, "Invalid asset id '{}'", id);
+    return &slot->asset;
+}
+
+// Gives the asset a slot in the table, reusing removed slots
+// first. Has to be called with the asset lock held.
+static UsableAsset *add_slot(AssetTable *table, AssetHeader *header, Pack *pack) {
+    u32 index;
+    if (table->free_slots.empty()) {
+        index = table->num_slots.load(std::memory_order_relaxed);
+        u32 chunk = index / ASSET_CHUNK_SIZE;
+        ASSERT(chunk < MAX_ASSET_CHUNKS, "Too many assets, the table is full");
+        if (!table->chunks[chunk]) {
+            table->chunks[chunk] = new AssetSlot[ASSET_CHUNK_SIZE]();
+        }
+        // Published after the chunk is in place.
+        table->num_slots.store(index + 1, std::memory_order_release);
+    } else {
+        index = table->free_slots.back();
+        table->free_slots.pop_back();
+    }
+
+    AssetSlot *slot = table->at(index);
+    slot->asset = {};
+    slot->asset.header = header;
+    slot->asset.pack = pack;
+    slot->asset.dirty = true;
+    slot->asset.slot = index;
+    slot->type = header->type;
+    slot->used = true;
+    slot->ready.store(false, std::memory_order_release);
+    slot->last_used.store(table->frame.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot->generation.fetch_add(1, std::memory_order_acq_rel);
+    return &slot->asset;
+}
+
+// Has to be called with the asset lock held.
+static void remove_slot(AssetTable *table, u32 index) {
+    AssetSlot *slot = table->at(index);
+    slot->ready.store(false, std::memory_order_release);
+    // Old handles stop matching.
+    slot->generation.fetch_add(1, std::memory_order_acq_rel);
+    slot->used = false;
+    table->free_slots.push_back(index);
+}
+
+// Updates the flag read by the handles, has to be called
+// whenever loaded or dirty changes.
+static void update_ready(UsableAsset *asset) {
+    AssetSlot *slot = GAMESTATE()->asset_system.table->at(asset->slot);
+    slot->ready.store(asset->loaded && !asset->dirty, std::memory_order_release);
+}
 
 template <typename T>
 static void read(FILE *file, T *ptr, size_t num = 1) {
@@ -19,47 +131,306 @@ static void read(FILE *file, T *ptr, size_t num = 1) {
     CHECK(gobbled == num, "Faild to read a part of an asset.");
 }
 
-static void load_texture(UsableAsset *asset, FILE *file) {
-    if (asset->loaded) {
-        asset->texture.destroy();
+#ifdef WINDOWS
+// There's no mmap here, so the file is read in one go instead.
+// Assets still point into the buffer, so nothing is copied twice.
+static u8 *map_file(const char *path, u64 *size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return nullptr;
+    defer { fclose(file); };
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    u8 *data = new u8[*size];
+    read(file, data, *size);
+    return data;
+}
+
+static void unmap_file(u8 *data, u64 size) {
+    delete[] data;
+}
+#else
+static u8 *map_file(const char *path, u64 *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return nullptr;
+    defer { close(fd); };
+
+    struct stat info;
+    if (fstat(fd, &info) == -1) return nullptr;
+    *size = info.st_size;
+
+    void *data = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        ERR("Failed to map asset file {}", path);
+        return nullptr;
+    }
+    return (u8 *)data;
+}
+
+static void unmap_file(u8 *data, u64 size) {
+    munmap((void *)data, size);
+}
+#endif
+
+static PackFile *acquire_file(PackFile *file) {
+    SDL_AtomicAdd(&file->references, 1);
+    return file;
+}
+
+// Closes the file when the last reference is released,
+// from any thread.
+static void release_file(PackFile *file) {
+    if (SDL_AtomicAdd(&file->references, -1) != 1) return;
+    if (file->mapped) unmap_file(file->mapped, file->mapped_size);
+    delete[] file->path;
+    delete file;
+}
+
+// Decodes one block in the LZ4 block format, returns false if
+// the block is malformed or doesn't fill the destination.
+static bool decompress_block(const u8 *src, u32 src_size, u8 *dst, u32 dst_size) {
+    const u8 *ip = src;
+    const u8 *ip_end = src + src_size;
+    u8 *op = dst;
+    u8 *op_end = dst + dst_size;
+
+    auto read_length = [&](u32 length) -> i64 {
+        if (length != 15) return length;
+        u8 byte;
+        do {
+            if (ip >= ip_end) return -1;
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return length;
+    };
+
+    while (ip < ip_end) {
+        u8 token = *ip++;
+        i64 literals = read_length(token >> 4);
+        if (literals < 0 || literals > ip_end - ip || literals > op_end - op) return false;
+        std::memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence has no match.
+        if (ip == ip_end) break;
+
+        if (ip_end - ip < 2) return false;
+        u32 offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst) return false;
+
+        i64 length = read_length(token & 0xF);
+        if (length < 0) return false;
+        length += 4;
+        if (length > op_end - op) return false;
+
+        const u8 *match = op - offset;
+        if (offset >= length) {
+            std::memcpy(op, match, length);
+        } else {
+            // Overlapping matches repeat the last offset bytes.
+            for (i64 i = 0; i < length; i++) op[i] = match[i];
+        }
+        op += length;
     }
+    return op == op_end;
+}
 
+///*
+// Reads the data of one asset, either from the file
+// or from the mapped memory. Compressed assets are
+// decoded a block at a time, straight into the
+// destination when a whole block fits.
+struct DataStream {
+    FILE *file;
+    // The file is closed by whoever opened it.
+    bool borrowed_file;
+    const u8 *cursor;
+
+    bool compressed;
+    u32 block_size;
+    u32 blocks_left;
+    u64 raw_left;
+    // The decoded block, for reads smaller than a block.
+    u8 *block;
+    u32 block_start;
+    u32 block_end;
+    // The compressed block, when reading from the file.
+    u8 *packed;
+
+    void read_raw(void *ptr, u64 size) {
+        if (file) {
+            Asset::read(file, (u8 *)ptr, size);
+        } else {
+            std::memcpy(ptr, cursor, size);
+            cursor += size;
+        }
+    }
+
+    // Decodes the next block into dst, which has to have
+    // room for a whole block. Returns the decoded size.
+    u32 decode_block(u8 *dst) {
+        ASSERT(blocks_left > 0, "Reading past the end of a compressed asset");
+        u32 raw_size = raw_left < block_size ? raw_left : block_size;
+        u32 packed_size;
+        read_raw(&packed_size, sizeof(packed_size));
+        ASSERT(packed_size <= COMPRESSED_BLOCK_BOUND, "Invalid compressed block size {}", packed_size);
+
+        const u8 *src = cursor;
+        if (file) {
+            read_raw(packed, packed_size);
+            src = packed;
+        } else {
+            cursor += packed_size;
+        }
+
+        // Blocks that don't shrink are stored as is.
+        if (packed_size == raw_size) {
+            std::memcpy(dst, src, raw_size);
+        } else {
+            CHECK(decompress_block(src, packed_size, dst, raw_size), "Corrupt compressed asset");
+        }
+        blocks_left--;
+        raw_left -= raw_size;
+        return raw_size;
+    }
+
+    void read_compressed(u8 *dst, u64 size) {
+        while (size) {
+            if (block_start < block_end) {
+                u64 num = block_end - block_start;
+                if (num > size) num = size;
+                std::memcpy(dst, block + block_start, num);
+                block_start += num;
+                dst += num;
+                size -= num;
+            } else if (size >= block_size || size >= raw_left) {
+                u32 num = decode_block(dst);
+                dst += num;
+                size -= num;
+            } else {
+                if (!block) block = new u8[block_size];
+                block_start = 0;
+                block_end = decode_block(block);
+            }
+        }
+    }
+
+    template <typename T>
+    void read(T *ptr, size_t num = 1) {
+        if (compressed) {
+            read_compressed((u8 *)ptr, sizeof(T) * num);
+        } else {
+            read_raw((void *)ptr, sizeof(T) * num);
+        }
+    }
+
+    // Returns a pointer to the next num elements, if the data
+    // is mapped, otherwise nullptr. Reading from the file or
+    // compressed data has to be done with read.
+    template <typename T>
+    T *view(size_t num) {
+        if (file || compressed) return nullptr;
+        T *ptr = (T *)cursor;
+        cursor += sizeof(T) * num;
+        return ptr;
+    }
+
+    void close() {
+        if (file && !borrowed_file) fclose(file);
+        delete[] block;
+        delete[] packed;
+        *this = {};
+    }
+};
+
+// Touches every page of a view into the mapped file, so the
+// page faults happen on the streaming worker and not while
+// the main thread uploads the data.
+static void touch_pages(const void *data, u64 size) {
+    const u64 PAGE_SIZE = 4096;
+    const volatile u8 *bytes = (const volatile u8 *)data;
+    for (u64 i = 0; i < size; i += PAGE_SIZE) {
+        (void)bytes[i];
+    }
+}
+
+// Reading and decoding is split from the upload for the assets
+// that live on the GPU, so the reading can be done by the
+// streaming workers.
+static StagedAsset stage_texture(DataStream *stream) {
     struct {
         // read from file
         u32 width;
         u32 height;
         u32 components;
+        u32 num_levels;
+        u32 num_layers;
         u8 *data;
 
         u64 size() const {
-            return width * height * components;
+            return GFX::Texture::data_size(width, height, components, num_levels, num_layers);
         }
     } raw_image;
 
-    read(file, &raw_image);
+    stream->read(&raw_image);
     u64 size = raw_image.size();
-    u8 *data = new u8[size];
-    read<u8>(file, data, size);
-    asset->texture = GFX::Texture::upload(raw_image.width,
-                                          raw_image.height,
-                                          raw_image.components,
-                                          data,
+
+    StagedAsset staged = {};
+    staged.type = AssetType::TEXTURE;
+    staged.width = raw_image.width;
+    staged.height = raw_image.height;
+    staged.components = raw_image.components;
+    staged.num_levels = raw_image.num_levels;
+    staged.num_layers = raw_image.num_layers;
+    // Always copied, since the texture keeps them.
+    staged.layers = new AssetID[raw_image.num_layers];
+    stream->read<AssetID>(staged.layers, raw_image.num_layers);
+    staged.data = stream->view<u8>(size);
+    staged.owned = !staged.data;
+    if (staged.owned) {
+        staged.data = new u8[size];
+        stream->read<u8>((u8 *)staged.data, size);
+    } else {
+        touch_pages(staged.data, size);
+    }
+    return staged;
+}
+
+static void upload_texture(UsableAsset *asset, StagedAsset *staged) {
+    if (asset->loaded) {
+        asset->texture.destroy();
+    }
+    asset->texture = GFX::Texture::upload(staged->width,
+                                          staged->height,
+                                          staged->components,
+                                          staged->num_levels,
+                                          staged->num_layers,
+                                          (u8 *)staged->data,
                                           GFX::Texture::Sampling::LINEAR);
-    delete[] data;
+    asset->texture.layers = staged->layers;
+    staged->layers = nullptr;
 }
 
-static void load_shader(UsableAsset *asset, FILE *file) {
+static void load_shader(UsableAsset *asset, DataStream *stream) {
     struct {
         // read from file
         u64 size;
         char *data;
     } source;
-    read(file, &source);
+    stream->read(&source);
     u32 size = source.size;
-    char *data = new char[size];
-    read<char>(file, data, size);
+    char *data = stream->view<char>(size);
+    bool owned = !data;
+    if (owned) {
+        data = new char[size];
+        stream->read<char>(data, size);
+    }
 
     GFX::Shader new_shader = GFX::Shader::compile(asset->header->name, data);
+    if (owned) delete[] data;
 
     if (new_shader.is_valid()) {
         if (asset->loaded) {
@@ -71,154 +442,623 @@ static void load_shader(UsableAsset *asset, FILE *file) {
     }
 }
 
-static void load_model(UsableAsset *asset, FILE *file) {
-    if (asset->loaded) {
-        asset->mesh.destroy();
-    }
-
+static StagedAsset stage_model(DataStream *stream) {
     struct {
         // read from file
-        u32 points_per_face;
-        u32 num_faces;
-        GFX::Mesh::Vertex *data;
+        u32 num_vertices;
+        u32 num_indices;
+        u32 index_size;
+        u32 padding;
     } model;
 
-    read(file, &model);
-    u32 num_faces = model.num_faces;
-    u32 size = num_faces * model.points_per_face;
-    model.data = new GFX::Mesh::Vertex[size];
-    read(file, model.data, size);
-    asset->mesh = GFX::Mesh::init(model.data, size);
-    delete[] model.data;
+    stream->read(&model);
+    ASSERT(model.index_size == 2 || model.index_size == 4,
+           "Invalid index size {}", model.index_size);
+    u64 vertex_bytes = sizeof(GFX::Mesh::Vertex) * model.num_vertices;
+    u64 index_bytes = model.index_size * model.num_indices;
+
+    StagedAsset staged = {};
+    staged.type = AssetType::MESH;
+    staged.num_vertices = model.num_vertices;
+    staged.num_indices = model.num_indices;
+    staged.index_size = model.index_size;
+    staged.data = stream->view<u8>(vertex_bytes + index_bytes);
+    staged.owned = !staged.data;
+    if (staged.owned) {
+        // One buffer for both, the indices follow the vertices.
+        staged.data = new u8[vertex_bytes + index_bytes];
+        stream->read((u8 *)staged.data, vertex_bytes + index_bytes);
+    } else {
+        touch_pages(staged.data, vertex_bytes + index_bytes);
+    }
+    staged.indices = (u8 *)staged.data + vertex_bytes;
+    return staged;
+}
+
+static void upload_model(UsableAsset *asset, StagedAsset *staged) {
+    if (asset->loaded) {
+        asset->mesh.destroy();
+    }
+    asset->mesh = GFX::Mesh::init((GFX::Mesh::Vertex *)staged->data,
+                                  staged->num_vertices,
+                                  staged->indices,
+                                  staged->num_indices,
+                                  staged->index_size);
+}
+
+static StagedAsset stage_skin(DataStream *stream) {
+    u32 size = 0;
+    u32 padding = 0;
+    stream->read(&size);
+    stream->read(&padding);
+
+    StagedAsset staged = {};
+    staged.type = AssetType::SKINNED;
+    staged.num_vertices = size;
+    staged.data = stream->view<GFX::Skin::Vertex>(size);
+    staged.owned = !staged.data;
+    if (staged.owned) {
+        staged.data = new GFX::Skin::Vertex[size];
+        stream->read((GFX::Skin::Vertex *)staged.data, size);
+    } else {
+        touch_pages(staged.data, sizeof(GFX::Skin::Vertex) * size);
+    }
+    return staged;
 }
 
-static void load_skin(UsableAsset *asset, FILE *file) {
+static void upload_skin(UsableAsset *asset, StagedAsset *staged) {
     if (asset->loaded) {
         asset->skin.destroy();
     }
-    i32 num_floats = 0;
-    read(file, &num_floats);
-    u32 size = (sizeof(float) * num_floats) / sizeof(GFX::Skin::Vertex);
-    GFX::Skin::Vertex *data = new GFX::Skin::Vertex[size];
-    read(file, data, size);
-    asset->skin = GFX::Skin::init(data, size);
-    delete[] data;
+    asset->skin = GFX::Skin::init((GFX::Skin::Vertex *)staged->data, staged->num_vertices);
+}
+
+static StagedAsset stage(DataStream *stream, AssetType type) {
+    switch (type) {
+    case AssetType::TEXTURE:
+        return stage_texture(stream);
+    case AssetType::MESH:
+        return stage_model(stream);
+    case AssetType::SKINNED:
+        return stage_skin(stream);
+    default:
+        UNREACHABLE("Asset type {} cannot be staged", type);
+    }
+    return {};
+}
+
+static void upload(UsableAsset *asset, StagedAsset *staged) {
+    switch (staged->type) {
+    case AssetType::TEXTURE:
+        upload_texture(asset, staged);
+        break;
+    case AssetType::MESH:
+        upload_model(asset, staged);
+        break;
+    case AssetType::SKINNED:
+        upload_skin(asset, staged);
+        break;
+    default:
+        UNREACHABLE("Asset type {} cannot be uploaded", staged->type);
+    }
 }
 
-static void load_skeleton(UsableAsset *asset, FILE *file) {
+// What the staged asset takes up once it's uploaded.
+static u64 staged_size(const StagedAsset *staged) {
+    switch (staged->type) {
+    case AssetType::TEXTURE:
+        return GFX::Texture::data_size(staged->width, staged->height, staged->components,
+                                       staged->num_levels, staged->num_layers);
+    case AssetType::MESH:
+        return sizeof(GFX::Mesh::Vertex) * staged->num_vertices
+               + (u64)staged->index_size * staged->num_indices;
+    case AssetType::SKINNED:
+        return sizeof(GFX::Skin::Vertex) * staged->num_vertices;
+    default:
+        UNREACHABLE("Asset type {} cannot be staged", staged->type);
+    }
+    return 0;
+}
+
+static void free_staged(StagedAsset *staged) {
+    // Taken by the texture if it was uploaded.
+    delete[] staged->layers;
+    staged->layers = nullptr;
+    if (staged->file) release_file(staged->file);
+    staged->file = nullptr;
+    if (!staged->owned) return;
+    switch (staged->type) {
+    case AssetType::TEXTURE:
+        delete[] (u8 *)staged->data;
+        break;
+    case AssetType::MESH:
+        delete[] (u8 *)staged->data;
+        break;
+    case AssetType::SKINNED:
+        delete[] (GFX::Skin::Vertex *)staged->data;
+        break;
+    default:
+        UNREACHABLE("Asset type {} cannot be staged", staged->type);
+    }
+    staged->data = nullptr;
+}
+
+// Only the assets that are uploaded to the GPU are
+// worth streaming, the rest are cheap to load.
+static bool is_streamed(AssetType type) {
+    return type == AssetType::TEXTURE
+           || type == AssetType::MESH
+           || type == AssetType::SKINNED;
+}
+
+static void load_skeleton(UsableAsset *asset, DataStream *stream) {
     if (asset->loaded) {
         asset->skeleton.destroy();
     }
 
     i32 num_bones = 0;
-    read(file, &num_bones);
+    stream->read(&num_bones);
     GFX::Bone *bones = new GFX::Bone[num_bones];
-    read(file, bones, num_bones);
+    stream->read(bones, num_bones);
     // Takes ownership of the bones passed in.
     asset->skeleton = GFX::Skeleton::init(bones, num_bones);
 }
 
-static void load_animation(UsableAsset *asset, FILE *file) {
+static void load_animation(UsableAsset *asset, DataStream *stream) {
     if (asset->loaded) {
         asset->animation.destroy();
     }
 
     i32 num_frames, trans_per_frame;
-    read(file, &num_frames);
-    read(file, &trans_per_frame);
+    stream->read(&num_frames);
+    stream->read(&trans_per_frame);
 
     i32 *times = new i32[num_frames];
-    read(file, times, num_frames);
+    stream->read(times, num_frames);
 
     GFX::Transform *trans = new GFX::Transform[trans_per_frame * num_frames];
-    read(file, trans, trans_per_frame * num_frames);
+    stream->read(trans, trans_per_frame * num_frames);
     // Ownership is passed to the animation for all pointers.
     asset->animation = GFX::Animation::init(times, num_frames, trans, trans_per_frame);
 }
 
-static void load_level(UsableAsset *asset, FILE *file) {
-    if (asset->loaded) {
+// Frees the CPU-side data of the simple asset types,
+// views into the mapped file are left alone.
+static void free_data(UsableAsset *asset) {
+    if (!asset->loaded || asset->is_view) return;
+    switch (asset->header->type) {
+    case AssetType::STRING:
+        delete[] asset->string.data;
+        break;
+    case AssetType::LEVEL:
         delete[] asset->level.data;
+        break;
+    default:
+        break;
+    }
+}
+
+static void load_string(UsableAsset *asset, DataStream *stream) {
+    free_data(asset);
+
+    stream->read(&asset->string);
+    u32 size = asset->string.size;
+    asset->string.data = stream->view<char>(size);
+    asset->is_view = asset->string.data;
+    if (!asset->is_view) {
+        asset->string.data = new char[size];
+        stream->read<char>(asset->string.data, size);
+    }
+}
+
+// A sound that is already loaded is unloaded first, see
+// unload_asset.
+static void load_sound(UsableAsset *asset, DataStream *stream) {
+    stream->read(&asset->sound);
+    u64 size = asset->sound.size();
+    asset->sound.data = stream->view<u8>(size);
+    asset->is_view = asset->sound.data;
+    if (!asset->is_view) {
+        asset->sound.data = new u8[size];
+        stream->read<u8>(asset->sound.data, size);
+    }
+}
+
+static void load_level(UsableAsset *asset, DataStream *stream) {
+    free_data(asset);
+
+    Level level;
+    stream->read(&level);
+    // The assets come right after the records.
+    u64 size = level.size + sizeof(AssetID) * level.num_assets;
+    level.data = stream->view<u8>(size);
+    asset->is_view = level.data;
+    if (!asset->is_view) {
+        level.data = new u8[size];
+        stream->read<u8>(level.data, size);
+    }
+    level.assets = (AssetID *)(level.data + level.size);
+    asset->level = level;
+}
+
+// What the asset holds in RAM, views into the mapped file are free.
+static u64 cpu_size(UsableAsset *asset) {
+    switch (asset->header->type) {
+    case AssetType::STRING:
+        return asset->is_view ? 0 : asset->string.size;
+    case AssetType::LEVEL:
+        return asset->is_view ? 0 : asset->level.size + sizeof(AssetID) * asset->level.num_assets;
+    case AssetType::SOUND:
+        return asset->is_view ? 0 : asset->sound.size();
+    case AssetType::SKELETON:
+        return sizeof(GFX::Bone) * asset->skeleton.num_bones;
+    case AssetType::ANIMATION:
+        return (sizeof(i32) + sizeof(GFX::Animation::Frame)
+                + sizeof(GFX::Transform) * asset->animation.trans_per_frame)
+               * asset->animation.num_frames;
+    default:
+        return 0;
+    }
+}
+
+// Has to be called with the asset lock held, whenever
+// an asset is loaded or unloaded.
+static void set_resident(System *system, UsableAsset *asset, u64 cpu, u64 gpu) {
+    system->cpu_resident += cpu - asset->cpu_size;
+    system->gpu_resident += gpu - asset->gpu_size;
+    asset->cpu_size = cpu;
+    asset->gpu_size = gpu;
+}
+
+// Frees what the asset holds, before it's removed or loaded as
+// another type. Sounds might still be playing, so they are
+// retired instead, see free_retired_sounds.
+static void unload_asset(UsableAsset *asset) {
+    if (!asset->loaded) return;
+    System *system = &GAMESTATE()->asset_system;
+    switch (asset->header->type) {
+    case AssetType::TEXTURE:
+        asset->texture.destroy();
+        break;
+    case AssetType::MESH:
+        asset->mesh.destroy();
+        break;
+    case AssetType::SKINNED:
+        asset->skin.destroy();
+        break;
+    case AssetType::SHADER:
+        asset->shader.destroy();
+        break;
+    case AssetType::SKELETON:
+        asset->skeleton.destroy();
+        break;
+    case AssetType::ANIMATION:
+        asset->animation.destroy();
+        break;
+    case AssetType::STRING:
+    case AssetType::LEVEL:
+        free_data(asset);
+        break;
+    case AssetType::SOUND:
+        // Still resident until it's freed.
+        system->retired_sounds.push_back({ asset->sound.data, asset->cpu_size, asset->view_file });
+        system->cpu_resident += asset->cpu_size;
+        asset->view_file = nullptr;
+        break;
+    default:
+        break;
     }
+    if (asset->view_file) release_file(asset->view_file);
+    asset->view_file = nullptr;
+    asset->loaded = false;
+    set_resident(system, asset, 0, 0);
+}
 
-    Level source;
-    read(file, &source);
-    source.data = new char[source.size];
-    read<char>(file, source.data, source.size);
-    TRACE("SOURCE: \n{}", source.data);
-    asset->level = source;
+// Finds the data of the asset in the pack.
+static StreamRequest locate(const Pack *pack, AssetID id, AssetHeader *header) {
+    StreamRequest request = {};
+    request.id = id;
+    request.type = header->type;
+    request.flags = header->flags;
+    request.data_hash = header->data_hash;
+    request.file = acquire_file(pack->file);
+    request.offset = pack->file_header.data_offset + header->data_offset;
+    request.size = header->data_size;
+    if (request.file->mapped) {
+        ASSERT(request.offset + request.size <= request.file->mapped_size,
+               "Asset {} is outside of the mapped file", header->name);
+    }
+    return request;
 }
 
-static void load_asset(UsableAsset *asset) {
+// Opens a stream at the start of the data of the asset,
+// the stream has to be closed by the caller. Reads from the
+// file if it's passed in, instead of opening it again.
+static DataStream open_stream(const StreamRequest *request, FILE *file = nullptr) {
+    DataStream stream = {};
+    if (request->file->mapped) {
+        stream.cursor = request->file->mapped + request->offset;
+    } else {
+        stream.borrowed_file = file;
+        stream.file = file ? file : fopen(request->file->path, "rb");
+        CHECK(stream.file, "Failed to open asset file {}", request->file->path);
+        fseek(stream.file, request->offset, SEEK_SET);
+    }
+
+    if (request->flags & FLAG_COMPRESSED) {
+        struct {
+            // read from file
+            u64 raw_size;
+            u32 block_size;
+            u32 num_blocks;
+        } compression;
+        stream.read_raw(&compression, sizeof(compression));
+        ASSERT(compression.block_size <= MAX_COMPRESSED_BLOCK,
+               "Invalid compressed block size {}", compression.block_size);
+        stream.compressed = true;
+        stream.raw_left = compression.raw_size;
+        stream.block_size = compression.block_size;
+        stream.blocks_left = compression.num_blocks;
+        if (stream.file) stream.packed = new u8[COMPRESSED_BLOCK_BOUND];
+    }
+    return stream;
+}
+
+static f32 ms_since(u64 start) {
+    return (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+// The file is the pack of the asset if it's passed in,
+// so a batch of assets can be read without reopening it.
+static void load_asset(UsableAsset *asset, FILE *file = nullptr) {
 #ifndef TESTS
     ASSERT(GAMESTATE()->main_thread == SDL_GetThreadID(NULL), "Should only be called from main thread");
 #endif
 
-    FILE *file = fopen(GAMESTATE()->asset_system.asset_path, "rb");
-    defer { fclose(file); };
-    fseek(file, GAMESTATE()->asset_system.file_header.data_offset + asset->header->data_offset, SEEK_SET);
+    System *system = &GAMESTATE()->asset_system;
+    const u64 start = SDL_GetPerformanceCounter();
+    f32 upload_ms = 0.0;
+    StreamRequest request = locate(asset->pack, AssetID(asset->header->name_hash), asset->header);
+    defer { release_file(request.file); };
+    DataStream stream = open_stream(&request, file);
+    defer { stream.close(); };
+
+    u64 gpu_size = 0;
     switch (asset->header->type) {
-    case AssetType::TEXTURE: {
-        load_texture(asset, file);
+    case AssetType::TEXTURE:
+    case AssetType::MESH:
+    case AssetType::SKINNED: {
+        StagedAsset staged = stage(&stream, asset->header->type);
+        const u64 upload_start = SDL_GetPerformanceCounter();
+        upload(asset, &staged);
+        upload_ms = ms_since(upload_start);
+        gpu_size = staged_size(&staged);
+        free_staged(&staged);
     } break;
     case AssetType::STRING: {
-        read(file, &asset->string);
-        u32 size = asset->string.size;
-        asset->string.data = new char[size];
-        read<char>(file, asset->string.data, size);
-    } break;
-    case AssetType::MESH: {
-        load_model(asset, file);
+        load_string(asset, &stream);
     } break;
     case AssetType::SHADER: {
-        load_shader(asset, file);
+        load_shader(asset, &stream);
     } break;
     case AssetType::SOUND: {
-        // TODO(ed): If you unload, make sure there aren't race conditions with
-        // the audio thread. :*
-        read(file, &asset->sound);
-        u32 size = asset->sound.num_samples;
-        asset->sound.data = new f32[size];
-        read<f32>(file, asset->sound.data, size);
-    } break;
-    case AssetType::SKINNED: {
-        load_skin(asset, file);
+        unload_asset(asset);
+        load_sound(asset, &stream);
     } break;
     case AssetType::SKELETON: {
-        load_skeleton(asset, file);
+        load_skeleton(asset, &stream);
     } break;
     case AssetType::ANIMATION: {
-        load_animation(asset, file);
+        load_animation(asset, &stream);
     } break;
     case AssetType::LEVEL: {
-        load_level(asset, file);
+        load_level(asset, &stream);
     } break;
     default:
         ERR("Unknown asset type {} in asset file {}",
-            asset->header->type, GAMESTATE()->asset_system.asset_path);
+            asset->header->type, asset->pack->file->path);
         break;
     }
+    if (asset->view_file) release_file(asset->view_file);
+    asset->view_file = asset->is_view ? acquire_file(request.file) : nullptr;
 
     asset->loaded = true;
     asset->dirty = false;
+    set_resident(system, asset, cpu_size(asset), gpu_size);
+    asset->stats.loads++;
+    asset->stats.bytes_read += asset->header->data_size;
+    asset->stats.decode_ms += ms_since(start) - upload_ms;
+    asset->stats.upload_ms += upload_ms;
+}
+
+// Has to be called with the asset lock held.
+static void queue_request(System *system, UsableAsset *asset, AssetID id) {
+    if (asset->pending) return;
+    asset->pending = true;
+    StreamingQueue *queue = system->streaming;
+    ASSERT(SDL_LockMutex(queue->lock) == 0, "Failed to lock streaming queue");
+    queue->requests.push_back(locate(asset->pack, id, asset->header));
+    SDL_CondSignal(queue->requests_signal);
+    SDL_UnlockMutex(queue->lock);
+}
+
+static int streaming_worker(void *data) {
+    StreamingQueue *queue = (StreamingQueue *)data;
+    for (;;) {
+        ASSERT(SDL_LockMutex(queue->lock) == 0, "Failed to lock streaming queue");
+        while (queue->running && queue->requests.empty()) {
+            SDL_CondWait(queue->requests_signal, queue->lock);
+        }
+        if (!queue->running) {
+            SDL_UnlockMutex(queue->lock);
+            return 0;
+        }
+        StreamRequest request = queue->requests.front();
+        queue->requests.pop_front();
+        SDL_UnlockMutex(queue->lock);
+
+        const u64 start = SDL_GetPerformanceCounter();
+        DataStream stream = open_stream(&request);
+        StagedAsset staged = stage(&stream, request.type);
+        staged.id = request.id;
+        staged.data_hash = request.data_hash;
+        // The data might be a view, so the reference is passed on.
+        staged.file = request.file;
+        stream.close();
+        staged.bytes_read = request.size;
+        staged.decode_ms = ms_since(start);
+
+        ASSERT(SDL_LockMutex(queue->lock) == 0, "Failed to lock streaming queue");
+        while (queue->running && queue->uploads.size() >= UPLOAD_QUEUE_SIZE) {
+            SDL_CondWait(queue->uploads_signal, queue->lock);
+        }
+        if (!queue->running) {
+            SDL_UnlockMutex(queue->lock);
+            free_staged(&staged);
+            return 0;
+        }
+        queue->uploads.push_back(staged);
+        SDL_UnlockMutex(queue->lock);
+    }
+}
+
+void start_streaming(u32 num_workers) {
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(!system->streaming, "Asset streaming is already running");
+    ASSERT(num_workers > 0 && num_workers <= MAX_STREAMING_WORKERS,
+           "Invalid number of streaming workers {}", num_workers);
+
+    StreamingQueue *queue = new StreamingQueue();
+    queue->lock = SDL_CreateMutex();
+    queue->requests_signal = SDL_CreateCond();
+    queue->uploads_signal = SDL_CreateCond();
+    queue->running = true;
+    queue->num_workers = num_workers;
+    for (u32 i = 0; i < num_workers; i++) {
+        queue->workers[i] = SDL_CreateThread(streaming_worker, "AssetStreaming", queue);
+        ASSERT(queue->workers[i], "Failed to start streaming worker: {}", SDL_GetError());
+    }
+    system->streaming = queue;
+}
+
+void stop_streaming() {
+    System *system = &GAMESTATE()->asset_system;
+    StreamingQueue *queue = system->streaming;
+    if (!queue) return;
+
+    ASSERT(SDL_LockMutex(queue->lock) == 0, "Failed to lock streaming queue");
+    queue->running = false;
+    SDL_CondBroadcast(queue->requests_signal);
+    SDL_CondBroadcast(queue->uploads_signal);
+    SDL_UnlockMutex(queue->lock);
+
+    for (u32 i = 0; i < queue->num_workers; i++) {
+        SDL_WaitThread(queue->workers[i], NULL);
+    }
+    for (StagedAsset &staged : queue->uploads) {
+        free_staged(&staged);
+    }
+    for (StreamRequest &request : queue->requests) {
+        release_file(request.file);
+    }
+    SDL_DestroyCond(queue->requests_signal);
+    SDL_DestroyCond(queue->uploads_signal);
+    SDL_DestroyMutex(queue->lock);
+    delete queue;
+    system->streaming = nullptr;
+
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
+    AssetTable *table = system->table;
+    for (u32 index = 0; index < table->num_slots; index++) {
+        table->at(index)->asset.pending = false;
+    }
+    SDL_UnlockMutex(system->asset_lock);
+}
+
+void upload_streamed(f32 budget_ms) {
+#ifndef TESTS
+    ASSERT(GAMESTATE()->main_thread == SDL_GetThreadID(NULL), "Should only be called from main thread");
+#endif
+    System *system = &GAMESTATE()->asset_system;
+    StreamingQueue *queue = system->streaming;
+    if (!queue) return;
+
+    const u64 start = SDL_GetPerformanceCounter();
+    const u64 budget = (u64)(budget_ms * SDL_GetPerformanceFrequency() / 1000.0);
+    // Always upload at least one asset, so something happens
+    // even if the budget is tiny.
+    do {
+        ASSERT(SDL_LockMutex(queue->lock) == 0, "Failed to lock streaming queue");
+        if (queue->uploads.empty()) {
+            SDL_UnlockMutex(queue->lock);
+            break;
+        }
+        StagedAsset staged = queue->uploads.front();
+        queue->uploads.pop_front();
+        SDL_CondSignal(queue->uploads_signal);
+        SDL_UnlockMutex(queue->lock);
+
+        ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
+        // Dropped if the asset was removed or changed by a reload
+        // while it was streaming in, the next fetch asks again.
+        if (is_valid(staged.id) && find(staged.id)->header->data_hash == staged.data_hash) {
+            UsableAsset *asset = find(staged.id);
+            const u64 upload_start = SDL_GetPerformanceCounter();
+            upload(asset, &staged);
+            asset->loaded = true;
+            asset->dirty = false;
+            asset->pending = false;
+            set_resident(system, asset, 0, staged_size(&staged));
+            asset->stats.loads++;
+            asset->stats.bytes_read += staged.bytes_read;
+            asset->stats.decode_ms += staged.decode_ms;
+            asset->stats.upload_ms += ms_since(upload_start);
+            update_ready(asset);
+        }
+        SDL_UnlockMutex(system->asset_lock);
+        free_staged(&staged);
+    } while (SDL_GetPerformanceCounter() - start < budget);
 }
 
 static UsableAsset *_raw_fetch(AssetType type, AssetID id) {
-    ASSERT(SDL_LockMutex(GAMESTATE()->asset_system.asset_lock) == 0, "Failed to aquire lock");
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to aquire lock");
     ASSERT(is_valid(id), "Invalid asset id '{}'", id);
-    UsableAsset *asset = &GAMESTATE()->asset_system.assets[id];
+    UsableAsset *asset = find(id);
     ASSERT(asset->header->type == type, "Type mismatch, type={}, id={}", type, id);
+    AssetTable *table = system->table;
+    table->at(asset->slot)->last_used.store(table->frame.load(std::memory_order_relaxed),
+                                            std::memory_order_relaxed);
 
     if ((!asset->loaded) || asset->dirty) {
-        load_asset(asset);
+        if (system->streaming && is_streamed(type)) {
+            queue_request(system, asset, id);
+        } else {
+            load_asset(asset);
+            update_ready(asset);
+        }
     }
 
-    SDL_UnlockMutex(GAMESTATE()->asset_system.asset_lock);
+    SDL_UnlockMutex(system->asset_lock);
     return asset;
 }
 
+// Created lazily, since it has to happen on the main thread.
+static void init_placeholders(System *system) {
+    if (system->has_placeholders) return;
+    u8 white[] = { 255, 255, 255, 255 };
+    system->placeholder_texture = GFX::Texture::upload(1, 1, 4, 1, 1, white, GFX::Texture::Sampling::NEAREST);
+    system->placeholder_mesh = {};
+    system->placeholder_skin = {};
+    system->has_placeholders = true;
+}
+
 GFX::Texture *fetch_texture(AssetID id) {
-    return &_raw_fetch(AssetType::TEXTURE, id)->texture;
+    UsableAsset *asset = _raw_fetch(AssetType::TEXTURE, id);
+    if (asset->loaded) return &asset->texture;
+    System *system = &GAMESTATE()->asset_system;
+    init_placeholders(system);
+    return &system->placeholder_texture;
 }
 
 StringAsset *fetch_string_asset(AssetID id) {
@@ -230,11 +1070,19 @@ GFX::Shader *fetch_shader(AssetID id) {
 }
 
 GFX::Mesh *fetch_mesh(AssetID id) {
-    return &_raw_fetch(AssetType::MESH, id)->mesh;
+    UsableAsset *asset = _raw_fetch(AssetType::MESH, id);
+    if (asset->loaded) return &asset->mesh;
+    System *system = &GAMESTATE()->asset_system;
+    init_placeholders(system);
+    return &system->placeholder_mesh;
 }
 
 GFX::Skin *fetch_skin(AssetID id) {
-    return &_raw_fetch(AssetType::SKINNED, id)->skin;
+    UsableAsset *asset = _raw_fetch(AssetType::SKINNED, id);
+    if (asset->loaded) return &asset->skin;
+    System *system = &GAMESTATE()->asset_system;
+    init_placeholders(system);
+    return &system->placeholder_skin;
 }
 
 GFX::Skeleton *fetch_skeleton(AssetID id) {
@@ -253,97 +1101,678 @@ Level *fetch_level(AssetID id) {
     return &_raw_fetch(AssetType::LEVEL, id)->level;
 }
 
+AssetHandle resolve(AssetID id) {
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to aquire lock");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+    u32 index = find(id)->slot;
+    return { id, index, system->table->at(index)->generation.load(std::memory_order_acquire) };
+}
+
+// Returns nullptr if the handle is stale or the asset isn't
+// ready, the caller then takes the slow path.
+static UsableAsset *_fast_fetch(AssetType type, AssetHandle handle) {
+    AssetTable *table = GAMESTATE()->asset_system.table;
+    if (handle.index >= table->num_slots.load(std::memory_order_acquire)) return nullptr;
+    AssetSlot *slot = table->at(handle.index);
+    if (!slot->ready.load(std::memory_order_acquire)) return nullptr;
+    if (slot->generation.load(std::memory_order_acquire) != handle.generation) return nullptr;
+    ASSERT(slot->type == type, "Type mismatch, type={}, id={}", type, handle.id);
+    slot->last_used.store(table->frame.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return &slot->asset;
+}
+
+GFX::Texture *fetch_texture(AssetHandle handle) {
+    if (UsableAsset *asset = _fast_fetch(AssetType::TEXTURE, handle)) return &asset->texture;
+    return fetch_texture(handle.id);
+}
+
+StringAsset *fetch_string_asset(AssetHandle handle) {
+    if (UsableAsset *asset = _fast_fetch(AssetType::STRING, handle)) return &asset->string;
+    return fetch_string_asset(handle.id);
+}
+
+GFX::Shader *fetch_shader(AssetHandle handle) {
+    if (UsableAsset *asset = _fast_fetch(AssetType::SHADER, handle)) return &asset->shader;
+    return fetch_shader(handle.id);
+}
+
+GFX::Mesh *fetch_mesh(AssetHandle handle) {
+    if (UsableAsset *asset = _fast_fetch(AssetType::MESH, handle)) return &asset->mesh;
+    return fetch_mesh(handle.id);
+}
+
+GFX::Skin *fetch_skin(AssetHandle handle) {
+    if (UsableAsset *asset = _fast_fetch(AssetType::SKINNED, handle)) return &asset->skin;
+    return fetch_skin(handle.id);
+}
+
+GFX::Skeleton *fetch_skeleton(AssetHandle handle) {
+    if (UsableAsset *asset = _fast_fetch(AssetType::SKELETON, handle)) return &asset->skeleton;
+    return fetch_skeleton(handle.id);
+}
+
+GFX::Animation *fetch_animation(AssetHandle handle) {
+    if (UsableAsset *asset = _fast_fetch(AssetType::ANIMATION, handle)) return &asset->animation;
+    return fetch_animation(handle.id);
+}
+
+Sound *fetch_sound(AssetHandle handle) {
+    if (UsableAsset *asset = _fast_fetch(AssetType::SOUND, handle)) return &asset->sound;
+    return fetch_sound(handle.id);
+}
+
+Level *fetch_level(AssetHandle handle) {
+    if (UsableAsset *asset = _fast_fetch(AssetType::LEVEL, handle)) return &asset->level;
+    return fetch_level(handle.id);
+}
+
 bool needs_reload(AssetID id) {
-    ASSERT(is_valid(id), "Invalid asset id '{}'", id);
-    UsableAsset *asset = &GAMESTATE()->asset_system.assets[id];
+    UsableAsset *asset = find(id);
     return (!asset->loaded) || asset->dirty;
 }
 
-bool reload() {
+void request(AssetID id) {
+    _raw_fetch(find(id)->header->type, id);
+}
+
+bool is_ready(AssetID id) {
     System *system = &GAMESTATE()->asset_system;
-    FILE *file = fopen(system->asset_path, "rb");
-    if (!file) return false;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to aquire lock");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+    UsableAsset *asset = find(id);
+    return asset->loaded && !asset->dirty;
+}
+
+u32 prefetch(const AssetID *ids, u32 num_ids) {
+#ifndef TESTS
+    ASSERT(GAMESTATE()->main_thread == SDL_GetThreadID(NULL), "Should only be called from main thread");
+#endif
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to aquire lock");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+
+    AssetTable *table = system->table;
+    const u64 frame = table->frame.load(std::memory_order_relaxed);
+    table->prefetched.clear();
+    std::vector<UsableAsset *> reads;
+    for (u32 i = 0; i < num_ids; i++) {
+        if (!is_valid(ids[i])) {
+            WARN("Can't prefetch asset {}, it's not in any pack", ids[i]);
+            continue;
+        }
+        UsableAsset *asset = find(ids[i]);
+        if (asset->header->type == AssetType::SOUND && (asset->header->flags & FLAG_STREAMED)) continue;
+        if (std::find(table->prefetched.begin(), table->prefetched.end(), ids[i]) != table->prefetched.end()) continue;
+        table->prefetched.push_back(ids[i]);
+        table->at(asset->slot)->last_used.store(frame, std::memory_order_relaxed);
+        if ((asset->loaded && !asset->dirty) || asset->pending) continue;
+        reads.push_back(asset);
+    }
+
+    std::sort(reads.begin(), reads.end(), [](UsableAsset *a, UsableAsset *b) {
+        if (a->pack != b->pack) return a->pack->id < b->pack->id;
+        return a->header->data_offset < b->header->data_offset;
+    });
+
+    FILE *file = nullptr;
+    Pack *file_pack = nullptr;
+    defer {
+        if (file) fclose(file);
+    };
+    for (UsableAsset *asset : reads) {
+        AssetID id(asset->header->name_hash);
+        if (system->streaming && is_streamed(asset->header->type)) {
+            queue_request(system, asset, id);
+            continue;
+        }
+        if (asset->pack->mode == LoadMode::STREAM && asset->pack != file_pack) {
+            if (file) fclose(file);
+            file = fopen(asset->pack->file->path, "rb");
+            CHECK(file, "Failed to open asset file {}", asset->pack->file->path);
+            file_pack = asset->pack;
+        }
+        load_asset(asset, asset->pack == file_pack ? file : nullptr);
+        update_ready(asset);
+    }
+    return reads.size();
+}
+
+PrefetchProgress prefetch_progress() {
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to aquire lock");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+    PrefetchProgress progress = { 0, (u32)system->table->prefetched.size() };
+    for (AssetID id : system->table->prefetched) {
+        if (!is_valid(id)) {
+            // Unmounted since.
+            progress.total--;
+            continue;
+        }
+        UsableAsset *asset = find(id);
+        progress.ready += asset->loaded && !asset->dirty;
+    }
+    return progress;
+}
+
+bool open_sound_reader(AssetID id, SoundReader *reader) {
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to aquire lock");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+    UsableAsset *asset = find(id);
+    AssetHeader *header = asset->header;
+    CHECK(header->type == AssetType::SOUND, "Asset {} is not a sound", header->name);
+    if (!(header->flags & FLAG_STREAMED)) return false;
+    CHECK(!(header->flags & FLAG_COMPRESSED), "Streamed sound {} is compressed", header->name);
+
+    StreamRequest request = locate(asset->pack, id, header);
+    *reader = {};
+    // Keeps the reference until the reader is closed.
+    reader->pack_file = request.file;
+    reader->offset = request.offset + sizeof(Sound);
+    if (reader->pack_file->mapped) {
+        std::memcpy(&reader->sound, reader->pack_file->mapped + request.offset, sizeof(Sound));
+    } else {
+        reader->file = fopen(request.file->path, "rb");
+        CHECK(reader->file, "Failed to open asset file {}", request.file->path);
+        fseek(reader->file, request.offset, SEEK_SET);
+        read(reader->file, &reader->sound);
+    }
+    reader->sound.data = nullptr;
+    ASSERT(sizeof(Sound) + reader->sound.size() <= request.size, "Sound {} is larger than its data", header->name);
+    return true;
+}
+
+void read_sound(SoundReader *reader, u64 offset, u8 *dst, u64 size) {
+    ASSERT(offset + size <= reader->sound.size(), "Reading past the end of a sound");
+    if (reader->pack_file->mapped) {
+        std::memcpy(dst, reader->pack_file->mapped + reader->offset + offset, size);
+    } else {
+        fseek(reader->file, reader->offset + offset, SEEK_SET);
+        read(reader->file, dst, size);
+    }
+}
+
+void close_sound_reader(SoundReader *reader) {
+    if (reader->file) fclose(reader->file);
+    if (reader->pack_file) release_file(reader->pack_file);
+    *reader = {};
+}
 
+// What read_pack reads from an asset file, before it's
+// handed to the pack.
+struct PackTables {
     FileHeader file_header;
-    read(file, &file_header, 1);
-    u64 num_assets = file_header.num_assets;
+    AssetHeader *headers;
+    IndexEntry *index;
+    char *names;
+    // With one reference, for the pack.
+    PackFile *file;
+};
+
+// Reads the file header, the asset headers and the names from the
+// asset file. When the pack is mapped, the file is mapped here
+// and the names point straight into it. No pack is changed, see
+// use_pack_tables.
+static bool read_pack(const char *path, LoadMode mode, PackTables *tables) {
+    FileHeader *file_header = &tables->file_header;
+    *tables = {};
+    u8 *mapped = nullptr;
+    u64 mapped_size = 0;
+    if (mode == LoadMode::MAPPED) {
+        mapped = map_file(path, &mapped_size);
+        if (!mapped) return false;
+
+        std::memcpy(file_header, mapped, sizeof(FileHeader));
+        tables->headers = new AssetHeader[file_header->num_assets];
+        std::memcpy(tables->headers, mapped + file_header->header_offset, sizeof(AssetHeader) * file_header->num_assets);
+        tables->index = (IndexEntry *)(mapped + file_header->index_offset);
+        tables->names = (char *)(mapped + file_header->name_offset);
+    } else {
+        FILE *file = fopen(path, "rb");
+        if (!file) return false;
+        defer { fclose(file); };
+
+        read(file, file_header);
+        tables->headers = new AssetHeader[file_header->num_assets];
+        fseek(file, file_header->header_offset, SEEK_SET);
+        read(file, tables->headers, file_header->num_assets);
+
+        tables->index = new IndexEntry[file_header->index_capacity];
+        fseek(file, file_header->index_offset, SEEK_SET);
+        read(file, tables->index, file_header->index_capacity);
+
+        u64 names_size = file_header->data_offset - file_header->name_offset;
+        tables->names = new char[names_size];
+        fseek(file, file_header->name_offset, SEEK_SET);
+        read(file, tables->names, names_size);
+    }
 
-    AssetHeader *headers = new AssetHeader[num_assets];
-    read(file, headers, num_assets);
+    ASSERT(std::has_single_bit(file_header->index_capacity),
+           "The index capacity has to be a power of two");
+    for (u64 slot = 0; slot < file_header->num_assets; slot++) {
+        tables->headers[slot].name = tables->names + tables->headers[slot].name_offset;
+    }
 
-    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
-    system->file_header = file_header;
-    for (u64 slot = 0; slot < num_assets; slot++) {
-        AssetHeader *header = headers + slot;
-        AssetID id(header->name_hash);
-        if (system->assets.contains(id)) {
-            // Old asset
-            UsableAsset &asset = system->assets[id];
-            asset.dirty = asset.header->data_hash != header->data_hash;
-            asset.dirty = true;
-            delete[] asset.header->name;
-            asset.header = header;
-            asset.header->name = new char[asset.header->name_size];
+    char *path_copy = new char[std::strlen(path) + 1];
+    std::strcpy(path_copy, path);
+    tables->file = new PackFile();
+    tables->file->path = path_copy;
+    tables->file->mapped = mapped;
+    tables->file->mapped_size = mapped_size;
+    SDL_AtomicSet(&tables->file->references, 1);
+    return true;
+}
 
-            fseek(file, file_header.name_offset + asset.header->name_offset, SEEK_SET);
-            read(file, asset.header->name, asset.header->name_size);
-        } else {
-            // New asset
-            UsableAsset data = {};
-            data.header = header;
-            data.header->name = new char[data.header->name_size];
-            data.dirty = true;
-            system->assets[id] = data;
-
-            fseek(file, file_header.name_offset + data.header->name_offset, SEEK_SET);
-            read(file, data.header->name, data.header->name_size);
-        }
+// Frees what read_pack allocated, the index and the names
+// point into the file when it's mapped. The file itself is
+// released by the caller, assets might still point into it.
+static void free_pack_tables(LoadMode mode, const PackTables &tables) {
+    delete[] tables.headers;
+    if (mode == LoadMode::STREAM) {
+        delete[] tables.index;
+        delete[] tables.names;
     }
-    delete[] system->headers;
-    system->headers = headers;
+}
+
+// The tables the pack uses now, so they can be freed.
+static PackTables pack_tables(const Pack *pack) {
+    return { pack->file_header, pack->headers, pack->index, pack->names, pack->file };
+}
+
+// Points the pack at tables from read_pack, and releases the old
+// file. It stays open while loaded assets point into it.
+static void use_pack_tables(Pack *pack, const PackTables &tables) {
+    if (pack->file) release_file(pack->file);
+    pack->file_header = tables.file_header;
+    pack->headers = tables.headers;
+    pack->index = tables.index;
+    pack->names = tables.names;
+    pack->file = tables.file;
+    pack->num_assets = tables.file_header.num_assets;
+}
 
-    fclose(file);
 
-    for (auto it = system->assets.cbegin(), next = it; it != system->assets.cend(); it = next) {
-        ++next;
-        if (headers > it->second.header && it->second.header >= (headers + num_assets)) {
-            delete[] it->second.header->name;
-            system->assets.erase(it);
+// Frees the retired sounds that no audio source plays. Takes
+// the locks one at a time, since the audio system fetches
+// sounds with the audio lock held.
+static void free_retired_sounds(System *system) {
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
+    std::vector<RetiredSound> retired;
+    retired.swap(system->retired_sounds);
+    SDL_UnlockMutex(system->asset_lock);
+    if (retired.empty()) return;
+
+    Audio::AudioStruct *audio = GAMESTATE()->audio_struct;
+    u64 freed = 0;
+    std::vector<RetiredSound> playing;
+    for (RetiredSound &sound : retired) {
+        if (audio && audio->is_playing(sound.data)) {
+            playing.push_back(sound);
+            continue;
+        }
+        if (sound.file) {
+            release_file(sound.file);
+        } else {
+            delete[] sound.data;
         }
+        freed += sound.cpu_size;
     }
+
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
+    system->cpu_resident -= freed;
+    system->retired_sounds.insert(system->retired_sounds.end(), playing.begin(), playing.end());
     SDL_UnlockMutex(system->asset_lock);
+}
+
+void set_budget(u64 cpu_bytes, u64 gpu_bytes) {
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+    system->cpu_budget = cpu_bytes;
+    system->gpu_budget = gpu_bytes;
+}
+
+u32 enforce_budget() {
+#ifndef TESTS
+    ASSERT(GAMESTATE()->main_thread == SDL_GetThreadID(NULL), "Should only be called from main thread");
+#endif
+    System *system = &GAMESTATE()->asset_system;
+    free_retired_sounds(system);
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+
+    AssetTable *table = system->table;
+    const u64 frame = table->frame.load(std::memory_order_relaxed);
+    defer { table->frame.store(frame + 1, std::memory_order_relaxed); };
+
+    auto over_cpu = [system]() { return system->cpu_budget && system->cpu_resident > system->cpu_budget; };
+    auto over_gpu = [system]() { return system->gpu_budget && system->gpu_resident > system->gpu_budget; };
+    if (!over_cpu() && !over_gpu()) return 0;
+
+    std::vector<AssetSlot *> candidates;
+    for (u32 index = 0; index < table->num_slots; index++) {
+        AssetSlot *slot = table->at(index);
+        UsableAsset *asset = &slot->asset;
+        if (!slot->used || !asset->loaded || asset->pending || asset->references) continue;
+        if (slot->type == AssetType::SOUND) continue;
+        if (slot->last_used.load(std::memory_order_relaxed) >= frame) continue;
+        candidates.push_back(slot);
+    }
+    std::sort(candidates.begin(), candidates.end(), [](AssetSlot *a, AssetSlot *b) {
+        return a->last_used.load(std::memory_order_relaxed) < b->last_used.load(std::memory_order_relaxed);
+    });
+
+    u32 evicted = 0;
+    for (AssetSlot *slot : candidates) {
+        bool cpu = over_cpu();
+        bool gpu = over_gpu();
+        if (!cpu && !gpu) break;
+        UsableAsset *asset = &slot->asset;
+        // Evicting it has to help with what's over budget.
+        if (!(cpu && asset->cpu_size) && !(gpu && asset->gpu_size)) continue;
+        TRACE("Evicted asset {}", asset->header->name);
+        unload_asset(asset);
+        update_ready(asset);
+        evicted++;
+    }
+    return evicted;
+}
+
+AssetHandle acquire(AssetID id) {
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to aquire lock");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+    UsableAsset *asset = find(id);
+    asset->references++;
+    return { id, asset->slot, system->table->at(asset->slot)->generation.load(std::memory_order_acquire) };
+}
+
+void release(AssetHandle handle) {
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to aquire lock");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+    AssetSlot *slot = lookup(system, handle.id);
+    // Removed, or removed and added again, by a reload.
+    if (!slot || slot->generation.load(std::memory_order_acquire) != handle.generation) return;
+    ASSERT(slot->asset.references, "Asset {} released more times than acquired", slot->asset.header->name);
+    slot->asset.references--;
+}
+
+std::vector<AssetReport> collect_stats() {
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to aquire lock");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+    AssetTable *table = system->table;
+    std::vector<AssetReport> reports;
+    for (u32 index = 0; index < table->num_slots; index++) {
+        AssetSlot *slot = table->at(index);
+        if (!slot->used) continue;
+        UsableAsset *asset = &slot->asset;
+        reports.push_back({
+            AssetID(asset->header->name_hash),
+            asset->header->name,
+            slot->type,
+            asset->stats,
+            asset->cpu_size,
+            asset->gpu_size,
+        });
+    }
+    return reports;
+}
 
+bool write_stats_csv(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        ERR("Failed to open {} for the asset stats", path);
+        return false;
+    }
+    defer { fclose(file); };
+
+    ftprint(file, "name,type,loads,bytes_read,decode_ms,upload_ms,cpu_bytes,gpu_bytes\n");
+    for (const AssetReport &report : collect_stats()) {
+        ftprint(file, "{},{},{},{},{},{},{},{}\n",
+                report.name,
+                asset_type_names[report.type],
+                report.stats.loads,
+                report.stats.bytes_read,
+                report.stats.decode_ms,
+                report.stats.upload_ms,
+                report.cpu_size,
+                report.gpu_size);
+    }
     return true;
 }
 
-bool load(const char *path) {
+// Points every asset at the pack with the highest priority that
+// has it, after packs are mounted, unmounted or reloaded. Assets
+// that are in no pack are removed, new ones get slots, and the
+// ones whose data changed have to be loaded again. The headers
+// the assets point at have to be kept until this is done. Has to
+// be called with the asset lock held.
+static ReloadReport resolve_packs(System *system) {
+    for (u32 i = 0; i < system->num_packs; i++) {
+        Pack *pack = system->packs[i];
+        delete[] pack->header_slots;
+        pack->header_slots = new u32[pack->num_assets];
+        std::fill_n(pack->header_slots, pack->num_assets, NO_SLOT);
+    }
+
+    ReloadReport changes;
+    AssetTable *table = system->table;
+    for (u32 index = 0; index < table->num_slots; index++) {
+        AssetSlot *slot = table->at(index);
+        if (!slot->used) continue;
+        UsableAsset &asset = slot->asset;
+        AssetID id(asset.header->name_hash);
+        Pack *pack;
+        u32 owner;
+        // Removed first, so the new assets can reuse the slots.
+        if (!find_owner(system, id, &pack, &owner)) {
+            changes.removed.push_back(id);
+            TRACE("Removed asset {}", asset.header->name);
+            unload_asset(&asset);
+            remove_slot(table, index);
+            continue;
+        }
+
+        // Old asset, only invalidated if the data changed.
+        AssetHeader *header = pack->headers + owner;
+        if (asset.header->type != header->type) {
+            unload_asset(&asset);
+            slot->type = header->type;
+            asset.dirty = true;
+            changes.changed.push_back(id);
+        } else if (asset.pack != pack) {
+            // Read from the other pack, which might be unmounted.
+            unload_asset(&asset);
+            asset.dirty = true;
+            asset.pending = false;
+            if (asset.header->data_hash != header->data_hash) changes.changed.push_back(id);
+        } else if (asset.header->data_hash != header->data_hash) {
+            asset.dirty = true;
+            // Anything in flight is for the old data.
+            asset.pending = false;
+            changes.changed.push_back(id);
+        }
+        asset.header = header;
+        asset.pack = pack;
+        update_ready(&asset);
+        pack->header_slots[owner] = index;
+    }
+
+    // In header order, so a new table has the same order as the headers.
+    for (u32 i = 0; i < system->num_packs; i++) {
+        Pack *pack = system->packs[i];
+        for (u32 header = 0; header < pack->num_assets; header++) {
+            if (pack->header_slots[header] != NO_SLOT) continue;
+            // Assets in the packs above are read from there.
+            Pack *owner;
+            u32 owner_header;
+            find_owner(system, pack->headers[header].name_hash, &owner, &owner_header);
+            if (owner != pack || owner_header != header) continue;
+            pack->header_slots[header] = add_slot(table, pack->headers + header, pack)->slot;
+            changes.added.push_back(AssetID(pack->headers[header].name_hash));
+        }
+    }
+    return changes;
+}
+
+bool reload(ReloadReport *report) {
     System *system = &GAMESTATE()->asset_system;
-    system->asset_path = path;
-    system->asset_lock = SDL_CreateMutex();
     ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
-    FILE *file = fopen(system->asset_path, "rb");
-    if (!file) return false;
+    defer { SDL_UnlockMutex(system->asset_lock); };
+
+    // Everything is read first, and the packs only take the new
+    // tables and mappings once every pack is read, so a pack that
+    // can't be read leaves all the assets as they were.
+    std::vector<PackTables> fresh(system->num_packs);
+    for (u32 i = 0; i < system->num_packs; i++) {
+        Pack *pack = system->packs[i];
+        if (read_pack(pack->file->path, pack->mode, &fresh[i])) continue;
+        ERR("Failed to reload {}", pack->file->path);
+        for (u32 j = 0; j < i; j++) {
+            free_pack_tables(system->packs[j]->mode, fresh[j]);
+            release_file(fresh[j].file);
+        }
+        return false;
+    }
+
+    // The old tables are kept until the assets point at the new ones.
+    std::vector<PackTables> old(system->num_packs);
+    for (u32 i = 0; i < system->num_packs; i++) {
+        old[i] = pack_tables(system->packs[i]);
+        // The old file isn't released here, only the tables are kept.
+        acquire_file(old[i].file);
+        use_pack_tables(system->packs[i], fresh[i]);
+    }
+    ReloadReport changes = resolve_packs(system);
+    for (u32 i = 0; i < system->num_packs; i++) {
+        free_pack_tables(system->packs[i]->mode, old[i]);
+        release_file(old[i].file);
+    }
 
-    read(file, &system->file_header, 1);
-    u64 num_assets = system->file_header.num_assets;
-    system->num_assets = num_assets;
+    for (AssetID id : changes.changed) {
+        INFO("Changed asset {}", find(id)->header->name);
+    }
+    for (AssetID id : changes.added) {
+        INFO("Added asset {}", find(id)->header->name);
+    }
+    INFO("Reloaded {} packs: {} changed, {} added, {} removed",
+         system->num_packs, changes.changed.size(), changes.added.size(), changes.removed.size());
+
+    if (report) *report = changes;
+    return true;
+}
 
-    system->headers = new AssetHeader[num_assets];
-    read(file, system->headers, num_assets);
-    fclose(file);
+// The resident sizes are left alone, shutdown leaves
+// them at what the retired sounds still take up.
+static void init(System *system) {
+    system->asset_lock = SDL_CreateMutex();
+    system->table = new AssetTable();
+    system->num_packs = 0;
+}
 
-    for (u64 slot = 0; slot < num_assets; slot++) {
-        AssetHeader header = system->headers[slot];
-        AssetID id(header.name_hash);
-        ASSERT(system->assets.contains(id) == 0, "Collision in asset system! Possibly reloading datafile.");
-        UsableAsset data = {};
-        data.header = system->headers + slot;
-        data.dirty = true;
-        data.loaded = false;
-        system->assets[id] = data;
+void shutdown() {
+    System *system = &GAMESTATE()->asset_system;
+    if (!system->table) return;
+    stop_streaming();
+
+    AssetTable *table = system->table;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
+    for (u32 index = 0; index < table->num_slots; index++) {
+        AssetSlot *slot = table->at(index);
+        if (slot->used) unload_asset(&slot->asset);
     }
     SDL_UnlockMutex(system->asset_lock);
+    // Sounds that are still playing are freed by the
+    // next enforce_budget, if the system is loaded again.
+    free_retired_sounds(system);
+
+    for (u32 i = 0; i < system->num_packs; i++) {
+        Pack *pack = system->packs[i];
+        free_pack_tables(pack->mode, pack_tables(pack));
+        delete[] pack->header_slots;
+        release_file(pack->file);
+        delete pack;
+        system->packs[i] = nullptr;
+    }
+    system->num_packs = 0;
+
+    for (u32 chunk = 0; chunk < MAX_ASSET_CHUNKS; chunk++) {
+        delete[] table->chunks[chunk];
+    }
+    delete table;
+    system->table = nullptr;
+    SDL_DestroyMutex(system->asset_lock);
+    system->asset_lock = nullptr;
+}
+
+bool load(const char *path, LoadMode mode) {
+    System *system = &GAMESTATE()->asset_system;
+    shutdown();
+    init(system);
+    return mount(path, 0, mode) != NO_PACK;
+}
+
+PackID mount(const char *path, i32 priority, LoadMode mode) {
+    System *system = &GAMESTATE()->asset_system;
+    if (!system->table) init(system);
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+    if (system->num_packs == MAX_PACKS) {
+        ERR("Can't mount {}, {} packs are already mounted", path, MAX_PACKS);
+        return NO_PACK;
+    }
+
+    PackTables tables;
+    if (!read_pack(path, mode, &tables)) {
+        ERR("Failed to mount {}", path);
+        return NO_PACK;
+    }
+    Pack *pack = new Pack();
+    pack->priority = priority;
+    pack->mode = mode;
+    use_pack_tables(pack, tables);
+    pack->id = ++system->next_pack_id;
+
+    u32 at = 0;
+    while (at < system->num_packs && system->packs[at]->priority > priority) at++;
+    for (u32 i = system->num_packs; i > at; i--) {
+        system->packs[i] = system->packs[i - 1];
+    }
+    system->packs[at] = pack;
+    system->num_packs++;
+
+    ReloadReport changes = resolve_packs(system);
+    INFO("Mounted {}: {} added, {} patched", path, changes.added.size(), changes.changed.size());
+    return pack->id;
+}
+
+bool unmount(PackID id) {
+    System *system = &GAMESTATE()->asset_system;
+    ASSERT(SDL_LockMutex(system->asset_lock) == 0, "Failed to lock asset system");
+    defer { SDL_UnlockMutex(system->asset_lock); };
+
+    u32 at = 0;
+    while (at < system->num_packs && system->packs[at]->id != id) at++;
+    if (at == system->num_packs) {
+        WARN("Tried to unmount pack {}, which isn't mounted", id);
+        return false;
+    }
+    Pack *pack = system->packs[at];
+    for (u32 i = at; i + 1 < system->num_packs; i++) {
+        system->packs[i] = system->packs[i + 1];
+    }
+    system->num_packs--;
+
+    ReloadReport changes = resolve_packs(system);
+    INFO("Unmounted {}: {} removed, {} changed", pack->file->path, changes.removed.size(), changes.changed.size());
 
+    free_pack_tables(pack->mode, pack_tables(pack));
+    delete[] pack->header_slots;
+    release_file(pack->file);
+    delete pack;
     return true;
 }
 
@@ -362,6 +1791,409 @@ TEST_CASE("asset text", {
            == 0;
 });
 
+TEST_CASE("asset index", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    Asset::Pack *pack = GAMESTATE()->asset_system.packs[0];
+    u64 capacity = pack->file_header.index_capacity;
+    for (u32 slot = 0; slot < pack->num_assets; slot++) {
+        u64 name_hash = pack->headers[slot].name_hash;
+        if (Asset::probe_index(pack->index, capacity, name_hash) != slot) return false;
+    }
+    return Asset::probe_index(pack->index, capacity, AssetID("NOT_IN_THE_PACK")) == Asset::EMPTY_INDEX_SLOT
+           && !Asset::is_valid(AssetID("NOT_IN_THE_PACK"));
+});
+
+TEST_CASE("asset text mapped", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    AssetID id("ALPHABET");
+
+    Asset::Pack *pack = GAMESTATE()->asset_system.packs[0];
+    const char *data = Asset::fetch_string_asset(id)->data;
+    ASSERT((const u8 *)data >= pack->file->mapped, "String should point into the mapped file");
+    ASSERT((const u8 *)data < pack->file->mapped + pack->file->mapped_size, "String should point into the mapped file");
+    return std::strcmp(data, "abcdefghijklmnopqrstuvwxyz") == 0;
+});
+
+TEST_CASE("asset names", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    AssetID id("TWO_BY_ONE");
+    if (!Asset::is_valid(id)) return false;
+    return std::strcmp(Asset::find(id)->header->name, "TWO_BY_ONE") == 0;
+});
+
+TEST_CASE("asset 2x1x4 png mapped", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    AssetID id("TWO_BY_ONE");
+    if (!Asset::is_valid(id)) return false;
+    GFX::Texture *image = Asset::fetch_texture(id);
+
+    return image->width == 2
+           && image->height == 1
+           && image->components == 4;
+});
+
+TEST_CASE("asset streaming", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    Asset::start_streaming();
+    defer { Asset::stop_streaming(); };
+
+    AssetID id("TWO_BY_ONE");
+    // Nothing is uploaded until the main thread asks for it.
+    GFX::Texture *placeholder = Asset::fetch_texture(id);
+    if (Asset::is_ready(id) || placeholder->width != 1) return false;
+
+    for (u32 tries = 0; !Asset::is_ready(id) && tries < 1000; tries++) {
+        SDL_Delay(1);
+        Asset::upload_streamed();
+    }
+    GFX::Texture *image = Asset::fetch_texture(id);
+    return Asset::is_ready(id)
+           && image->width == 2
+           && image->height == 1
+           && image->components == 4;
+});
+
+static const AssetID prefetch_ids[] = {
+    AssetID("TWO_BY_ONE"),
+    AssetID("ALPHABET"),
+    AssetID("SINE_SHORT"),
+    AssetID("SINE_STREAM"),
+    AssetID("ALPHABET"),
+    AssetID("NOT_IN_THE_PACK"),
+};
+
+TEST_CASE("asset prefetch", {
+    Asset::load("assets-tests.bin");
+    if (Asset::prefetch(prefetch_ids, LEN(prefetch_ids)) != 3) return false;
+    Asset::PrefetchProgress progress = Asset::prefetch_progress();
+    return progress.ready == 3
+           && progress.total == 3
+           && Asset::is_ready(AssetID("TWO_BY_ONE"))
+           && !Asset::find(AssetID("SINE_STREAM"))->loaded
+           && Asset::prefetch(prefetch_ids, LEN(prefetch_ids)) == 0;
+});
+
+static const AssetID prefetch_streaming_ids[] = {
+    AssetID("SIXTEEN_BY_SIXTEEN"),
+    AssetID("ALPHABET"),
+    AssetID("TWO_BY_ONE"),
+};
+
+TEST_CASE("asset prefetch streaming", {
+    Asset::load("assets-tests.bin");
+    Asset::start_streaming();
+    defer { Asset::stop_streaming(); };
+
+    Asset::prefetch(prefetch_streaming_ids, LEN(prefetch_streaming_ids));
+    // Only the string is loaded right away.
+    if (Asset::prefetch_progress().ready != 1) return false;
+    for (u32 tries = 0; Asset::prefetch_progress().ready != 3 && tries < 1000; tries++) {
+        SDL_Delay(1);
+        Asset::upload_streamed();
+    }
+    return Asset::prefetch_progress().ready == 3;
+});
+
+TEST_CASE("asset handle", {
+    Asset::load("assets-tests.bin");
+    AssetID id("TWO_BY_ONE");
+    AssetHandle handle = Asset::resolve(id);
+    GFX::Texture *slow = Asset::fetch_texture(handle);
+    GFX::Texture *fast = Asset::fetch_texture(handle);
+    return slow == fast
+           && fast == Asset::fetch_texture(id)
+           && fast->width == 2;
+});
+
+TEST_CASE("asset stale handle", {
+    Asset::load("assets-tests.bin");
+    AssetID id("ALPHABET");
+    AssetHandle handle = Asset::resolve(id);
+    handle.generation += 1;
+    return std::strcmp(Asset::fetch_string_asset(handle)->data,
+                       "abcdefghijklmnopqrstuvwxyz")
+           == 0;
+});
+
+TEST_CASE("asset compressed png", {
+    Asset::load("assets-tests.bin");
+    AssetID id("SIXTEEN_BY_SIXTEEN");
+    if (!Asset::is_valid(id)) return false;
+    if (!(Asset::find(id)->header->flags & Asset::FLAG_COMPRESSED)) return false;
+    GFX::Texture *image = Asset::fetch_texture(id);
+
+    return image->width == 16
+           && image->height == 16
+           && image->components == 4;
+});
+
+TEST_CASE("asset compressed data", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    AssetID id("SIXTEEN_BY_SIXTEEN");
+    Asset::AssetHeader *header = Asset::find(id)->header;
+    Asset::StreamRequest request = Asset::locate(Asset::find(id)->pack, id, header);
+    defer { Asset::release_file(request.file); };
+    Asset::DataStream stream = Asset::open_stream(&request);
+    defer { stream.close(); };
+
+    // Read it in odd pieces, so it goes through the block buffer.
+    // The pixels come after the header and the layer name.
+    const u64 pixels = 32 + 8;
+    u8 data[pixels + (16 * 16 + 8 * 8 + 4 * 4 + 2 * 2 + 1) * 4];
+    stream.read(data, pixels);
+    stream.read(data + pixels, 7);
+    stream.read(data + pixels + 7, sizeof(data) - pixels - 7);
+
+    // Same as hash_bytes in the asset packer.
+    u64 hash = 0xCBF29CE484222325ull;
+    for (u8 byte : data) {
+        hash = (hash ^ byte) * 0x100000001B3ull;
+    }
+    return hash == header->data_hash
+           && data[pixels] == 200
+           && data[sizeof(data) - 1] == 255;
+});
+
+TEST_CASE("asset reload unchanged", {
+    Asset::load("assets-tests.bin");
+    AssetID id("ALPHABET");
+    Asset::fetch_string_asset(id);
+
+    Asset::ReloadReport changes;
+    if (!Asset::reload(&changes)) return false;
+    return changes.changed.empty()
+           && changes.added.empty()
+           && changes.removed.empty()
+           && !Asset::needs_reload(id);
+});
+
+TEST_CASE("asset reload changed", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    AssetID id("ALPHABET");
+    Asset::fetch_string_asset(id);
+    // Pretend the file on disk changed.
+    Asset::find(id)->header->data_hash += 1;
+
+    Asset::ReloadReport changes;
+    if (!Asset::reload(&changes)) return false;
+    if (changes.changed.size() != 1 || changes.changed[0] != id) return false;
+    if (!Asset::needs_reload(id)) return false;
+    return std::strcmp(Asset::fetch_string_asset(id)->data,
+                       "abcdefghijklmnopqrstuvwxyz")
+           == 0;
+});
+
+TEST_CASE("asset reload edited", {
+    auto copy = [](const char *from, const char *to) {
+        FILE *in = fopen(from, "rb");
+        FILE *out = fopen(to, "wb");
+        defer { fclose(in); fclose(out); };
+        char buffer[4096];
+        u64 read;
+        while ((read = fread(buffer, 1, sizeof(buffer), in))) fwrite(buffer, 1, read, out);
+    };
+    // A copy, so the pack can be edited on disk.
+    copy("assets-tests.bin", "assets-tests-reload.bin");
+    Asset::load("assets-tests-reload.bin");
+    AssetID id("ALPHABET");
+    Asset::fetch_string_asset(id);
+    copy("assets-tests-patch.bin", "assets-tests-reload.bin");
+
+    Asset::ReloadReport changes;
+    if (!Asset::reload(&changes)) return false;
+    return std::find(changes.changed.begin(), changes.changed.end(), id) != changes.changed.end()
+           && std::strcmp(Asset::fetch_string_asset(id)->data, "patched") == 0;
+});
+
+TEST_CASE("asset reload added and removed", {
+    Asset::load("assets-tests.bin");
+    Asset::AssetTable *table = GAMESTATE()->asset_system.table;
+    AssetID alphabet("ALPHABET");
+    Asset::remove_slot(table, Asset::find(alphabet)->slot);
+
+    AssetID missing("NOT_IN_THE_PACK");
+    static Asset::AssetHeader header = {};
+    header.type = Asset::AssetType::STRING;
+    header.name_hash = missing;
+    header.name = (char *)"NOT_IN_THE_PACK";
+    Asset::add_slot(table, &header, nullptr);
+
+    Asset::ReloadReport changes;
+    if (!Asset::reload(&changes)) return false;
+    return changes.changed.empty()
+           && changes.added.size() == 1 && changes.added[0] == alphabet
+           && changes.removed.size() == 1 && changes.removed[0] == missing
+           && Asset::is_valid(alphabet)
+           && !Asset::is_valid(missing);
+});
+
+TEST_CASE("asset reload failed", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    Asset::mount("assets-tests-patch.bin", -1, Asset::LoadMode::MAPPED);
+    Asset::System *system = &GAMESTATE()->asset_system;
+    Asset::Pack *first = system->packs[0];
+    Asset::Pack *second = system->packs[1];
+    const u8 *mapped = first->file->mapped;
+
+    // The first pack is read before the second one fails.
+    const char *path = second->file->path;
+    second->file->path = "not-an-asset-file.bin";
+    bool reloaded = Asset::reload();
+    second->file->path = path;
+    return !reloaded
+           && first->file->mapped == mapped
+           && std::strcmp(Asset::fetch_string_asset(AssetID("ALPHABET"))->data, "abcdefghijklmnopqrstuvwxyz") == 0;
+});
+
+TEST_CASE("asset reload keeps views", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    Asset::Pack *pack = GAMESTATE()->asset_system.packs[0];
+    Asset::PackFile *file = pack->file;
+    const char *data = Asset::fetch_string_asset(AssetID("ALPHABET"))->data;
+    if (SDL_AtomicGet(&file->references) != 2) return false;
+
+    // The data didn't change, so the string still points into
+    // the old mapping, which is only held by the string now.
+    Asset::reload();
+    return pack->file != file
+           && SDL_AtomicGet(&file->references) == 1
+           && Asset::fetch_string_asset(AssetID("ALPHABET"))->data == data
+           && std::strcmp(data, "abcdefghijklmnopqrstuvwxyz") == 0;
+});
+
+TEST_CASE("asset load again", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    Asset::System *system = &GAMESTATE()->asset_system;
+    Asset::PackFile *file = Asset::acquire_file(system->packs[0]->file);
+    defer { Asset::release_file(file); };
+    Asset::fetch_string_asset(AssetID("ALPHABET"));
+    if (SDL_AtomicGet(&file->references) != 3) return false;
+
+    // Neither the pack nor the string hold on to the file.
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    return SDL_AtomicGet(&file->references) == 1
+           && system->num_packs == 1
+           && std::strcmp(Asset::fetch_string_asset(AssetID("ALPHABET"))->data, "abcdefghijklmnopqrstuvwxyz") == 0;
+});
+
+TEST_CASE("asset retired sound", {
+    Asset::load("assets-tests.bin");
+    Asset::System *system = &GAMESTATE()->asset_system;
+    AssetID id("SINE_SHORT");
+    Asset::fetch_sound(id);
+    Asset::UsableAsset *asset = Asset::find(id);
+    const u64 size = asset->cpu_size;
+    const u64 resident = system->cpu_resident;
+
+    // Counted until it's freed, there's no audio playing it.
+    Asset::unload_asset(asset);
+    if (system->retired_sounds.size() != 1 || system->cpu_resident != resident) return false;
+    Asset::free_retired_sounds(system);
+    return size != 0
+           && system->retired_sounds.empty()
+           && system->cpu_resident == resident - size;
+});
+
+TEST_CASE("asset mount patch", {
+    Asset::load("assets-tests.bin");
+    AssetID alphabet("ALPHABET");
+    AssetID note("PATCH_NOTE");
+    if (Asset::is_valid(note)) return false;
+    Asset::fetch_string_asset(alphabet);
+
+    Asset::PackID patch = Asset::mount("assets-tests-patch.bin", 1);
+    if (patch == Asset::NO_PACK) return false;
+    if (!Asset::needs_reload(alphabet) || !Asset::is_valid(note)) return false;
+    if (std::strcmp(Asset::fetch_string_asset(alphabet)->data, "patched") != 0) return false;
+
+    // The original is read again.
+    if (!Asset::unmount(patch)) return false;
+    return !Asset::is_valid(note)
+           && std::strcmp(Asset::fetch_string_asset(alphabet)->data, "abcdefghijklmnopqrstuvwxyz") == 0
+           && !Asset::unmount(patch);
+});
+
+TEST_CASE("asset mount below", {
+    Asset::load("assets-tests.bin");
+    Asset::mount("assets-tests-patch.bin", -1, Asset::LoadMode::MAPPED);
+    return std::strcmp(Asset::fetch_string_asset(AssetID("ALPHABET"))->data, "abcdefghijklmnopqrstuvwxyz") == 0
+           && std::strcmp(Asset::fetch_string_asset(AssetID("PATCH_NOTE"))->data, "only in the patch") == 0;
+});
+
+TEST_CASE("asset unmount unloads", {
+    Asset::load("assets-tests.bin");
+    Asset::System *system = &GAMESTATE()->asset_system;
+    Asset::PackID patch = Asset::mount("assets-tests-patch.bin", 1);
+    Asset::fetch_string_asset(AssetID("PATCH_NOTE"));
+    Asset::fetch_string_asset(AssetID("ALPHABET"));
+    if (system->cpu_resident != 18 + 8) return false;
+    Asset::unmount(patch);
+    return system->cpu_resident == 0;
+});
+
+TEST_CASE("asset eviction", {
+    Asset::load("assets-tests.bin");
+    Asset::System *system = &GAMESTATE()->asset_system;
+    AssetID id("ALPHABET");
+    Asset::fetch_string_asset(id);
+    if (system->cpu_resident != 27) return false;
+
+    Asset::set_budget(1, 0);
+    defer { Asset::set_budget(0, 0); };
+    // Used this frame, so it's kept.
+    if (Asset::enforce_budget() != 0) return false;
+    if (Asset::enforce_budget() != 1) return false;
+    if (Asset::is_ready(id) || system->cpu_resident != 0) return false;
+
+    const char *data = Asset::fetch_string_asset(id)->data;
+    return std::strcmp(data, "abcdefghijklmnopqrstuvwxyz") == 0
+           && system->cpu_resident == 27;
+});
+
+TEST_CASE("asset acquire", {
+    Asset::load("assets-tests.bin");
+    AssetID id("ALPHABET");
+    AssetHandle handle = Asset::acquire(id);
+    Asset::fetch_string_asset(handle);
+
+    Asset::set_budget(1, 0);
+    defer { Asset::set_budget(0, 0); };
+    Asset::enforce_budget();
+    if (Asset::enforce_budget() != 0 || !Asset::is_ready(id)) return false;
+    Asset::release(handle);
+    return Asset::enforce_budget() == 1 && !Asset::is_ready(id);
+});
+
+TEST_CASE("asset stats", {
+    Asset::load("assets-tests.bin");
+    AssetID id("ALPHABET");
+    Asset::fetch_string_asset(id);
+    Asset::set_budget(1, 0);
+    defer { Asset::set_budget(0, 0); };
+    Asset::enforce_budget();
+    Asset::enforce_budget();
+    Asset::fetch_string_asset(id);
+
+    Asset::AssetStats stats = Asset::find(id)->stats;
+    if (stats.loads != 2 || stats.bytes_read != 2 * Asset::find(id)->header->data_size) return false;
+    if (stats.upload_ms != 0.0 || !(stats.decode_ms >= 0.0)) return false;
+
+    const char *path = "asset-stats-test.csv";
+    if (!Asset::write_stats_csv(path)) return false;
+    defer { std::remove(path); };
+    FILE *file = std::fopen(path, "r");
+    if (!file) return false;
+    defer { std::fclose(file); };
+    char line[256];
+    bool found = false;
+    while (std::fgets(line, LEN(line), file)) {
+        char expected[64];
+        sntprint(expected, LEN(expected), "ALPHABET,String,2,{},", stats.bytes_read);
+        found |= std::strncmp(line, expected, std::strlen(expected)) == 0;
+    }
+    return found;
+});
+
 TEST_CASE("asset 1x1x3 png white", {
     Asset::load("assets-tests.bin");
     AssetID id("ONE_BY_ONE_RGB_PNG_WHITE");
@@ -395,6 +2227,27 @@ TEST_CASE("asset 1x2x4 png", {
            && image->components == 4;
 });
 
+TEST_CASE("asset mip chain", {
+    Asset::load("assets-tests.bin");
+    GFX::Texture *image = Asset::fetch_texture(AssetID("SIXTEEN_BY_SIXTEEN"));
+    return image->num_levels == 5
+           && image->num_layers == 1
+           && image->layer(AssetID("SIXTEEN_BY_SIXTEEN")) == 0;
+});
+
+TEST_CASE("asset texture layers", {
+    Asset::load("assets-tests.bin");
+    // Only packed as layers.
+    if (Asset::is_valid(AssetID("LAYER_RED"))) return false;
+    GFX::Texture *image = Asset::fetch_texture(AssetID("TWO_LAYERS"));
+    return image->width == 4
+           && image->height == 2
+           && image->num_levels == 3
+           && image->num_layers == 2
+           && image->layer(AssetID("LAYER_RED")) == 0
+           && image->layer(AssetID("LAYER_BLUE")) == 1;
+});
+
 TEST_CASE("asset 1x1x4 png white", {
     Asset::load("assets-tests.bin");
     AssetID id("ONE_BY_ONE_RGBA_PNG_WHITE");
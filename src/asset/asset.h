@@ -1,11 +1,14 @@
 #pragma once
 
 #include <vector>
+#include <deque>
+#include <atomic>
 #include <unordered_map>
 #include "SDL.h"
 
 #include "../math/smek_vec.h"
 #include "../renderer/renderer.h"
+#include "asset_ids.h"
 
 namespace std {
 template <>
@@ -47,6 +50,37 @@ enum AssetType {
     NUM_TYPES,
 };
 
+static const char *asset_type_names[] = {
+    "None",
+    "Texture",
+    "String",
+    "Mesh",
+    "Shader",
+    "Sound",
+    "Skinned",
+    "Skeleton",
+    "Animation",
+    "Level",
+};
+
+static_assert(!(LEN(asset_type_names) < (u64)AssetType::NUM_TYPES), "Too few asset type names");
+static_assert(!(LEN(asset_type_names) > (u64)AssetType::NUM_TYPES), "Too many asset type names");
+
+///* AssetFlag
+// Bits in AssetHeader::flags, these also have to match
+// the python script.
+enum AssetFlag : u32 {
+    FLAG_COMPRESSED = 1 << 0,
+    // Read a piece at a time while it's used, never compressed.
+    FLAG_STREAMED = 1 << 1,
+};
+
+///* COMPRESSED_BLOCK_BOUND
+// The largest a compressed block can get, the blocks are
+// never more than 64 KiB before compression.
+const u32 MAX_COMPRESSED_BLOCK = 1 << 16;
+const u32 COMPRESSED_BLOCK_BOUND = MAX_COMPRESSED_BLOCK + MAX_COMPRESSED_BLOCK / 255 + 16;
+
 ///* FileHeader
 struct FileHeader {
     // read from file
@@ -54,12 +88,29 @@ struct FileHeader {
     u64 header_offset;
     u64 name_offset;
     u64 data_offset;
+    u64 index_offset;
+    u64 index_capacity;
+};
+
+///* IndexEntry
+// The pack has an open-addressing hash index from name hash
+// to header slot, written by the asset packer. It's probed
+// linearly from index_bucket, and a slot of EMPTY_INDEX_SLOT
+// ends the probe.
+struct IndexEntry {
+    // read from file
+    u64 name_hash;
+    u32 slot;
+    u32 padding;
 };
 
+const u32 EMPTY_INDEX_SLOT = 0xFFFFFFFF;
+
 ///* AssetType
 struct AssetHeader {
     // read from file
     AssetType type;
+    u32 flags;
     u64 name_hash;
     u64 data_hash;
     u64 name_size;
@@ -77,21 +128,97 @@ struct StringAsset {
     char *data;
 };
 
+///* SampleFormat
+// How the samples of a sound are stored, these have to match
+// the python script. The mixer decodes them while playing.
+enum class SampleFormat : u32 {
+    I16 = 0,
+    // Blocks of block_size bytes that decode to frames_per_block
+    // frames each, see Audio::audio_callback.
+    IMA_ADPCM = 1,
+};
+
 ///* Sound
+// The samples are interleaved, and num_samples counts
+// the samples in all channels.
 struct Sound {
     // read from file
     u32 channels;
     u32 sample_rate;
     u32 num_samples;
-    f32 *data;
+    SampleFormat format;
+    u32 block_size;
+    u32 frames_per_block;
+    u8 *data;
+
+    u64 size() const {
+        if (format == SampleFormat::I16) return sizeof(i16) * num_samples;
+        u64 num_frames = num_samples / channels;
+        return (num_frames + frames_per_block - 1) / frames_per_block * block_size;
+    }
 };
 
 ///* Level
+// The entities in the level, compiled by the asset packer
+// into records that are copied straight into the entities.
+// See read_level_and_do. The assets are the ones the level
+// declares, they're prefetched when it's loaded.
 struct Level {
-    // TODO(ed): Change this representation
-    // to not store the string. Parsing is slow.
+    // read from file
+    u64 num_entities;
     u64 size;
-    char *data;
+    u64 num_assets;
+    u8 *data;
+    AssetID *assets;
+};
+
+///* PackFile
+// The file of a pack, and its mapping if the pack is mapped. A
+// reload replaces it and an unmount drops it, but it's only
+// closed when the last reference is released. The pack, views
+// into the mapping, sound readers and streaming requests all
+// hold one.
+struct PackFile {
+    const char *path;
+    u8 *mapped;
+    u64 mapped_size;
+    SDL_atomic_t references;
+};
+
+///* SoundReader
+// Reads the samples of a streamed sound straight from the
+// pack, without loading the sound. See open_sound_reader.
+struct SoundReader {
+    // The data pointer is not set.
+    Sound sound;
+    FILE *file;
+    PackFile *pack_file;
+    // Where the samples start in the file.
+    u64 offset;
+};
+
+///* LoadMode
+// How the asset file is accessed. STREAM opens the file and
+// copies the data out for every asset that is loaded. MAPPED
+// maps the whole file into memory once, strings, sounds,
+// levels and names then point straight into the file, and
+// textures and meshes are uploaded from the mapped memory.
+enum class LoadMode {
+    STREAM,
+    MAPPED,
+};
+
+struct Pack;
+
+///* AssetStats
+// Totals over every time the asset was loaded, kept across
+// evictions and reloads. Decoding is everything but the GPU
+// upload, including reading the file.
+struct AssetStats {
+    u32 loads;
+    u64 bytes_read;
+    f32 decode_ms;
+    f32 upload_ms;
 };
 
 ///* UsableAsset
@@ -109,21 +236,223 @@ struct UsableAsset {
     };
 
     AssetHeader *header;
+    // The mounted pack with the highest priority that has
+    // the asset, the header points into it.
+    Pack *pack;
     bool dirty;
     bool loaded;
+    // The CPU-side data points into the mapped file,
+    // and is not owned by the asset.
+    bool is_view;
+    // The file the view points into, held until the
+    // asset is unloaded or loaded again.
+    PackFile *view_file;
+    // Requested from the streaming workers, but not
+    // uploaded yet.
+    bool pending;
+    // Where in the asset table the asset lives.
+    u32 slot;
+    // Acquired assets are never evicted, see acquire.
+    u32 references;
+    // Bytes held in RAM and on the GPU, counted
+    // against the budget.
+    u64 cpu_size;
+    u64 gpu_size;
+    AssetStats stats;
 };
 
-struct System {
+///* AssetSlot
+// One entry in the asset table. The generation is bumped every
+// time the slot is given to a new asset, and ready is set when
+// the asset is loaded and up to date, so handles can be checked
+// without taking the lock.
+struct AssetSlot {
+    UsableAsset asset;
+    AssetType type;
+    bool used;
+
+    std::atomic<u32> generation;
+    std::atomic<bool> ready;
+    // The frame the asset was last fetched, updated
+    // by the handles too.
+    std::atomic<u64> last_used;
+};
+
+///* ASSET_CHUNK_SIZE
+// The asset table grows in chunks of this many slots, chunks
+// are never moved so readers don't need to lock.
+const u32 ASSET_CHUNK_SIZE = 256;
+
+///* MAX_ASSET_CHUNKS
+const u32 MAX_ASSET_CHUNKS = 256;
+
+///* AssetTable
+// Dense storage for all assets. AssetIDs are found through the
+// indices of the mounted packs, see Pack. Only changed with the
+// asset lock held.
+struct AssetTable {
+    AssetSlot *chunks[MAX_ASSET_CHUNKS];
+    std::atomic<u32> num_slots;
+    std::vector<u32> free_slots;
+    // Advanced by enforce_budget.
+    std::atomic<u64> frame;
+    // The assets from the last prefetch, see prefetch_progress.
+    std::vector<AssetID> prefetched;
+
+    AssetSlot *at(u32 index) {
+        return chunks[index / ASSET_CHUNK_SIZE] + (index % ASSET_CHUNK_SIZE);
+    }
+};
+
+///* StreamRequest
+// Where a streaming worker finds the data of an asset. It's a
+// copy, since the workers never touch the game state.
+struct StreamRequest {
+    AssetID id;
+    AssetType type;
+    u32 flags;
+    u64 data_hash;
+    // Holds a reference, released when the request is done.
+    PackFile *file;
+    u64 offset;
+    u64 size;
+};
+
+///* StagedAsset
+// An asset that has been read and decoded by a streaming
+// worker, and is waiting for the main thread to upload it
+// to the GPU.
+struct StagedAsset {
+    AssetID id;
+    AssetType type;
+    u64 data_hash;
+
+    // Textures
+    u32 width;
+    u32 height;
+    u32 components;
+    u32 num_levels;
+    u32 num_layers;
+    // Owned until it's given to the texture.
+    AssetID *layers;
+
+    // Meshes and skins
+    u32 num_vertices;
+    // Meshes, the indices point into data
+    u32 num_indices;
+    u32 index_size;
+    void *indices;
+
+    void *data;
+    bool owned;
+    // Set by the streaming workers, since the data might be
+    // a view. Holds a reference until the staged asset is freed.
+    PackFile *file;
+
+    // Filled in by the worker, for the stats.
+    u64 bytes_read;
+    f32 decode_ms;
+};
+
+///* MAX_STREAMING_WORKERS
+// The maximum number of threads reading assets in the background.
+const u32 MAX_STREAMING_WORKERS = 4;
+
+///* UPLOAD_QUEUE_SIZE
+// How many staged assets can wait for upload before the
+// workers stop reading new ones.
+const u32 UPLOAD_QUEUE_SIZE = 16;
+
+///* StreamingQueue
+// Shared between the main thread and the streaming workers,
+// everything is guarded by the lock.
+struct StreamingQueue {
+    bool running;
+    u32 num_workers;
+    SDL_Thread *workers[MAX_STREAMING_WORKERS];
+
+    SDL_mutex *lock;
+    SDL_cond *requests_signal;
+    SDL_cond *uploads_signal;
+    std::deque<StreamRequest> requests;
+    std::deque<StagedAsset> uploads;
+};
+
+///* PackID
+// Returned by mount, NO_PACK is never a mounted pack.
+using PackID = u32;
+const PackID NO_PACK = 0;
+
+///* NO_SLOT
+// In Pack::header_slots for assets that are read from
+// another pack.
+const u32 NO_SLOT = 0xFFFFFFFF;
+
+///* Pack
+// A mounted asset file. Every asset is read from the pack with
+// the highest priority that has it, header_slots maps the header
+// slots of those assets to slots in the asset table.
+struct Pack {
+    PackID id;
+    i32 priority;
+    LoadMode mode;
+    // The pack holds a reference.
+    PackFile *file;
+
     // read directly from file
     FileHeader file_header;
     AssetHeader *headers;
-    std::unordered_map<AssetID, UsableAsset> assets;
+    IndexEntry *index;
 
     // not read directly from file
     u64 num_assets;
-    const char *asset_path;
+    char *names;
+    u32 *header_slots;
+};
+
+///* RetiredSound
+// The samples of an unloaded sound, kept until no audio
+// source plays them. The file is set if they are a view.
+struct RetiredSound {
+    u8 *data;
+    u64 cpu_size;
+    PackFile *file;
+};
+
+///* MAX_PACKS
+// The most packs that can be mounted at the same time.
+const u32 MAX_PACKS = 16;
+
+struct System {
+    // Sorted by priority, the highest first.
+    Pack *packs[MAX_PACKS];
+    u32 num_packs;
+    PackID next_pack_id;
+    // Not part of the game state, since the atomics can't be copied.
+    AssetTable *table;
+
+    // Still counted as resident, freed by enforce_budget.
+    std::vector<RetiredSound> retired_sounds;
 
     SDL_mutex *asset_lock;
+
+    // What the loaded assets take up, and how much they are
+    // allowed to take up. A budget of 0 means no limit.
+    u64 cpu_resident;
+    u64 gpu_resident;
+    u64 cpu_budget;
+    u64 gpu_budget;
+
+    // Allocated when streaming is started, and not part of
+    // the game state since the workers hold on to it.
+    StreamingQueue *streaming;
+
+    // Returned for textures, meshes and skins that
+    // are still streaming in.
+    bool has_placeholders;
+    GFX::Texture placeholder_texture;
+    GFX::Mesh placeholder_mesh;
+    GFX::Skin placeholder_skin;
 };
 
 ///*
@@ -131,13 +460,58 @@ struct System {
 bool is_valid(AssetID id);
 
 ///*
-// Load the specified binary asset file.
-// Does not currently support hot reloading.
-bool load(const char *path);
+// Returns the asset with the ID, without loading it.
+UsableAsset *find(AssetID id);
+
+///*
+// Resolves the ID into a handle, which can be fetched
+// without locking. Resolve once and keep the handle.
+AssetHandle resolve(AssetID id);
+
+///*
+// Starts the asset system over, with only the specified binary
+// asset file mounted. Passing LoadMode::MAPPED maps the file
+// into memory instead of reading it piece by piece.
+bool load(const char *path, LoadMode mode = LoadMode::STREAM);
+
+///*
+// Stops the streaming, unloads all assets and unmounts all
+// packs. Called by load, and when the game shuts down.
+void shutdown();
+
+/// Packs
+// Assets can come from several packs, like one for the whole
+// game and one for every level. Assets are read from the mounted
+// pack with the highest priority that has them, so a pack can
+// patch assets in the packs below it. Unmounting a pack unloads
+// all the assets that were read from it at once, and the assets
+// it patched are read from the packs below again.
+//
+// NOTE(ed): The file of an unmounted pack stays open, or mapped,
+// until the sounds and streaming workers reading it are done.
+
+///*
+// Mounts the asset file on top of the packs with the same or
+// a lower priority. Returns NO_PACK if the file can't be read.
+PackID mount(const char *path, i32 priority = 0, LoadMode mode = LoadMode::STREAM);
+
+///*
+// Unmounts a pack from mount, returns false if it isn't mounted.
+bool unmount(PackID pack);
+
+///* ReloadReport
+// The assets that changed in a reload.
+struct ReloadReport {
+    std::vector<AssetID> changed;
+    std::vector<AssetID> added;
+    std::vector<AssetID> removed;
+};
 
 ///*
-// Hot reloads the asset file passed in.
-bool reload();
+// Hot reloads all mounted packs. Only assets whose data hash
+// changed are loaded again, the changes are logged and written
+// to the report if one is passed in.
+bool reload(ReloadReport *report = nullptr);
 
 ///*
 // Fetch the ID corresponding to the asset with the specified name.
@@ -148,6 +522,142 @@ AssetID fetch_id(const char *name);
 // Returns true if the asset needs to be reloaded.
 bool needs_reload(AssetID id);
 
+/// Streaming
+// Textures, meshes and skins can be read and decoded by worker
+// threads, the main thread then only has to upload them. While
+// an asset is streaming in, the fetch functions return a
+// placeholder (a white pixel or an empty mesh) or, when the
+// asset is being reloaded, the old version.
+//
+// NOTE(ed): The workers run code in the game library, like
+// the network threads, so stop them before unloading it.
+
+///*
+// Starts the streaming workers.
+void start_streaming(u32 num_workers = 2);
+
+///*
+// Stops and joins the streaming workers, assets that were
+// not uploaded yet are dropped and requested again on the
+// next fetch.
+void stop_streaming();
+
+///*
+// Uploads streamed assets to the GPU until the time
+// budget is spent. Has to be called from the main thread,
+// preferably once every frame.
+void upload_streamed(f32 budget_ms = 2.0);
+
+///*
+// Asks the workers to load the asset, without waiting for it.
+// Assets that aren't streamed are loaded directly.
+void request(AssetID id);
+
+///*
+// Returns true if the asset is loaded and up to date.
+bool is_ready(AssetID id);
+
+/// Prefetching
+// Assets are loaded in the order the game fetches them, which
+// jumps all over the pack. Prefetching a batch of assets reads
+// them in the order they are stored instead, so loading a level
+// is one sweep through the file.
+
+///* PrefetchProgress
+struct PrefetchProgress {
+    u32 ready;
+    u32 total;
+};
+
+///*
+// Loads the assets, in the order they are stored in the packs.
+// Textures, meshes and skins are handed to the streaming workers
+// in that order when they run. Streamed sounds are skipped.
+// Returns the number of assets that had to be read.
+u32 prefetch(const AssetID *ids, u32 num_ids);
+
+///*
+// How many of the assets from the last prefetch are ready.
+PrefetchProgress prefetch_progress();
+
+/// Residency
+// Loaded assets are kept until the memory budget is exceeded,
+// then the ones that haven't been used for the longest time
+// are unloaded. They are loaded again on the next fetch, so
+// nothing has to be done to use an evicted asset. Pointers
+// returned by the fetch functions are only valid until the
+// next call to enforce_budget, keep the handle or ID instead.
+//
+// Sounds are never evicted, since the audio thread holds on
+// to them.
+
+///*
+// Sets how many bytes of RAM and GPU memory the assets
+// may use, 0 means no limit.
+void set_budget(u64 cpu_bytes, u64 gpu_bytes);
+
+///*
+// Evicts the least recently used assets that aren't acquired
+// until the system is within budget, assets fetched since the
+// last call are kept. Advances the frame counter used for the
+// ordering, so call it once every frame. Returns the number of
+// evicted assets.
+u32 enforce_budget();
+
+///*
+// Keeps the asset from being evicted until it's released,
+// acquire and release have to be paired.
+AssetHandle acquire(AssetID id);
+
+///*
+// Releases an asset from acquire. Releasing an asset that
+// was removed by a reload does nothing.
+void release(AssetHandle handle);
+
+/// Load statistics
+// Every load is timed and counted, to find the assets that
+// are worth compressing, splitting or prefetching.
+
+///* AssetReport
+// A copy of the stats of one asset, see collect_stats.
+struct AssetReport {
+    AssetID id;
+    const char *name;
+    AssetType type;
+    AssetStats stats;
+    u64 cpu_size;
+    u64 gpu_size;
+};
+
+///*
+// Copies the stats of all assets in the table, loaded or not.
+std::vector<AssetReport> collect_stats();
+
+///*
+// Writes the stats of all assets to a CSV file, one asset
+// per line. Returns false if the file can't be written.
+bool write_stats_csv(const char *path);
+
+/// Streamed sounds
+// Long sounds are packed with FLAG_STREAMED, and are read a
+// piece at a time by the audio system while they play, so
+// they never have to be loaded as a whole.
+
+///*
+// Opens a reader for the sound if it was packed to be
+// streamed, otherwise returns false and the sound has to
+// be fetched. Has to be called from the main thread, but
+// the reader can then be used from any thread.
+bool open_sound_reader(AssetID id, SoundReader *reader);
+
+///*
+// Reads size bytes of samples, starting offset bytes
+// into the sound data.
+void read_sound(SoundReader *reader, u64 offset, u8 *dst, u64 size);
+
+///*
+void close_sound_reader(SoundReader *reader);
+
 /// Asset Requests
 // Functions for interacting with the asset system.
 
@@ -169,4 +679,18 @@ Sound *fetch_sound(AssetID id);
 StringAsset *fetch_string_asset(AssetID id);
 Level *fetch_level(AssetID id);
 
+///* fetch through a handle
+// Same as fetching with the ID, but doesn't lock or hash if the
+// asset is loaded and up to date. Stale handles still work, but
+// go the slow way.
+Animation *fetch_animation(AssetHandle handle);
+Mesh *fetch_mesh(AssetHandle handle);
+Shader *fetch_shader(AssetHandle handle);
+Skeleton *fetch_skeleton(AssetHandle handle);
+Skin *fetch_skin(AssetHandle handle);
+Texture *fetch_texture(AssetHandle handle);
+Sound *fetch_sound(AssetHandle handle);
+StringAsset *fetch_string_asset(AssetHandle handle);
+Level *fetch_level(AssetHandle handle);
+
 } // namespace Asset
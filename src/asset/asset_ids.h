@@ -0,0 +1,41 @@
+// clang-format off
+/*
+ * Do not edit this file directly! It is generated from
+ * the assets in `res/` by `tools/asset-gen.py`.
+ */
+
+#pragma once
+#include "../math/smek_math.h"
+
+namespace AssetIDs {
+
+constexpr AssetID ANIM_ARMATUREACTION_001_UNTITLED("ANIM_ARMATUREACTION_001_UNTITLED");
+constexpr AssetID ANIM_ARMATUREACTION_002_SIMPLE("ANIM_ARMATUREACTION_002_SIMPLE");
+constexpr AssetID ANIM_SKINNEDMESHACTION_001_RIGGED_SIMPLE_CHARACTER("ANIM_SKINNEDMESHACTION_001_RIGGED_SIMPLE_CHARACTER");
+constexpr AssetID ANIM_SWINGING_SWINGING_CUBE("ANIM_SWINGING_SWINGING_CUBE");
+constexpr AssetID BLOCK("BLOCK");
+constexpr AssetID CUBE("CUBE");
+constexpr AssetID DEBUG_SHADER("DEBUG_SHADER");
+constexpr AssetID MASTER_SHADER("MASTER_SHADER");
+constexpr AssetID MONKEY("MONKEY");
+constexpr AssetID NOISE_SHORT("NOISE_SHORT");
+constexpr AssetID NOISE_SHORT_32("NOISE_SHORT_32");
+constexpr AssetID NOISE_SHORT_8K("NOISE_SHORT_8K");
+constexpr AssetID NOISE_SHORT_U8("NOISE_SHORT_U8");
+constexpr AssetID NOISE_STEREO("NOISE_STEREO");
+constexpr AssetID NOISE_STEREO_8K("NOISE_STEREO_8K");
+constexpr AssetID POSTPROCESS_SHADER("POSTPROCESS_SHADER");
+constexpr AssetID RGB("RGB");
+constexpr AssetID RGBA("RGBA");
+constexpr AssetID SIMPLE_WORLD("SIMPLE_WORLD");
+constexpr AssetID SKEL_RIGGED_SIMPLE_CHARACTER("SKEL_RIGGED_SIMPLE_CHARACTER");
+constexpr AssetID SKEL_SIMPLE("SKEL_SIMPLE");
+constexpr AssetID SKEL_SWINGING_CUBE("SKEL_SWINGING_CUBE");
+constexpr AssetID SKEL_UNTITLED("SKEL_UNTITLED");
+constexpr AssetID SKIN_RIGGED_SIMPLE_CHARACTER("SKIN_RIGGED_SIMPLE_CHARACTER");
+constexpr AssetID SKIN_SIMPLE("SKIN_SIMPLE");
+constexpr AssetID SKIN_SWINGING_CUBE("SKIN_SWINGING_CUBE");
+constexpr AssetID SKIN_UNTITLED("SKIN_UNTITLED");
+constexpr AssetID TILES("TILES");
+
+} // namespace AssetIDs
@@ -1,4 +1,6 @@
 #include "audio.h"
+#include <algorithm>
+#include <cstring>
 
 #include "util/log.h"
 #include "math/smek_math.h"
@@ -8,6 +10,98 @@
 
 namespace Audio {
 
+static const i32 IMA_INDEX_TABLE[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+static const i32 IMA_STEP_TABLE[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+};
+
+// Has to match ima_decode_sample in tools/asset-gen.py.
+static void decode_nibble(AdpcmChannel *channel, u8 nibble) {
+    i32 step = IMA_STEP_TABLE[channel->step_index];
+    i32 diff = step >> 3;
+    if (nibble & 1) diff += step >> 2;
+    if (nibble & 2) diff += step >> 1;
+    if (nibble & 4) diff += step;
+    if (nibble & 8) diff = -diff;
+    channel->predictor = std::clamp(channel->predictor + diff, -32768, 32767);
+    channel->step_index = std::clamp(channel->step_index + IMA_INDEX_TABLE[nibble & 7], 0, 88);
+}
+
+// Where the byte offset into the sound data is, streamed sounds
+// are read from the ring buffer. Chunks hold whole frames and
+// blocks, so a frame or a block can be read in one go.
+static const u8 *data_at(SoundSource *source, u64 offset) {
+    SoundStream *stream = source->stream;
+    if (!stream) return source->data + offset;
+    u64 chunk = stream->first_chunk + offset / stream->chunk_bytes;
+    return stream->ring + (chunk % NUM_STREAM_CHUNKS) * stream->chunk_bytes + offset % stream->chunk_bytes;
+}
+
+// Streamed sounds can only be read where the streaming thread
+// has filled them, the mixer tells it how far it has come.
+static bool stream_ready(SoundStream *stream, u64 chunk) {
+    if (chunk >= stream->filled.load(std::memory_order_acquire)) return false;
+    stream->played.store(chunk, std::memory_order_release);
+    return true;
+}
+
+// Decodes forward to the frame, restarting at the block header
+// when jumping to another block or backwards. Playback moves
+// forward, so most of the time it's one frame per call.
+static void decode_adpcm(SoundSource *source, u64 frame) {
+    const u32 PER_BLOCK = source->frames_per_block;
+    const u32 CHANNELS = source->channels;
+    const u8 *block = data_at(source, (frame / PER_BLOCK) * source->block_size);
+    const bool same_block = source->decoded_frame / PER_BLOCK == frame / PER_BLOCK;
+    if (!same_block || source->decoded_frame > frame) {
+        for (u32 c = 0; c < CHANNELS; c++) {
+            // read from file
+            struct {
+                i16 predictor;
+                u8 step_index;
+                u8 padding;
+            } header;
+            std::memcpy(&header, block + 4 * c, sizeof(header));
+            source->adpcm[c] = { header.predictor, std::min<i32>(header.step_index, 88) };
+        }
+        source->decoded_frame = frame - frame % PER_BLOCK;
+    }
+
+    while (source->decoded_frame < frame) {
+        // The header is the first frame, the nibbles are for the rest.
+        u32 n = source->decoded_frame % PER_BLOCK;
+        u32 group = n / 8;
+        u32 k = n % 8;
+        for (u32 c = 0; c < CHANNELS; c++) {
+            u8 byte = block[4 * CHANNELS + (group * CHANNELS + c) * 4 + k / 2];
+            decode_nibble(source->adpcm + c, (byte >> (4 * (k & 1))) & 0xF);
+        }
+        source->decoded_frame++;
+    }
+}
+
+static f32 read_sample(SoundSource *source, u64 frame, u32 channel) {
+    switch (source->format) {
+    case Asset::SampleFormat::I16: {
+        i16 sample;
+        std::memcpy(&sample, data_at(source, sizeof(i16) * (frame * source->channels + channel)), sizeof(i16));
+        return sample / 32768.0f;
+    }
+    case Asset::SampleFormat::IMA_ADPCM:
+        decode_adpcm(source, frame);
+        return source->adpcm[channel].predictor / 32768.0f;
+    default:
+        UNREACHABLE("Unknown sample format {}", (u32)source->format);
+    }
+    return 0.0;
+}
+
 void audio_callback(AudioStruct *audio_struct, f32 *stream, int len) {
     audio_struct->lock();
     defer { audio_struct->unlock(); };
@@ -23,31 +117,46 @@ void audio_callback(AudioStruct *audio_struct, f32 *stream, int len) {
         if (!source->active) continue;
         if (source->paused) continue;
 
+        SoundStream *ring = source->stream;
         u64 index;
         for (u32 i = 0; i < SAMPLES; i += 2) {
+            const f32 previous = source->sample;
             source->sample += source->sample_rate * TIME_STEP;
             index = source->sample;
 
+            // Repeating streams keep counting chunks.
+            u64 first_chunk = ring ? ring->first_chunk : 0;
             if (index * source->channels >= source->num_samples) {
                 if (source->repeat) {
                     source->sample = 0;
                     index = 0;
+                    if (ring) first_chunk += ring->sound_chunks;
                 } else {
                     source->active = false;
+                    if (ring) ring->playing = false;
                     break;
                 }
             }
 
+            if (ring) {
+                if (!stream_ready(ring, first_chunk + index / ring->chunk_frames)) {
+                    // The streaming thread is behind, wait for it.
+                    source->sample = previous;
+                    break;
+                }
+                ring->first_chunk = first_chunk;
+            }
+
             f32 left;
             f32 right;
 
             if (source->channels == 2) {
-                left = source->data[index * 2 + 0];
-                right = source->data[index * 2 + 1];
+                left = read_sample(source, index, 0);
+                right = read_sample(source, index, 1);
             } else {
                 // mono
                 f32 sample;
-                sample = source->data[index];
+                sample = read_sample(source, index, 0);
                 left = sample;
                 right = sample;
             }
@@ -58,6 +167,58 @@ void audio_callback(AudioStruct *audio_struct, f32 *stream, int len) {
     }
 }
 
+static void init_streaming(AudioStruct *audio) {
+    if (audio->streaming) return;
+    AudioStreaming *streaming = new AudioStreaming();
+    streaming->lock = SDL_CreateMutex();
+    streaming->signal = SDL_CreateCond();
+    for (u32 i = 0; i < NUM_SOURCES; i++) {
+        streaming->streams[i].lock = SDL_CreateMutex();
+    }
+    audio->streaming = streaming;
+}
+
+// Sets up the stream of the source, it's filled by the
+// streaming thread. Called with the audio lock held, so
+// the mixer isn't reading it.
+static SoundStream *open_stream(AudioStruct *audio, u32 source_id, Asset::SoundReader *reader, bool repeat) {
+    init_streaming(audio);
+    SoundStream *stream = audio->streaming->streams + source_id;
+    ASSERT(SDL_LockMutex(stream->lock) == 0, "Failed to lock sound stream");
+    defer { SDL_UnlockMutex(stream->lock); };
+    if (stream->open) Asset::close_sound_reader(&stream->reader);
+
+    const Asset::Sound *sound = &reader->sound;
+    u32 chunk_frames = std::max<u32>(STREAM_CHUNK_SECONDS * sound->sample_rate, 1);
+    u32 chunk_bytes;
+    if (sound->format == Asset::SampleFormat::IMA_ADPCM) {
+        u32 blocks = (chunk_frames + sound->frames_per_block - 1) / sound->frames_per_block;
+        chunk_frames = blocks * sound->frames_per_block;
+        chunk_bytes = blocks * sound->block_size;
+    } else {
+        chunk_bytes = chunk_frames * sound->channels * sizeof(i16);
+    }
+    if (stream->ring_size < NUM_STREAM_CHUNKS * chunk_bytes) {
+        delete[] stream->ring;
+        stream->ring_size = NUM_STREAM_CHUNKS * chunk_bytes;
+        stream->ring = new u8[stream->ring_size];
+    }
+
+    const u64 num_frames = sound->num_samples / sound->channels;
+    stream->open = true;
+    stream->repeat = repeat;
+    stream->reader = *reader;
+    stream->chunk_frames = chunk_frames;
+    stream->chunk_bytes = chunk_bytes;
+    stream->sound_chunks = (num_frames + chunk_frames - 1) / chunk_frames;
+    stream->first_chunk = 0;
+    stream->filled = 0;
+    stream->played = 0;
+    stream->playing = true;
+    SDL_CondSignal(audio->streaming->signal);
+    return stream;
+}
+
 AudioID AudioStruct::play_sound(AssetID asset_id, SoundSourceSettings source_settings) {
     lock();
     defer { unlock(); };
@@ -66,7 +227,15 @@ AudioID AudioStruct::play_sound(AssetID asset_id, SoundSourceSettings source_set
         if (source->active) {
             continue;
         }
-        Asset::Sound *sound = Asset::fetch_sound(asset_id);
+        Asset::Sound *sound;
+        SoundStream *stream = nullptr;
+        Asset::SoundReader reader;
+        if (Asset::open_sound_reader(asset_id, &reader)) {
+            stream = open_stream(this, source_id, &reader, source_settings.repeat);
+            sound = &stream->reader.sound;
+        } else {
+            sound = Asset::fetch_sound(asset_id);
+        }
         AudioID audio_id = {
             .gen = ++source->gen,
             .slot = source_id,
@@ -75,7 +244,14 @@ AudioID AudioStruct::play_sound(AssetID asset_id, SoundSourceSettings source_set
             .channels = sound->channels,
             .sample_rate = sound->sample_rate,
             .num_samples = sound->num_samples,
+            .format = sound->format,
+            .block_size = sound->block_size,
+            .frames_per_block = sound->frames_per_block,
             .data = sound->data,
+            .stream = stream,
+            // Nothing is decoded yet.
+            .decoded_frame = ~0ull,
+            .adpcm = {},
             .sample = 0.0,
             .gain = source_settings.gain,
             .active = true,
@@ -110,6 +286,7 @@ void AudioStruct::stop_sound(AudioID id) {
         return;
     }
     source->active = false;
+    if (source->stream) source->stream->playing = false;
     return;
 }
 
@@ -129,9 +306,83 @@ void AudioStruct::stop_all() {
     for (u32 source_id = 0; source_id < NUM_SOURCES; source_id++) {
         SoundSource *source = sources + source_id;
         source->active = false;
+        if (source->stream) source->stream->playing = false;
     }
 }
 
+// Reads the chunks the mixer is done with, or hasn't
+// reached yet. Called with the stream lock held.
+static u32 fill_stream(SoundStream *stream) {
+    const u64 sound_bytes = stream->reader.sound.size();
+    const u64 played = stream->played.load(std::memory_order_acquire);
+    u32 num_read = 0;
+    for (u64 chunk = stream->filled; chunk < played + NUM_STREAM_CHUNKS; chunk++) {
+        if (!stream->repeat && chunk >= stream->sound_chunks) break;
+        const u64 offset = (chunk % stream->sound_chunks) * stream->chunk_bytes;
+        u8 *slot = stream->ring + (chunk % NUM_STREAM_CHUNKS) * stream->chunk_bytes;
+        Asset::read_sound(&stream->reader, offset, slot, std::min<u64>(stream->chunk_bytes, sound_bytes - offset));
+        stream->filled.store(chunk + 1, std::memory_order_release);
+        num_read++;
+    }
+    return num_read;
+}
+
+u32 AudioStruct::fill_streams() {
+    if (!streaming) return 0;
+    u32 num_read = 0;
+    for (u32 i = 0; i < NUM_SOURCES; i++) {
+        SoundStream *stream = streaming->streams + i;
+        ASSERT(SDL_LockMutex(stream->lock) == 0, "Failed to lock sound stream");
+        if (stream->open && !stream->playing) {
+            Asset::close_sound_reader(&stream->reader);
+            stream->open = false;
+        }
+        if (stream->open) {
+            num_read += fill_stream(stream);
+        }
+        SDL_UnlockMutex(stream->lock);
+    }
+    return num_read;
+}
+
+// How often the streaming thread looks for streams to fill,
+// it's woken up when a stream is started.
+static const u32 STREAM_POLL_MS = 20;
+
+static int streaming_thread(void *data) {
+    AudioStruct *audio = (AudioStruct *)data;
+    AudioStreaming *streaming = audio->streaming;
+    ASSERT(SDL_LockMutex(streaming->lock) == 0, "Failed to lock audio streaming");
+    while (streaming->running) {
+        SDL_UnlockMutex(streaming->lock);
+        audio->fill_streams();
+        ASSERT(SDL_LockMutex(streaming->lock) == 0, "Failed to lock audio streaming");
+        if (streaming->running) {
+            SDL_CondWaitTimeout(streaming->signal, streaming->lock, STREAM_POLL_MS);
+        }
+    }
+    SDL_UnlockMutex(streaming->lock);
+    return 0;
+}
+
+void AudioStruct::start_streaming() {
+    init_streaming(this);
+    if (streaming->running) return;
+    streaming->running = true;
+    streaming->thread = SDL_CreateThread(streaming_thread, "AudioStreaming", this);
+    ASSERT(streaming->thread, "Failed to start audio streaming: {}", SDL_GetError());
+}
+
+void AudioStruct::stop_streaming() {
+    if (!streaming || !streaming->running) return;
+    ASSERT(SDL_LockMutex(streaming->lock) == 0, "Failed to lock audio streaming");
+    streaming->running = false;
+    SDL_CondSignal(streaming->signal);
+    SDL_UnlockMutex(streaming->lock);
+    SDL_WaitThread(streaming->thread, NULL);
+    streaming->thread = nullptr;
+}
+
 bool AudioStruct::is_valid(AudioID id) {
     CHECK(id.slot < NUM_SOURCES, "Tried to access invalid AudioID");
     SoundSource source = sources[id.slot];
@@ -144,8 +395,126 @@ SoundSource *AudioStruct::fetch_source(AudioID id) {
     return sources + id.slot;
 }
 
+// Whether a source plays the loaded samples, so they
+// can't be freed yet.
+bool AudioStruct::is_playing(const u8 *data) {
+    lock();
+    defer { unlock(); };
+    for (u32 source_id = 0; source_id < NUM_SOURCES; source_id++) {
+        SoundSource *source = sources + source_id;
+        if (source->active && !source->stream && source->data == data) return true;
+    }
+    return false;
+}
+
 } // namespace Audio
 
 void audio_callback(Audio::AudioStruct *audio_struct, f32 *stream, int len) {
     Audio::audio_callback(audio_struct, stream, len);
 }
+
+#include "test.h"
+#include <cmath>
+#include <vector>
+
+// Mixes the sound at its own sample rate, a little at a time
+// like the audio device does, and checks that the output
+// follows the sines the test files were made from.
+static bool mixes_to_sine(AssetID id, f32 amplitude, f32 tolerance, u32 skip, std::vector<f32> freqs,
+                          bool repeat = false, f32 loops = 1.0) {
+    Asset::load("assets-tests.bin");
+    Audio::AudioStruct audio = {};
+    audio.sample_rate = 1;
+    Audio::SoundSource *source = audio.sources + audio.play_sound(id, { .gain = 1.0, .repeat = repeat }).slot;
+    const u32 rate = source->sample_rate;
+    const u64 num_frames = source->num_samples / source->channels;
+    audio.sample_rate = rate;
+    defer {
+        audio.stop_all();
+        audio.fill_streams();
+    };
+
+    const u32 CALLBACK_FRAMES = 256;
+    const u32 frames = (num_frames - 1) * loops;
+    std::vector<f32> stream(CALLBACK_FRAMES * 2);
+    // Steps the same way as the mixer.
+    f32 sample = 0.0;
+    for (u32 start = 0; start < frames; start += CALLBACK_FRAMES) {
+        audio.fill_streams();
+        Audio::audio_callback(&audio, stream.data(), stream.size() * sizeof(f32));
+
+        for (u32 i = 0; i < CALLBACK_FRAMES && start + i < frames; i++) {
+            sample += rate * (1.0f / rate);
+            u64 index = sample;
+            if (index >= num_frames) {
+                sample = 0;
+                index = 0;
+            }
+            if (index < skip) continue;
+            for (u32 c = 0; c < 2; c++) {
+                f32 freq = freqs[c % freqs.size()];
+                f32 expected = amplitude * std::sin(2 * PI * freq * index / rate);
+                if (std::abs(stream[i * 2 + c] - expected) > tolerance) return false;
+            }
+        }
+    }
+    return true;
+}
+
+TEST_CASE("audio i16", {
+    Asset::load("assets-tests.bin");
+    if (Asset::fetch_sound(AssetID("SINE_SHORT"))->format != Asset::SampleFormat::I16) return false;
+    return mixes_to_sine(AssetID("SINE_SHORT"), 16000.0 / 32768.0, 0.001, 0, { 440 });
+});
+
+TEST_CASE("audio ima adpcm", {
+    Asset::load("assets-tests.bin");
+    AssetID id("SINE_LONG_STEREO");
+    if (Asset::fetch_sound(id)->format != Asset::SampleFormat::IMA_ADPCM) return false;
+    // The decoder needs a few frames to adapt to the first block.
+    return mixes_to_sine(id, 16000.0 / 32768.0, 0.05, 20, { 200, 300 });
+});
+
+TEST_CASE("audio stream", {
+    Asset::load("assets-tests.bin");
+    Asset::SoundReader reader;
+    if (Asset::open_sound_reader(AssetID("SINE_SHORT"), &reader)) return false;
+    if (!Asset::open_sound_reader(AssetID("SINE_STREAM"), &reader)) return false;
+    Asset::close_sound_reader(&reader);
+    return mixes_to_sine(AssetID("SINE_STREAM"), 16000.0 / 32768.0, 0.05, 20, { 100 }, true, 2.5);
+});
+
+TEST_CASE("audio stream mapped", {
+    Asset::load("assets-tests.bin", Asset::LoadMode::MAPPED);
+    defer { Asset::load("assets-tests.bin"); };
+    return mixes_to_sine(AssetID("SINE_STREAM"), 16000.0 / 32768.0, 0.05, 20, { 100 });
+});
+
+TEST_CASE("audio stream waits for data", {
+    Asset::load("assets-tests.bin");
+    Audio::AudioStruct audio = {};
+    audio.sample_rate = 2000;
+    AudioID id = audio.play_sound(AssetID("SINE_STREAM"), { .gain = 1.0 });
+    defer {
+        audio.stop_all();
+        audio.fill_streams();
+    };
+    Audio::SoundSource *source = audio.fetch_source(id);
+    Audio::SoundStream *stream = source->stream;
+    if (!stream || stream->filled != 0) return false;
+
+    // Nothing is read yet, so the sound doesn't move.
+    f32 out[64] = {};
+    Audio::audio_callback(&audio, out, sizeof(out));
+    if (source->sample != 0.0) return false;
+
+    // Only a few chunks are read ahead.
+    if (audio.fill_streams() != Audio::NUM_STREAM_CHUNKS) return false;
+    if (audio.fill_streams() != 0) return false;
+    Audio::audio_callback(&audio, out, sizeof(out));
+    if (source->sample == 0.0) return false;
+    for (f32 s : out) {
+        if (s != 0.0) return true;
+    }
+    return false;
+});
@@ -21,15 +21,85 @@ namespace Audio {
 // The total number of available sources.
 const u32 NUM_SOURCES = 10;
 
+///* NUM_STREAM_CHUNKS
+// How many chunks of a streamed sound are kept in memory,
+// the streaming thread fills them ahead of the mixer.
+const u32 NUM_STREAM_CHUNKS = 4;
+
+///* STREAM_CHUNK_SECONDS
+// How long a chunk of a streamed sound plays, IMA-ADPCM
+// chunks are rounded up to whole blocks.
+const f32 STREAM_CHUNK_SECONDS = 0.1;
+
 ///* SoundSource
 // Internal representation for playing sounds.
 struct SoundSource;
 
+///* SoundStream
+// The ring buffer of a source playing a streamed sound. The
+// chunks are counted from the start, and keep counting when
+// the sound repeats, chunk n is stored in slot
+// n % NUM_STREAM_CHUNKS. The mixer only reads chunks that are
+// filled, and the streaming thread only writes chunks the
+// mixer is done with.
+struct SoundStream {
+    // Held while the stream is set up or filled.
+    SDL_mutex *lock;
+    bool open;
+    bool repeat;
+    Asset::SoundReader reader;
+    u32 chunk_frames;
+    u32 chunk_bytes;
+    u64 sound_chunks;
+    u8 *ring;
+    u64 ring_size;
+
+    // The chunk the sound starts at in this loop,
+    // only used by the mixer.
+    u64 first_chunk;
+    // Chunks written by the streaming thread.
+    std::atomic<u64> filled;
+    // The chunk the mixer is reading.
+    std::atomic<u64> played;
+    // Cleared when the source stops, the reader is then
+    // closed by the streaming thread.
+    std::atomic<bool> playing;
+};
+
+///* AudioStreaming
+// The streams of all sources, and the thread filling them.
+struct AudioStreaming {
+    SoundStream streams[NUM_SOURCES];
+
+    bool running;
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *signal;
+};
+
+///* AdpcmChannel
+// Where the IMA-ADPCM decoder is in one channel.
+struct AdpcmChannel {
+    i32 predictor;
+    i32 step_index;
+};
+
 struct SoundSource {
     u32 channels;
     u32 sample_rate;
     u32 num_samples;
-    f32 *data;
+    Asset::SampleFormat format;
+    u32 block_size;
+    u32 frames_per_block;
+    u8 *data;
+    // Set if the sound is streamed, the samples are then
+    // read from the ring buffer instead of data.
+    SoundStream *stream;
+    // IMA_ADPCM sounds are decoded forward from the last
+    // decoded frame, or from the start of the block.
+    u64 decoded_frame;
+    AdpcmChannel adpcm[2];
+
     f32 sample;
     f32 gain;
     bool active;
@@ -55,6 +125,8 @@ struct AudioStruct {
     u32 sample_rate;
     SDL_AudioDeviceID dev;
     SoundSource sources[NUM_SOURCES];
+    // Allocated when the first streamed sound is played.
+    AudioStreaming *streaming;
 
     void lock() {
         if (active)
@@ -72,8 +144,13 @@ struct AudioStruct {
 
     void stop_all();
 
+    void start_streaming();
+    void stop_streaming();
+    u32 fill_streams();
+
     bool is_valid(AudioID id);
     SoundSource *fetch_source(AudioID id);
+    bool is_playing(const u8 *data);
 };
 
 void audio_callback(AudioStruct *audio_struct, f32 *stream, int len);
@@ -108,4 +185,28 @@ void stop_sound(AudioID id);
 // Stop all currently playing sounds.
 void stop_all();
 
+//// Streaming
+// Sounds that are packed with FLAG_STREAMED are never loaded,
+// play_sound gives them a small ring buffer instead, which a
+// background thread fills from the pack while they play. If
+// the thread falls behind, the sound waits where it is.
+
+///*
+// Starts the thread filling the streams. It runs code in
+// the game library, so stop it before the library is
+// unloaded.
+void start_streaming();
+
+///*
+// Stops and joins the streaming thread, the streams are
+// kept and filled again when it's started.
+void stop_streaming();
+
+///*
+// Fills the ring buffers of all playing streams as far as
+// possible, and closes the ones that are done. Returns the
+// number of chunks read. The streaming thread calls this,
+// but it can be called from any thread.
+u32 fill_streams();
+
 #endif
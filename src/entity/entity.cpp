@@ -5,6 +5,8 @@
 #include "../game.h"
 #include "../test.h"
 #include "imgui/imgui.h"
+#include <bit>
+#include <new>
 
 // These helper functions make it easier to
 // create the ClassName::imgui() functions, where
@@ -65,7 +67,7 @@ void Block::on_create() {
 }
 
 void Block::draw() {
-    GFX::push_mesh("CUBE", "TILES", position, rotation, scale);
+    GFX::push_mesh(AssetIDs::CUBE, AssetIDs::TILES, position, rotation, scale);
 }
 
 void Light::draw() {
@@ -96,6 +98,7 @@ void LightUpdate::callback() {
     l->position = Vec3::from(position);
     l->color = Color3::from(color);
     l->draw_as_point = draw_as_point;
+    GAMESTATE()->entity_system.moved(entity_id);
 }
 
 void PlayerInput::callback() {
@@ -236,7 +239,7 @@ IMPL_IMGUI(Player, ([&]() {
 
 void Player::draw() {
     scale = Vec3(1., 2., 3.) * 0.3;
-    GFX::push_mesh("MONKEY", "TILES", position, rotation, scale);
+    GFX::push_mesh(AssetIDs::MONKEY, AssetIDs::TILES, position, rotation, scale);
 
     if (hit) {
         Physics::draw_manifold(hit, Color4(1.0, 1.0, 1.0, 1.0));
@@ -253,6 +256,7 @@ void PlayerUpdate::callback() {
     if (!GAMESTATE()->entity_system.have_ownership(entity_id)) {
         p->rotation = H(rotation);
     }
+    GAMESTATE()->entity_system.moved(entity_id);
 }
 
 void SoundEntity::update() {
@@ -299,6 +303,469 @@ void SoundEntity::on_remove() {
     GAMESTATE()->audio_struct->stop_sound(audio_id);
 }
 
+// Fibonacci hashing, the low bits of IDs from different
+// clients are the same.
+static u32 entity_bucket(EntityID id, u64 capacity) {
+    u32 bits = std::countr_zero(capacity);
+    return (id * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+}
+
+// The position in the index of the entity, or
+// of the empty entry where it would go.
+u32 EntityMap::probe(EntityID id) const {
+    u64 mask = index.size() - 1;
+    u32 at = entity_bucket(id, index.size());
+    while (index[at].dense != EMPTY && index[at].id != id) {
+        at = (at + 1) & mask;
+    }
+    return at;
+}
+
+bool EntityMap::contains(EntityID id) const {
+    return find(id) != nullptr;
+}
+
+BaseEntity *EntityMap::find(EntityID id) const {
+    if (index.empty()) return nullptr;
+    const IndexEntry &entry = index[probe(id)];
+    return entry.dense == EMPTY ? nullptr : groups[entry.group].entities[entry.dense];
+}
+
+EntityMap::Slot EntityMap::slot(EntityID id) const {
+    if (index.empty()) return { 0, EMPTY };
+    const IndexEntry &entry = index[probe(id)];
+    return { entry.group, entry.dense };
+}
+
+void EntityMap::grow() {
+    u64 capacity = Math::max<u64>(MIN_CAPACITY, index.size() * 2);
+    index.assign(capacity, { 0, 0, EMPTY });
+    for (u32 group = 0; group < groups.size(); group++) {
+        const Group &g = groups[group];
+        for (u32 i = 0; i < g.ids.size(); i++) {
+            index[probe(g.ids[i])] = { g.ids[i], group, i };
+        }
+    }
+}
+
+void EntityMap::insert(EntityID id, BaseEntity *entity, u32 group) {
+    if ((num_entities + 1) * 2 > index.size()) grow();
+    IndexEntry &entry = index[probe(id)];
+    ASSERT(entry.dense == EMPTY, "Entity {} is already in the map", id);
+    if (group >= groups.size()) groups.resize(group + 1);
+    Group &g = groups[group];
+    entry = { id, group, (u32)g.entities.size() };
+    g.entities.push_back(entity);
+    g.ids.push_back(id);
+    num_entities++;
+}
+
+void EntityMap::erase(EntityID id) {
+    ASSERT(!index.empty(), "Erasing entity {} from an empty map", id);
+    u64 mask = index.size() - 1;
+    u32 hole = probe(id);
+    IndexEntry removed = index[hole];
+    ASSERT(removed.dense != EMPTY, "Erasing entity {} that isn't in the map", id);
+
+    // Move the last entity of the group into the dense hole.
+    Group &g = groups[removed.group];
+    u32 last = g.entities.size() - 1;
+    if (removed.dense != last) {
+        g.entities[removed.dense] = g.entities[last];
+        g.ids[removed.dense] = g.ids[last];
+        index[probe(g.ids[removed.dense])].dense = removed.dense;
+    }
+    g.entities.pop_back();
+    g.ids.pop_back();
+    num_entities--;
+
+    // Shift the entries after the hole back, so
+    // lookups don't stop early at it.
+    index[hole].dense = EMPTY;
+    for (u32 at = (hole + 1) & mask; index[at].dense != EMPTY; at = (at + 1) & mask) {
+        u32 home = entity_bucket(index[at].id, index.size());
+        // Stays if its home is cyclically in (hole, at].
+        bool stays = hole <= at ? (hole < home && home <= at) : (hole < home || home <= at);
+        if (stays) continue;
+        index[hole] = index[at];
+        index[at].dense = EMPTY;
+        hole = at;
+    }
+}
+
+void EntityMap::clear() {
+    groups.clear();
+    index.clear();
+    num_entities = 0;
+}
+
+static i32 grid_cell(real x) {
+    return Math::floor<i32>(x / EntityGrid::CELL_SIZE);
+}
+
+static u64 grid_key(i32 x, i32 y, i32 z) {
+    const u64 MASK = 0x1FFFFF;
+    return (((u64)x & MASK) << 42) | (((u64)y & MASK) << 21) | ((u64)z & MASK);
+}
+
+// The coordinate of the cell along the axis, x is 0.
+static i32 grid_key_cell(u64 key, u32 axis) {
+    u32 bits = (key >> (42 - 21 * axis)) & 0x1FFFFF;
+    // Sign extends the 21 bits.
+    return (i32)(bits << 11) >> 11;
+}
+
+static void unlink(std::vector<EntityID> *ids, EntityID id) {
+    auto it = std::find(ids->begin(), ids->end(), id);
+    ASSERT(it != ids->end(), "Entity {} is missing from the grid", id);
+    *it = ids->back();
+    ids->pop_back();
+}
+
+static void grid_unlink(EntityGrid *grid, EntityID id, const EntityGrid::Entry &entry) {
+    if (entry.large) {
+        unlink(&grid->large, id);
+        return;
+    }
+    for (i32 x = entry.lo[0]; x <= entry.hi[0]; x++)
+        for (i32 y = entry.lo[1]; y <= entry.hi[1]; y++)
+            for (i32 z = entry.lo[2]; z <= entry.hi[2]; z++) {
+                auto cell = grid->cells.find(grid_key(x, y, z));
+                unlink(&cell->second, id);
+                if (cell->second.empty()) grid->cells.erase(cell);
+            }
+}
+
+static void grid_link(EntityGrid *grid, EntityID id, const EntityGrid::Entry &entry) {
+    if (entry.large) {
+        grid->large.push_back(id);
+        return;
+    }
+    for (i32 x = entry.lo[0]; x <= entry.hi[0]; x++)
+        for (i32 y = entry.lo[1]; y <= entry.hi[1]; y++)
+            for (i32 z = entry.lo[2]; z <= entry.hi[2]; z++)
+                grid->cells[grid_key(x, y, z)].push_back(id);
+}
+
+void EntityGrid::update(EntityID id, Vec3 min, Vec3 max) {
+    Entry entry = { min, max };
+    u64 num_cells = 1;
+    for (u32 k = 0; k < 3; k++) {
+        entry.lo[k] = grid_cell(min._[k]);
+        entry.hi[k] = grid_cell(max._[k]);
+        num_cells *= entry.hi[k] - entry.lo[k] + 1;
+    }
+    entry.large = num_cells > MAX_ENTITY_CELLS;
+
+    auto it = entries.find(id);
+    if (it != entries.end()) {
+        Entry &old = it->second;
+        bool same_cells = old.large == entry.large
+                          && std::equal(old.lo, old.lo + 3, entry.lo)
+                          && std::equal(old.hi, old.hi + 3, entry.hi);
+        if (same_cells) {
+            old = entry;
+            return;
+        }
+        grid_unlink(this, id, old);
+    }
+    grid_link(this, id, entry);
+    entries[id] = entry;
+}
+
+void EntityGrid::remove(EntityID id) {
+    auto it = entries.find(id);
+    if (it == entries.end()) return;
+    grid_unlink(this, id, it->second);
+    entries.erase(it);
+}
+
+void EntityGrid::clear() {
+    entries.clear();
+    cells.clear();
+    large.clear();
+}
+
+bool EntityGrid::pick(Vec3 origin, Vec3 dir, f32 max_t, EntityID *hit, f32 *hit_t) const {
+    bool found = false;
+    f32 closest = max_t;
+    auto test = [&](EntityID id) {
+        const Entry &entry = entries.at(id);
+        Physics::AABody box = {};
+        box.position = (entry.min + entry.max) * 0.5;
+        box.half_size = (entry.max - entry.min) * 0.5;
+        Physics::Manifold manifold = Physics::collision_line_aabody(origin, dir, &box);
+        if (manifold.t > 0 && manifold.t < closest) {
+            closest = manifold.t;
+            *hit = id;
+            found = true;
+        }
+    };
+    for (EntityID id : large) test(id);
+
+    // Walk the cells the ray passes through in order, a hit in a
+    // cell can't be beaten by the cells after the hit.
+    const f32 NEVER = 1e30;
+    i32 cell[3];
+    i32 step[3];
+    f32 next_t[3];
+    f32 delta_t[3];
+    for (u32 k = 0; k < 3; k++) {
+        cell[k] = grid_cell(origin._[k]);
+        if (dir._[k] > 0) {
+            step[k] = 1;
+            next_t[k] = ((cell[k] + 1) * CELL_SIZE - origin._[k]) / dir._[k];
+            delta_t[k] = CELL_SIZE / dir._[k];
+        } else if (dir._[k] < 0) {
+            step[k] = -1;
+            next_t[k] = (cell[k] * CELL_SIZE - origin._[k]) / dir._[k];
+            delta_t[k] = -CELL_SIZE / dir._[k];
+        } else {
+            step[k] = 0;
+            next_t[k] = NEVER;
+            delta_t[k] = NEVER;
+        }
+    }
+    for (f32 t = 0; t < closest;) {
+        auto it = cells.find(grid_key(cell[0], cell[1], cell[2]));
+        if (it != cells.end()) {
+            for (EntityID id : it->second) test(id);
+        }
+        u32 k = 0;
+        if (next_t[1] < next_t[k]) k = 1;
+        if (next_t[2] < next_t[k]) k = 2;
+        t = next_t[k];
+        cell[k] += step[k];
+        next_t[k] += delta_t[k];
+    }
+    if (found) *hit_t = closest;
+    return found;
+}
+
+// If a sphere is inside the cone, with some margin.
+static bool in_cone(Vec3 origin, Vec3 forward, f32 half_angle, f32 max_t, Vec3 center, f32 radius) {
+    Vec3 to = center - origin;
+    f32 distance = length(to);
+    if (distance <= radius) return true;
+    if (distance > max_t + radius) return false;
+    real cos_angle = Math::min<real>(1.0, Math::max<real>(-1.0, dot(to, forward) / distance));
+    f32 angle = Math::acos(cos_angle);
+    return angle <= half_angle + Math::asin(radius / distance);
+}
+
+void EntityGrid::visible(Vec3 origin, Vec3 forward, f32 half_angle, f32 max_t,
+                         std::vector<EntityID> *out) const {
+    out->clear();
+    const f32 CELL_RADIUS = CELL_SIZE * Math::sqrt(3.0) * 0.5;
+    for (const auto &[key, ids] : cells) {
+        Vec3 center;
+        for (u32 k = 0; k < 3; k++) {
+            center._[k] = (grid_key_cell(key, k) + 0.5) * CELL_SIZE;
+        }
+        if (in_cone(origin, forward, half_angle, max_t, center, CELL_RADIUS)) {
+            out->insert(out->end(), ids.begin(), ids.end());
+        }
+    }
+    for (EntityID id : large) {
+        const Entry &entry = entries.at(id);
+        Vec3 center = (entry.min + entry.max) * 0.5;
+        if (in_cone(origin, forward, half_angle, max_t, center, length(entry.max - center))) {
+            out->push_back(id);
+        }
+    }
+    std::sort(out->begin(), out->end());
+    out->erase(std::unique(out->begin(), out->end()), out->end());
+}
+
+void *EntityPool::alloc() {
+    if (!free_list) {
+        u8 *chunk = new u8[(u64)slot_size * CHUNK_SIZE];
+        chunks.push_back(chunk);
+        // Linked backwards, so the slots are handed out in order.
+        for (u32 i = CHUNK_SIZE; i > 0; i--) {
+            u8 *slot = chunk + (u64)slot_size * (i - 1);
+            *(void **)slot = free_list;
+            free_list = slot;
+        }
+    }
+    void *slot = free_list;
+    free_list = *(void **)slot;
+    num_used++;
+    return slot;
+}
+
+void EntityPool::free(void *slot) {
+    ASSERT(owns(slot), "Freeing an entity from another pool");
+    *(void **)slot = free_list;
+    free_list = slot;
+    num_used--;
+}
+
+bool EntityPool::owns(const void *slot) const {
+    for (u8 *chunk : chunks) {
+        if (slot >= chunk && slot < chunk + (u64)slot_size * CHUNK_SIZE) return true;
+    }
+    return false;
+}
+
+static_assert(LEN(ENTITY_TYPE_SIZES) == (u64)EntityType::NUM_ENTITY_TYPES);
+
+void *EntitySystem::alloc_entity(EntityType type, u32 size) {
+    if (pools.empty()) {
+        pools.resize((u32)EntityType::NUM_ENTITY_TYPES);
+        for (u32 i = 0; i < pools.size(); i++) {
+            // The free list is stored in the slots.
+            pools[i].slot_size = Math::max<u32>(ENTITY_TYPE_SIZES[i], sizeof(void *));
+        }
+    }
+    EntityPool *pool = &pools[(u32)type];
+    if (size > pool->slot_size) return ::operator new(size);
+    return pool->alloc();
+}
+
+void EntitySystem::free_entity(BaseEntity *e) {
+    EntityPool *pool = pools.empty() ? nullptr : &pools[(u32)e->type];
+    e->~BaseEntity();
+    if (pool && pool->owns(e)) {
+        pool->free(e);
+    } else {
+        ::operator delete(e);
+    }
+}
+
+u32 EntitySystem::group_of(BaseEntity *e) {
+    if (typeid(*e) == *entity_type_infos[(u32)e->type]) return (u32)e->type;
+    return (u32)EntityType::NUM_ENTITY_TYPES;
+}
+
+// 0 is the main thread, the workers are numbered from 1.
+thread_local u32 entity_worker_index = 0;
+
+void EntitySystem::run_batch(u32 group, EntityBatchFunc func) {
+    if (group >= entities.groups.size()) return;
+    std::vector<BaseEntity *> &group_entities = entities.groups[group].entities;
+    func(group_entities.data(), group_entities.size());
+}
+
+static void run_batches(EntityWorkers *workers) {
+    for (;;) {
+        u32 start = SDL_AtomicAdd(&workers->next, PARALLEL_BATCH_SIZE);
+        if (start >= workers->num_entities) return;
+        u32 num = Math::min(PARALLEL_BATCH_SIZE, workers->num_entities - start);
+        workers->func(workers->entities + start, num);
+    }
+}
+
+void EntitySystem::run_batch_parallel(u32 group, EntityBatchFunc func) {
+    if (group >= entities.groups.size()) return;
+    std::vector<BaseEntity *> &group_entities = entities.groups[group].entities;
+    if (!workers || group_entities.size() < PARALLEL_BATCH_SIZE * 2) {
+        run_batch(group, func);
+        return;
+    }
+    ASSERT(deferring, "Adds and removes have to be deferred when updating in parallel");
+
+    ASSERT(SDL_LockMutex(workers->lock) == 0, "Failed to lock entity workers");
+    workers->entities = group_entities.data();
+    workers->num_entities = group_entities.size();
+    workers->func = func;
+    SDL_AtomicSet(&workers->next, 0);
+    workers->num_busy = workers->num_workers;
+    workers->generation++;
+    SDL_CondBroadcast(workers->work_signal);
+    SDL_UnlockMutex(workers->lock);
+
+    run_batches(workers);
+
+    ASSERT(SDL_LockMutex(workers->lock) == 0, "Failed to lock entity workers");
+    while (workers->num_busy) {
+        SDL_CondWait(workers->done_signal, workers->lock);
+    }
+    SDL_UnlockMutex(workers->lock);
+}
+
+static int entity_worker(void *data) {
+    EntityWorkers *workers = (EntityWorkers *)data;
+    entity_worker_index = SDL_AtomicAdd(&workers->started, 1) + 1;
+    u32 seen = 0;
+    for (;;) {
+        ASSERT(SDL_LockMutex(workers->lock) == 0, "Failed to lock entity workers");
+        while (workers->running && workers->generation == seen) {
+            SDL_CondWait(workers->work_signal, workers->lock);
+        }
+        if (!workers->running) {
+            SDL_UnlockMutex(workers->lock);
+            return 0;
+        }
+        seen = workers->generation;
+        SDL_UnlockMutex(workers->lock);
+
+        run_batches(workers);
+
+        ASSERT(SDL_LockMutex(workers->lock) == 0, "Failed to lock entity workers");
+        if (--workers->num_busy == 0) SDL_CondSignal(workers->done_signal);
+        SDL_UnlockMutex(workers->lock);
+    }
+}
+
+void EntitySystem::start_workers(u32 num_workers) {
+    ASSERT(!workers, "Entity workers are already running");
+    ASSERT(num_workers <= MAX_ENTITY_WORKERS, "Invalid number of entity workers {}", num_workers);
+    if (num_workers == 0) return;
+
+    workers = new EntityWorkers();
+    workers->lock = SDL_CreateMutex();
+    workers->work_signal = SDL_CreateCond();
+    workers->done_signal = SDL_CreateCond();
+    workers->running = true;
+    workers->num_workers = num_workers;
+    for (u32 i = 0; i < num_workers; i++) {
+        workers->threads[i] = SDL_CreateThread(entity_worker, "EntityWorker", workers);
+        ASSERT(workers->threads[i], "Failed to start entity worker: {}", SDL_GetError());
+    }
+}
+
+void EntitySystem::stop_workers() {
+    if (!workers) return;
+
+    ASSERT(SDL_LockMutex(workers->lock) == 0, "Failed to lock entity workers");
+    workers->running = false;
+    SDL_CondBroadcast(workers->work_signal);
+    SDL_UnlockMutex(workers->lock);
+
+    for (u32 i = 0; i < workers->num_workers; i++) {
+        SDL_WaitThread(workers->threads[i], NULL);
+    }
+    SDL_DestroyCond(workers->work_signal);
+    SDL_DestroyCond(workers->done_signal);
+    SDL_DestroyMutex(workers->lock);
+    delete workers;
+    workers = nullptr;
+}
+
+void EntitySystem::queue_command(EntityCommand command) {
+    commands[entity_worker_index].push_back(command);
+}
+
+// The main thread's commands first, then the workers' in order.
+void EntitySystem::apply_commands() {
+    ASSERT(!deferring, "Applying entity commands while they are deferred");
+    for (std::vector<EntityCommand> &buffer : commands) {
+        for (EntityCommand &command : buffer) {
+            command();
+        }
+        buffer.clear();
+    }
+}
+
+// Groups of types that don't derive from Entity are skipped before
+// this. The entities in the last group are checked one at a time,
+// since the type system doesn't know their types.
+static Entity *transform_of(EntityMap::Group &g, u32 group, u32 i) {
+    if (group < (u32)EntityType::NUM_ENTITY_TYPES) return static_cast<Entity *>(g.entities[i]);
+    return dynamic_cast<Entity *>(g.entities[i]);
+}
+
 bool EntitySystem::is_valid(EntityID id) {
     return entities.contains(id);
 }
@@ -312,52 +779,124 @@ bool EntitySystem::have_ownership(EntityID id) {
 
 void EntitySystem::remove(EntityID id) {
     ASSERT(is_valid(id), "Removing invalid entity id {}", id);
-    entities[id]->on_remove();
-    delete entities[id];
+    if (deferring) {
+        queue_command([this, id]() { remove(id); });
+        return;
+    }
+    BaseEntity *e = entities.find(id);
+    e->on_remove();
+    if (grid) grid->remove(id);
     entities.erase(id);
+    free_entity(e);
 }
 
 void EntitySystem::remove_all() {
     for (auto [_, e] : entities) {
         e->on_remove();
-        delete e;
+        free_entity(e);
     }
     entities.clear();
+    if (grid) grid->clear();
+    // The bodies are otherwise only dropped when their entity is
+    // gone, which it isn't if the same IDs are added again.
+    GAMESTATE()->physics_engine.clear();
 }
 
 void EntitySystem::update() {
-#if IMGUI_ENABLE
-    for (auto [id, e] : entities) {
-        Physics::AABody box = {};
-        if (Vec3 *p = get_field_by_name_no_warn<Vec3>(e, FieldName::position)) {
-            box.position = *p;
+    deferring = true;
+    update_entities();
+    deferring = false;
+    apply_commands();
+
+    // Erasing swaps in the last entity of the
+    // group, which is checked before moving on.
+    for (EntityMap::Group &group : entities.groups) {
+        for (u32 i = 0; i < group.entities.size();) {
+            BaseEntity *e = group.entities[i];
+            if (e->remove) {
+                EntityID id = group.ids[i];
+                e->on_remove();
+                if (grid) grid->remove(id);
+                entities.erase(id);
+                free_entity(e);
+            } else {
+                i++;
+            }
         }
+    }
+#if IMGUI_ENABLE
+    update_editor();
+#endif
+}
 
-        // Size for boxes that doesn't have a scale.
-        box.half_size = Vec3(1.0, 1.0, 1.0) * 0.2;
-        if (Vec3 *s = get_field_by_name_no_warn<Vec3>(e, FieldName::scale)) {
-            box.half_size = (*s) * 0.5;
-        }
+// Puts the box of the entity in the grid, entities that aren't
+// derived from Entity get a small box at the origin.
+static void update_grid_entry(EntityGrid *grid, EntityMap::Group &g, u32 group, u32 i) {
+    bool transforms = group == (u32)EntityType::NUM_ENTITY_TYPES || ENTITY_TYPE_TRANSFORMS[group];
+    Vec3 center = Vec3();
+    Vec3 half_size = Vec3(1.0, 1.0, 1.0) * 0.2;
+    if (Entity *e = transforms ? transform_of(g, group, i) : nullptr) {
+        center = e->position;
+        half_size = e->scale * 0.5;
+    }
+    grid->update(g.ids[i], center - half_size, center + half_size);
+}
 
-        Vec3 start = GFX::current_camera()->position;
-        Vec3 dir = GFX::current_camera()->get_forward();
-        Physics::Manifold manifold = Physics::collision_line_aabody(start, dir, &box);
-        // TODO(ed): Only select the closest.
-        bool hovering = manifold.t > 0;
-
-        Color4 nothing_color = { 0., 0., 0., 1. };
-        Color4 hovering_color = { 0., 0.5, 0.5, 1. };
-        Color4 selected_color = { 0., 0.5, 0., 1. };
-        Color4 selected_and_hover_color = { 0., 0.5, 0.8, 1. };
-
-        if (hovering && Input::pressed(Ac::ESelect)) {
-            if (selected.contains(id))
-                selected.erase(id);
-            else
-                selected.insert(id);
+void EntitySystem::update_grid() {
+    for (u32 group = 0; group < entities.groups.size(); group++) {
+        EntityMap::Group &g = entities.groups[group];
+        for (u32 i = 0; i < g.entities.size(); i++) {
+            update_grid_entry(grid, g, group, i);
         }
+    }
+}
 
-        if (hovering) {
+void EntitySystem::moved(EntityID id) {
+    if (!grid) return;
+    EntityMap::Slot slot = entities.slot(id);
+    if (slot.dense == EntityMap::EMPTY) return;
+    update_grid_entry(grid, entities.groups[slot.group], slot.group, slot.dense);
+}
+
+void EntitySystem::update_editor() {
+    if (!grid) {
+        grid = new EntityGrid();
+        update_grid();
+    }
+
+    // As far as the far plane.
+    const f32 VIEW_DISTANCE = 100.0;
+    GFX::Camera *camera = GFX::current_camera();
+    Vec3 start = camera->position;
+    Vec3 dir = camera->get_forward();
+    EntityID hovered;
+    f32 hovered_t;
+    bool hovering = grid->pick(start, dir, VIEW_DISTANCE, &hovered, &hovered_t);
+    if (hovering && Input::pressed(Ac::ESelect)) {
+        if (selected.contains(hovered))
+            selected.erase(hovered);
+        else
+            selected.insert(hovered);
+    }
+
+    Color4 nothing_color = { 0., 0., 0., 1. };
+    Color4 hovering_color = { 0., 0.5, 0.5, 1. };
+    Color4 selected_color = { 0., 0.5, 0., 1. };
+    Color4 selected_and_hover_color = { 0., 0.5, 0.8, 1. };
+
+    // The cone around the frustum, the fov is vertical.
+    f32 half_angle = Math::atan(Math::tan(camera->fov / 2.0)
+                                * Math::sqrt(1.0 + camera->aspect_ratio * camera->aspect_ratio));
+    std::vector<EntityID> visible;
+    grid->visible(start, dir, half_angle, VIEW_DISTANCE, &visible);
+    for (EntityID id : visible) {
+        const EntityGrid::Entry &entry = grid->entries.at(id);
+        Physics::AABody box = {};
+        box.position = (entry.min + entry.max) * 0.5;
+        box.half_size = (entry.max - entry.min) * 0.5;
+
+        bool is_hovered = hovering && id == hovered;
+        if (is_hovered) {
             if (selected.contains(id)) {
                 Physics::draw_aabody(box, selected_and_hover_color);
             } else {
@@ -369,21 +908,6 @@ void EntitySystem::update() {
             Physics::draw_aabody(box, nothing_color);
         }
     }
-#endif
-
-    for (auto [_, e] : entities) {
-        e->update();
-    }
-    for (auto i = entities.begin(), last = entities.end(); i != last;) {
-        BaseEntity *e = i->second;
-        if (e->remove) {
-            e->on_remove();
-            delete e;
-            i = entities.erase(i);
-        } else {
-            i++;
-        }
-    }
 }
 
 void EntitySystem::send_state(ClientHandle *handle) {
@@ -460,29 +984,26 @@ void EntitySystem::drop_client(u64 client_id) {
 
 void EntitySystem::draw() {
     draw_imgui();
-    for (auto [_, e] : entities) {
-        e->draw();
-    }
+    draw_entities();
+}
+
+// Nullptr if the entity doesn't have the field.
+static const Field *find_field(BaseEntity *e, FieldNameType name) {
+    FieldID id = field_id(name);
+    if (id == FieldID::NUM_FIELD_IDS) return nullptr;
+    i8 slot = FIELD_SLOTS[(u32)e->type][(u32)id];
+    if (slot == -1) return nullptr;
+    return FIELD_TABLES[(u32)e->type] + slot;
 }
 
 bool has_field_by_name(BaseEntity *e, FieldNameType name) {
-    FieldList types = get_fields_for(e->type);
-    for (i32 i = 0; i < types.num_fields; i++) {
-        if (types.list[i].name == name)
-            return true;
-    }
-    return false;
+    return find_field(e, name) != nullptr;
 }
 
 void *_fetch_field_by_name_helper(BaseEntity *e, FieldNameType name, const std::type_info &info) {
-    FieldList types = get_fields_for(e->type);
-    for (i32 i = 0; i < types.num_fields; i++) {
-        Field field = types.list[i];
-        if (field.name == name && field.typeinfo == info) {
-            return ((u8 *)e) + field.offset;
-        }
-    }
-    return nullptr;
+    const Field *field = find_field(e, name);
+    if (!field || field->typeinfo != info) return nullptr;
+    return ((u8 *)e) + field->offset;
 }
 
 const char *type_name(BaseEntity *e) {
@@ -564,6 +1085,233 @@ TEST_CASE("entity_id_valid", {
     return true;
 });
 
+TEST_CASE("entity map", {
+    EntityMap map;
+    BaseEntity entities[1000];
+    // IDs from two clients, with the same low bits.
+    auto id_of = [](u32 i) -> EntityID {
+        return ((u64)(i % 2) << 56) | (i / 2);
+    };
+    for (u32 i = 0; i < LEN(entities); i++) {
+        map.insert(id_of(i), entities + i, i % 3);
+    }
+    // Remove every third, so the index has to shift entries back.
+    for (u32 i = 0; i < LEN(entities); i += 3) {
+        map.erase(id_of(i));
+    }
+    for (u32 i = 0; i < LEN(entities); i++) {
+        BaseEntity *expected = i % 3 == 0 ? nullptr : entities + i;
+        if (map.find(id_of(i)) != expected) return false;
+    }
+    u32 seen = 0;
+    for (auto [id, e] : map) {
+        if (map.find(id) != e) return false;
+        seen++;
+    }
+    return seen == map.size() && seen == LEN(entities) - (LEN(entities) + 2) / 3;
+});
+
+TEST_CASE("entity pool", {
+    GAMESTATE()->logger.levels &= ~LogLevel::TRACE;
+    EntityID a_id = entity_system()->add(Block());
+    EntityID b_id = entity_system()->add(Block());
+    Block *a = entity_system()->fetch<Block>(a_id);
+    Block *b = entity_system()->fetch<Block>(b_id);
+    // Next to each other, in either order.
+    if (std::abs((u8 *)b - (u8 *)a) != (i64)sizeof(Block)) return false;
+
+    entity_system()->remove(a_id);
+    EntityID c_id = entity_system()->add(Block());
+    Block *c = entity_system()->fetch<Block>(c_id);
+    EntityPool *pool = &entity_system()->pools[(u32)EntityType::BLOCK];
+    bool reused = c == a && pool->owns(c);
+    entity_system()->remove(b_id);
+    entity_system()->remove(c_id);
+    return reused && pool->num_used == 0;
+});
+
+TEST_CASE("entity groups", {
+    GAMESTATE()->logger.levels &= ~LogLevel::TRACE;
+    int calls = 0;
+    struct TestEnt : public Entity {
+        int *value;
+        void update() { value[0]++; };
+        void draw() {}
+    };
+    TestEnt t;
+    t.value = &calls;
+    EntityID block_id = entity_system()->add(Block());
+    EntityID test_id = entity_system()->add(t);
+    auto &groups = entity_system()->entities.groups;
+    auto in_group = [&groups](u32 group, BaseEntity *e) {
+        auto &entities = groups[group].entities;
+        return std::find(entities.begin(), entities.end(), e) != entities.end();
+    };
+    bool grouped =
+        in_group((u32)EntityType::BLOCK, entity_system()->fetch<Block>(block_id))
+        && in_group((u32)EntityType::NUM_ENTITY_TYPES, entity_system()->fetch<TestEnt>(test_id));
+    // Derived types the type system doesn't know still get updated.
+    entity_system()->update_entities();
+    entity_system()->remove(block_id);
+    entity_system()->remove(test_id);
+    return grouped && calls == 1;
+});
+
+TEST_CASE("entity slots", {
+    GAMESTATE()->logger.levels &= ~LogLevel::TRACE;
+    Block a;
+    a.position = Vec3(1, 2, 3);
+    Block b;
+    b.position = Vec3(4, 5, 6);
+    EntityID a_id = entity_system()->add(a);
+    EntityID b_id = entity_system()->add(b);
+
+    // Removing a moves b in its place.
+    EntityMap *map = &entity_system()->entities;
+    u32 a_dense = map->slot(a_id).dense;
+    entity_system()->remove(a_id);
+    EntityMap::Slot slot = map->slot(b_id);
+    Block *b_ptr = (Block *)map->groups[slot.group].entities[slot.dense];
+    bool moved = slot.group == (u32)EntityType::BLOCK
+                 && slot.dense == a_dense
+                 && length(b_ptr->position - Vec3(4, 5, 6)) < 0.01;
+    entity_system()->remove(b_id);
+    return moved && map->slot(a_id).dense == EntityMap::EMPTY;
+});
+
+TEST_CASE("entity parallel update", {
+    GAMESTATE()->logger.levels &= ~LogLevel::TRACE;
+    struct TestEnt : public BaseEntity {
+        int generation = 0;
+    };
+    const u32 NUM_ENTITIES = PARALLEL_BATCH_SIZE * 5 + 3;
+    std::vector<EntityID> ids;
+    for (u32 i = 0; i < NUM_ENTITIES; i++) {
+        ids.push_back(entity_system()->add(TestEnt()));
+    }
+
+    // Every entity is replaced by one of the next generation.
+    EntityBatchFunc replace = [](BaseEntity **entities, u32 num_entities) {
+        for (u32 i = 0; i < num_entities; i++) {
+            TestEnt next;
+            next.generation = ((TestEnt *)entities[i])->generation + 1;
+            entity_system()->add(next);
+            entity_system()->remove(entities[i]->entity_id);
+        }
+    };
+    entity_system()->start_workers(3);
+    entity_system()->deferring = true;
+    entity_system()->run_batch_parallel((u32)EntityType::NUM_ENTITY_TYPES, replace);
+    entity_system()->deferring = false;
+    // Nothing changes before the sync point.
+    bool deferred = entity_system()->is_valid(ids[0]) && entity_system()->entities.size() >= NUM_ENTITIES;
+    entity_system()->apply_commands();
+    entity_system()->stop_workers();
+
+    u32 replaced = 0;
+    for (auto [id, e] : entity_system()->entities) {
+        if (TestEnt *t = dynamic_cast<TestEnt *>(e)) {
+            replaced += t->generation == 1;
+        }
+    }
+    bool removed = std::none_of(ids.begin(), ids.end(), [](EntityID id) { return entity_system()->is_valid(id); });
+    entity_system()->remove_all();
+    return deferred && removed && replaced == NUM_ENTITIES && !entity_system()->workers;
+});
+
+TEST_CASE("entity grid", {
+    EntityGrid grid;
+    // A row of boxes along -z, and one big floor.
+    for (u32 i = 0; i < 10; i++) {
+        Vec3 center = Vec3(0, 0, -3.0 * i - 3.0);
+        grid.update(i, center - Vec3(0.5, 0.5, 0.5), center + Vec3(0.5, 0.5, 0.5));
+    }
+    grid.update(100, Vec3(-50, -3, -50), Vec3(50, -2, 50));
+    ASSERT_EQ(grid.large.size(), 1);
+
+    EntityID hit;
+    f32 hit_t;
+    ASSERT(grid.pick(Vec3(0, 0, 0), Vec3(0, 0, -1), 100.0, &hit, &hit_t), "Missed the row");
+    ASSERT_EQ(hit, 0);
+    ASSERT_LT(Math::abs(hit_t - 2.5), 0.01);
+
+    // Moving the first box away uncovers the second.
+    grid.update(0, Vec3(20, 0, 0), Vec3(21, 1, 1));
+    ASSERT(grid.pick(Vec3(0, 0, 0), Vec3(0, 0, -1), 100.0, &hit, &hit_t), "Missed the row");
+    ASSERT_EQ(hit, 1);
+    grid.remove(1);
+    ASSERT(grid.pick(Vec3(0, 0, 0), Vec3(0, 0, -1), 100.0, &hit, &hit_t), "Missed the row");
+    ASSERT_EQ(hit, 2);
+    ASSERT(grid.pick(Vec3(0, 0, 0), Vec3(0, -1, 0), 100.0, &hit, &hit_t), "Missed the floor");
+    ASSERT_EQ(hit, 100);
+    ASSERT(!grid.pick(Vec3(0, 0, 0), Vec3(0, 1, 0), 100.0, &hit, &hit_t), "Hit something above");
+
+    // Looking down the row, the moved box is behind the camera.
+    std::vector<EntityID> visible;
+    grid.visible(Vec3(0, 0, 0), Vec3(0, 0, -1), 0.5, 100.0, &visible);
+    bool moved_visible = std::find(visible.begin(), visible.end(), 0) != visible.end();
+    bool floor_visible = std::find(visible.begin(), visible.end(), 100) != visible.end();
+    return !moved_visible && floor_visible && visible.size() == 9;
+});
+
+TEST_CASE("entity grid moves", {
+    GAMESTATE()->logger.levels &= ~LogLevel::TRACE;
+    EntityGrid grid;
+    entity_system()->grid = &grid;
+    entity_system()->update_grid();
+    // Entities added after the grid is filled are put in it.
+    Block b;
+    b.position = Vec3(0, 0, -5);
+    EntityID id = entity_system()->add(b);
+    EntityID hit;
+    f32 hit_t;
+    bool added = grid.pick(Vec3(0, 0, 0), Vec3(0, 0, -1), 100.0, &hit, &hit_t) && hit == id;
+
+    // The grid only changes when it's told.
+    entity_system()->fetch<Block>(id)->position = Vec3(0, 0, 5);
+    bool kept = grid.pick(Vec3(0, 0, 0), Vec3(0, 0, -1), 100.0, &hit, &hit_t);
+    entity_system()->moved(id);
+    bool moved = !grid.pick(Vec3(0, 0, 0), Vec3(0, 0, -1), 100.0, &hit, &hit_t)
+                 && grid.pick(Vec3(0, 0, 0), Vec3(0, 0, 1), 100.0, &hit, &hit_t) && hit == id;
+    entity_system()->remove(id);
+    entity_system()->grid = nullptr;
+    return added && kept && moved && grid.entries.empty();
+});
+
+TEST_CASE("entity remove flag", {
+    GAMESTATE()->logger.levels &= ~LogLevel::TRACE;
+    struct TestEnt : public BaseEntity {
+        bool leaving = false;
+        void update() override { remove = leaving; }
+    };
+    // Every other entity leaves, the last one included,
+    // so the swapped in entities are checked too.
+    const u32 NUM_ENTITIES = 7;
+    std::vector<EntityID> ids;
+    for (u32 i = 0; i < NUM_ENTITIES; i++) {
+        TestEnt t;
+        t.leaving = i % 2 == 0;
+        ids.push_back(entity_system()->add(t));
+    }
+    EntityGrid grid;
+    entity_system()->grid = &grid;
+    entity_system()->update_grid();
+    entity_system()->update();
+    entity_system()->grid = nullptr;
+
+    bool survived = true;
+    for (u32 i = 0; i < NUM_ENTITIES; i++) {
+        bool leaving = i % 2 == 0;
+        survived &= entity_system()->is_valid(ids[i]) != leaving;
+        survived &= grid.entries.contains(ids[i]) != leaving;
+        if (!leaving)
+            survived &= entity_system()->fetch<TestEnt>(ids[i])->entity_id == ids[i];
+    }
+    bool counted = entity_system()->entities.size() == NUM_ENTITIES / 2;
+    entity_system()->remove_all();
+    return survived && counted;
+});
+
 TEST_CASE("entity fetch", {
     GAMESTATE()->logger.levels &= ~LogLevel::TRACE;
     struct TestEnt : public BaseEntity {
@@ -637,4 +1385,23 @@ TEST_CASE("entity add_unknown_type", {
     return true;
 });
 
+static_assert(field_offset<Light, FieldID::position>() == offsetof(Light, position));
+static_assert(field_offset<Player, FieldID::velocity>() == offsetof(Player, velocity));
+
+TEST_CASE("entity field lookup", {
+    Light l;
+    l.color = Color3(1, 2, 3);
+    l.type = EntityType::LIGHT;
+    ASSERT(field_id(FieldName::color) == FieldID::color, "Wrong FieldID for color");
+    // Only the FieldName::* are found, not other strings.
+    char name[] = "color";
+    ASSERT(field_id(name) == FieldID::NUM_FIELD_IDS, "Found a string that isn't a FieldName");
+
+    Color3 *color = get_field_by_name_no_warn<Color3>(&l, FieldName::color);
+    ASSERT(color == &l.color, "Wrong color field");
+    ASSERT(!get_field_by_name_no_warn<Vec3>(&l, FieldName::color), "Found a field of the wrong type");
+    ASSERT(!has_field_by_name(&l, FieldName::velocity), "Lights don't have velocity");
+    return has_field_by_name(&l, FieldName::position);
+});
+
 #undef IMPL_IMGUI
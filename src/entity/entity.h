@@ -1,6 +1,9 @@
 #pragma once
 #include <unordered_map>
+#include <vector>
 #include <set>
+#include <functional>
+#include <type_traits>
 #include "../math/smek_math.h"
 #include "../math/smek_vec.h"
 #include "../math/smek_quat.h"
@@ -44,6 +47,10 @@ struct SoundEntity : public BaseEntity {
 
     AudioID audio_id;
 
+    // Only touches the entity itself, so it's updated on
+    // the entity workers.
+    static constexpr bool PARALLEL_UPDATE = true;
+
     void imgui() override;
 
     void update() override;
@@ -128,7 +135,8 @@ struct Player : public Entity {
     static constexpr f32 FLOOR = 0.2;
     INTERNAL PlayerInput last_input;
     Vec3 velocity;
-    Physics::Manifold hit;
+    // Points at physics bodies, only valid for this frame.
+    INTERNAL Physics::Manifold hit;
 
     void imgui() override;
 
@@ -147,6 +155,206 @@ struct PlayerUpdate {
     void callback();
 };
 
+///* EntityMap
+// All entities, packed in dense arrays that are iterated without
+// chasing buckets. The entities are split into groups, one for
+// every entity type, see EntitySystem::group_of. Removing swaps
+// the last entity of the group into the hole, so the order
+// changes and iterators are invalidated by adds and removes.
+//
+// The index is an open-addressing table from EntityID to the
+// dense position. IDs are handed out by every client and can't
+// be positions themselves. They are never reused, so a stale ID
+// simply isn't found.
+struct EntityMap {
+    struct IndexEntry {
+        EntityID id;
+        u32 group;
+        u32 dense;
+    };
+    static constexpr u32 EMPTY = 0xFFFFFFFF;
+    static constexpr u32 MIN_CAPACITY = 64;
+
+    struct Group {
+        std::vector<BaseEntity *> entities;
+        std::vector<EntityID> ids;
+    };
+
+    struct Slot {
+        u32 group;
+        u32 dense;
+    };
+
+    std::vector<Group> groups;
+    u32 num_entities = 0;
+    // A power of two, at most half full.
+    std::vector<IndexEntry> index;
+
+    struct Iterator {
+        const EntityMap *map;
+        u32 group;
+        u32 i;
+
+        std::pair<EntityID, BaseEntity *> operator*() const {
+            const Group &g = map->groups[group];
+            return { g.ids[i], g.entities[i] };
+        }
+        Iterator &operator++() {
+            i++;
+            skip_empty();
+            return *this;
+        }
+        void skip_empty() {
+            while (group < map->groups.size() && i >= map->groups[group].entities.size()) {
+                group++;
+                i = 0;
+            }
+        }
+        bool operator!=(const Iterator &other) const { return group != other.group || i != other.i; }
+    };
+
+    Iterator begin() const {
+        Iterator it = { this, 0, 0 };
+        it.skip_empty();
+        return it;
+    }
+    Iterator end() const { return { this, (u32)groups.size(), 0 }; }
+    u32 size() const { return num_entities; }
+
+    bool contains(EntityID id) const;
+    // nullptr if the entity isn't in the map.
+    BaseEntity *find(EntityID id) const;
+    // The dense position of the entity, dense is EMPTY if it
+    // isn't in the map.
+    Slot slot(EntityID id) const;
+
+    void insert(EntityID id, BaseEntity *entity, u32 group);
+    void erase(EntityID id);
+    void clear();
+
+    u32 probe(EntityID id) const;
+    void grow();
+};
+
+///* EntityPool
+// Memory for the entities of one type. The slots are handed out
+// from chunks that are never freed, and removed entities go on a
+// free list, so adding and removing doesn't allocate once the
+// pool has grown. The free slots hold the next free slot.
+struct EntityPool {
+    static constexpr u32 CHUNK_SIZE = 256;
+
+    u32 slot_size;
+    std::vector<u8 *> chunks;
+    void *free_list;
+    u32 num_used;
+
+    void *alloc();
+    void free(void *slot);
+    bool owns(const void *slot) const;
+};
+
+///* EntityBatchFunc
+// Updates or draws the entities, which are all of the same type.
+using EntityBatchFunc = void (*)(BaseEntity **entities, u32 num_entities);
+
+///* update_batch, draw_batch
+// Calls update or draw on entities of type E without going through
+// the vtable. With BaseEntity the calls are virtual, for entities
+// of types the type system doesn't know.
+template <typename E>
+void update_batch(BaseEntity **entities, u32 num_entities) {
+    for (u32 i = 0; i < num_entities; i++) {
+        if constexpr (std::is_same_v<E, BaseEntity>)
+            entities[i]->update();
+        else
+            static_cast<E *>(entities[i])->E::update();
+    }
+}
+
+template <typename E>
+void draw_batch(BaseEntity **entities, u32 num_entities) {
+    for (u32 i = 0; i < num_entities; i++) {
+        if constexpr (std::is_same_v<E, BaseEntity>)
+            entities[i]->draw();
+        else
+            static_cast<E *>(entities[i])->E::draw();
+    }
+}
+
+///* EntityCommand
+// A change to the entity system that waits for the sync point
+// after the updates, like adding or removing an entity, or
+// writing to another entity.
+using EntityCommand = std::function<void()>;
+
+///* MAX_ENTITY_WORKERS
+// The maximum number of threads updating entities
+// together with the main thread.
+const u32 MAX_ENTITY_WORKERS = 7;
+
+///* PARALLEL_BATCH_SIZE
+// How many entities a thread takes at a time. Groups smaller
+// than two batches are updated on the main thread.
+const u32 PARALLEL_BATCH_SIZE = 64;
+
+///* EntityWorkers
+// Shared between the main thread and the entity workers. The
+// job is handed out a batch at a time through next, the rest
+// is guarded by the lock.
+struct EntityWorkers {
+    bool running;
+    u32 num_workers;
+    SDL_Thread *threads[MAX_ENTITY_WORKERS];
+    SDL_atomic_t started;
+
+    SDL_mutex *lock;
+    SDL_cond *work_signal;
+    SDL_cond *done_signal;
+    u32 generation;
+    u32 num_busy;
+
+    BaseEntity **entities;
+    u32 num_entities;
+    EntityBatchFunc func;
+    SDL_atomic_t next;
+};
+
+///* EntityGrid
+// A uniform grid over the boxes of the entities, so the editor can
+// pick and draw entities without testing every one of them. An
+// entity is in every cell its box touches, and only moves between
+// cells when that range changes. Entities that cover too many
+// cells are in a list that is always tested.
+struct EntityGrid {
+    static constexpr f32 CELL_SIZE = 4.0;
+    static constexpr u32 MAX_ENTITY_CELLS = 64;
+
+    struct Entry {
+        Vec3 min;
+        Vec3 max;
+        i32 lo[3];
+        i32 hi[3];
+        bool large;
+    };
+
+    std::unordered_map<EntityID, Entry> entries;
+    std::unordered_map<u64, std::vector<EntityID>> cells;
+    std::vector<EntityID> large;
+
+    void update(EntityID id, Vec3 min, Vec3 max);
+    void remove(EntityID id);
+    void clear();
+
+    // The closest entity the ray hits before max_t, the direction
+    // has to be normalized. False if it doesn't hit anything.
+    bool pick(Vec3 origin, Vec3 dir, f32 max_t, EntityID *hit, f32 *hit_t) const;
+    // The entities in cells that might be inside the cone, given
+    // by its half angle, with no entity twice.
+    void visible(Vec3 origin, Vec3 forward, f32 half_angle, f32 max_t,
+                 std::vector<EntityID> *out) const;
+};
+
 struct ServerHandle;
 struct ClientHandle;
 ///*
@@ -157,9 +365,22 @@ struct EntitySystem {
     u64 client_id = 0;
     u64 id_counter = 0;
 
-    std::unordered_map<EntityID, BaseEntity *> entities;
+    EntityMap entities;
+    // One for every EntityType, created on the first add.
+    std::vector<EntityPool> pools;
     std::set<EntityID> selected;
 
+    // Nullptr if the updates are all on the main thread.
+    EntityWorkers *workers = nullptr;
+    // Created when the editor first picks. After that it's kept up
+    // to date by the code that moves entities, see moved.
+    EntityGrid *grid = nullptr;
+    // Set while the entities are updated, adds and removes are
+    // queued as commands and applied after all the updates.
+    bool deferring = false;
+    // One buffer for every thread, the main thread has the first.
+    std::vector<EntityCommand> commands[MAX_ENTITY_WORKERS + 1];
+
     u64 next_id();
 
     bool is_valid(EntityID id);
@@ -172,12 +393,60 @@ struct EntitySystem {
     EntityID add(E entity) { return add_with_id(entity, next_id()); }
 
     EntityID add_unknown_type(BaseEntity *e);
+    EntityID add_unknown_type_with_id(BaseEntity *e, EntityID id);
+
+    // The group in the EntityMap the entity goes in. Every entity
+    // type has its own, and entities of types derived from them
+    // that the type system doesn't know about share the last one.
+    u32 group_of(BaseEntity *e);
+
+    // Memory for an entity of the type, from the pool if the
+    // entity fits. Entities derived from a type that aren't
+    // known to the type system (like in the tests) can be
+    // bigger, they get their memory from the heap.
+    void *alloc_entity(EntityType type, u32 size);
+    // Destroys the entity and gives back its memory.
+    void free_entity(BaseEntity *e);
 
     void remove(EntityID entity);
     void remove_all();
 
     void draw_imgui();
     void draw();
+    // Generated by the type system, calls update and draw on every
+    // entity a type at a time. The calls aren't virtual, and types
+    // that don't override them are skipped.
+    void update_entities();
+    void draw_entities();
+
+    // Calls the function on the entities in the group. The parallel
+    // version splits them across the workers, for the types marked
+    // with PARALLEL_UPDATE, and returns when all are done.
+    void run_batch(u32 group, EntityBatchFunc func);
+    void run_batch_parallel(u32 group, EntityBatchFunc func);
+
+    // Queues the command on the buffer of the calling thread.
+    void queue_command(EntityCommand command);
+    void apply_commands();
+
+    // Starts the threads that update entities, the main thread
+    // helps out so one less than the cores is enough.
+    //
+    // NOTE(ed): The workers run code in the game library,
+    // so stop them before unloading it.
+    void start_workers(u32 num_workers);
+    void stop_workers();
+
+    // Puts every entity in the grid, when it's created.
+    void update_grid();
+    // Moves the entity in the grid, after its position or scale
+    // changed. Physics, the network updates and the editor call
+    // it, so does anything else that moves entities.
+    void moved(EntityID id);
+    // Selects the entity in the middle of the screen and
+    // draws the boxes of the visible entities.
+    void update_editor();
+
     void send_state(ServerHandle *handle);
     void send_state(ClientHandle *handle);
     void send_initial_state(ClientHandle *handle);
@@ -195,7 +464,7 @@ struct EntitySystem {
 template <typename E>
 E *EntitySystem::fetch(EntityID id) {
     ASSERT(is_valid(id), "Fetching invalid entity id {}", id);
-    return dynamic_cast<E *>(entities[id]);
+    return dynamic_cast<E *>(entities.find(id));
 }
 
 ///*
@@ -204,12 +473,17 @@ template <typename E>
 EntityID EntitySystem::add_with_id(E entity, EntityID id) {
     ASSERT(!is_valid(id), "Adding multiple entities for id {}", id);
     TRACE("Adding with id {}", id);
-    E *e = new E();
+    if (deferring) {
+        queue_command([this, entity, id]() { add_with_id(entity, id); });
+        return id;
+    }
+    E *e = new (alloc_entity(type_of((E *)nullptr), sizeof(E))) E();
     *e = entity;
     e->type = type_of(e);
     e->entity_id = id;
-    entities[id] = (BaseEntity *)e;
+    entities.insert(id, (BaseEntity *)e, group_of(e));
     e->on_create();
+    if (grid) moved(id);
     return id;
 }
 
@@ -124,7 +124,7 @@ void show_H(const char *name, void *v, bool readonly) {
 void EntitySystem::draw_imgui() {
     if (GAMESTATE()->imgui.entities_enabled) {
         ImGui::Begin("Entities");
-        ImGui::Text("Current number of entities: %ld", entities.size());
+        ImGui::Text("Current number of entities: %u", entities.size());
         static bool initalize_func_map = true;
         if (initalize_func_map) {
 #define F(T) func_map[typeid(T).hash_code()] = ImGuiFuncs::show_##T
@@ -171,6 +171,8 @@ void EntitySystem::draw_imgui() {
                     // Do stuff for all the fields,
                     // like drawing them, map of type to functions.
                 }
+                // The fields might have been edited.
+                moved(id);
                 ImGui::TreePop();
             }
             ImGui::TreePop();
@@ -196,15 +198,18 @@ void EntitySystem::draw_imgui() {
                     item_current_idx = AssetID::NONE();
                 }
 
-                const char *id_preview = (Asset::is_valid(item_current_idx) ? GAMESTATE()->asset_system.assets[item_current_idx].header->name : "Sound asset");
+                const char *id_preview = (Asset::is_valid(item_current_idx) ? Asset::find(item_current_idx)->header->name : "Sound asset");
 
                 if (ImGui::BeginCombo("", id_preview)) {
-                    for (auto &it : GAMESTATE()->asset_system.assets) {
-                        Asset::UsableAsset asset = it.second;
+                    Asset::AssetTable *table = GAMESTATE()->asset_system.table;
+                    for (u32 slot = 0; slot < table->num_slots; slot++) {
+                        if (!table->at(slot)->used) continue;
+                        Asset::UsableAsset asset = table->at(slot)->asset;
                         if (asset.header->type != Asset::AssetType::SOUND) continue;
-                        const bool is_selected = (item_current_idx == it.first);
+                        AssetID id = asset.header->name_hash;
+                        const bool is_selected = (item_current_idx == id);
                         if (ImGui::Selectable(asset.header->name, is_selected))
-                            item_current_idx = it.first;
+                            item_current_idx = id;
                     }
                     ImGui::EndCombo();
                 }
@@ -212,7 +217,7 @@ void EntitySystem::draw_imgui() {
                 ImGui::Checkbox("Repeat", &repeat);
 
                 if (ImGui::Button("Play") && (item_current_idx != AssetID::NONE())) {
-                    AssetID asset_id = AssetID(GAMESTATE()->asset_system.assets[item_current_idx].header->name);
+                    AssetID asset_id = AssetID(Asset::find(item_current_idx)->header->name);
                     Asset::fetch_sound(asset_id);
                     SoundEntity sound_entity = {};
                     sound_entity.asset_id = asset_id;
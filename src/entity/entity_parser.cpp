@@ -3,6 +3,7 @@
 #include "../game.h"
 #include "entity_types.h"
 
+#include <algorithm>
 #include <cstring>
 #include <cxxabi.h>
 #include <limits>
@@ -13,10 +14,326 @@
 //
 
 void load_level(AssetID level_id) {
-    const char *serialized = Asset::fetch_level(level_id)->data;
+    Asset::Level *level = Asset::fetch_level(level_id);
+    Asset::prefetch(level->assets, level->num_assets);
 
     auto callback = [](BaseEntity *e) { GAMESTATE()->entity_system.add_unknown_type(e); };
-    parse_entities_and_do(serialized, "LOAD", callback);
+    read_level_and_do(level, Asset::find(level_id)->header->name, callback);
+}
+
+// The records written by level_asset in tools/asset-gen.py.
+struct LevelEntity {
+    // read from file
+    u64 type_hash;
+    u32 num_fields;
+    u32 padding;
+};
+
+struct LevelField {
+    // read from file
+    u64 name_hash;
+    u32 size;
+    u32 padding;
+};
+
+void read_level_and_do(const Asset::Level *level,
+                       const char *filename,
+                       EntityParseCallback callback) {
+    // The records only have the hashes of the names, so the
+    // names are hashed once per level instead.
+    const u32 NUM_TYPES = (u32)EntityType::NUM_ENTITY_TYPES;
+    u64 type_hashes[NUM_TYPES];
+    for (u32 t = 0; t < NUM_TYPES; t++) {
+        type_hashes[t] = hash(entity_type_names[t]);
+    }
+    std::vector<u64> field_hashes[NUM_TYPES];
+
+    const u8 *cursor = level->data;
+    const u8 *end = level->data + level->size;
+    for (u64 i = 0; i < level->num_entities; i++) {
+        LevelEntity record;
+        ASSERT(cursor + sizeof(record) <= end, "Level {} ends in the middle of an entity", filename);
+        std::memcpy(&record, cursor, sizeof(record));
+        cursor += sizeof(record);
+
+        u32 t = std::find(type_hashes, type_hashes + NUM_TYPES, record.type_hash) - type_hashes;
+        if (t == NUM_TYPES) {
+            ERR("Unknown entity type in level {}, rebuild the assets", filename);
+        }
+
+        u8 entity[MAX_ENTITY_SIZE];
+        FieldList fields = {};
+        if (t != NUM_TYPES) {
+            emplace_entity((void *)entity, EntityType(t));
+            fields = get_fields_for(EntityType(t));
+            if (field_hashes[t].empty()) {
+                for (int f = 0; f < fields.num_fields; f++) {
+                    field_hashes[t].push_back(hash(fields.list[f].name));
+                }
+            }
+        }
+
+        for (u32 f = 0; f < record.num_fields; f++) {
+            LevelField field;
+            ASSERT(cursor + sizeof(field) <= end, "Level {} ends in the middle of a field", filename);
+            std::memcpy(&field, cursor, sizeof(field));
+            cursor += sizeof(field);
+            ASSERT(cursor + field.size <= end, "Level {} ends in the middle of a field", filename);
+
+            if (t != NUM_TYPES) {
+                auto found = std::find(field_hashes[t].begin(), field_hashes[t].end(), field.name_hash);
+                if (found == field_hashes[t].end()) {
+                    ERR("Unknown field in level {}, rebuild the assets", filename);
+                } else {
+                    const Field *target = fields.list + (found - field_hashes[t].begin());
+                    if ((u32)target->size == field.size) {
+                        std::memcpy(entity + target->offset, cursor, field.size);
+                    } else {
+                        ERR("Field '{}' in level {} has the wrong size, rebuild the assets",
+                            target->name, filename);
+                    }
+                }
+            }
+            // Padded to 8 bytes.
+            cursor += (field.size + 7) & ~7;
+        }
+
+        if (t != NUM_TYPES) callback((BaseEntity *)entity);
+    }
+}
+
+// The records of a snapshot, after the header every entity type
+// has a section. A section lists the fields, then the IDs of the
+// entities, then every field for all the entities. All records
+// and the field data are padded to 8 bytes.
+struct SnapshotHeader {
+    u32 magic;
+    u32 version;
+    u64 id_counter;
+    u32 num_sections;
+    u32 padding;
+};
+
+struct SnapshotSection {
+    u64 type_hash;
+    u32 num_entities;
+    u32 num_fields;
+};
+
+struct SnapshotField {
+    u64 name_hash;
+    u32 size;
+    u32 padding;
+};
+
+static const u32 SNAPSHOT_MAGIC = 0x50414E53; // "SNAP"
+
+static u64 snapshot_pad(u64 size) {
+    return (size + 7) & ~7;
+}
+
+template <typename T>
+static void snapshot_push(std::vector<u8> *out, const T &record) {
+    const u8 *bytes = (const u8 *)&record;
+    out->insert(out->end(), bytes, bytes + sizeof(T));
+}
+
+std::vector<u8> write_snapshot() {
+    EntitySystem *system = &GAMESTATE()->entity_system;
+    const u32 NUM_TYPES = (u32)EntityType::NUM_ENTITY_TYPES;
+    std::vector<BaseEntity *> by_type[NUM_TYPES];
+    for (auto [id, e] : system->entities) {
+        by_type[(u32)e->type].push_back(e);
+    }
+
+    std::vector<u8> out;
+    SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .id_counter = system->id_counter,
+        .num_sections = 0,
+    };
+    for (u32 t = 0; t < NUM_TYPES; t++) {
+        header.num_sections += !by_type[t].empty();
+    }
+    snapshot_push(&out, header);
+
+    for (u32 t = 0; t < NUM_TYPES; t++) {
+        std::vector<BaseEntity *> &of_type = by_type[t];
+        if (of_type.empty()) continue;
+        FieldList fields = get_fields_for(EntityType(t));
+        std::vector<const Field *> written;
+        for (int f = 0; f < fields.num_fields; f++) {
+            if (!fields.list[f].internal) written.push_back(fields.list + f);
+        }
+
+        SnapshotSection section = {
+            .type_hash = hash(entity_type_names[t]),
+            .num_entities = (u32)of_type.size(),
+            .num_fields = (u32)written.size(),
+        };
+        snapshot_push(&out, section);
+        for (const Field *field : written) {
+            snapshot_push(&out, SnapshotField { hash(field->name), (u32)field->size });
+        }
+        for (BaseEntity *e : of_type) {
+            snapshot_push(&out, e->entity_id);
+        }
+
+        for (const Field *field : written) {
+            u64 at = out.size();
+            out.resize(at + snapshot_pad((u64)field->size * of_type.size()));
+            u8 *column = out.data() + at;
+            for (BaseEntity *e : of_type) {
+                std::memcpy(column, (u8 *)e + field->offset, field->size);
+                column += field->size;
+            }
+        }
+    }
+    return out;
+}
+
+// Walks the snapshot, and adds the entities if add is set.
+// Returns false if the snapshot is broken.
+static bool walk_snapshot(const u8 *data, u64 size, bool add) {
+    const u8 *cursor = data;
+    const u8 *end = data + size;
+    auto read = [&cursor, end](void *to, u64 bytes) {
+        if ((u64)(end - cursor) < bytes) return false;
+        std::memcpy(to, cursor, bytes);
+        cursor += bytes;
+        return true;
+    };
+
+    SnapshotHeader header;
+    if (!read(&header, sizeof(header)) || header.magic != SNAPSHOT_MAGIC) {
+        ERR("Not an entity snapshot");
+        return false;
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        ERR("Entity snapshot has version {}, expected {}", header.version, SNAPSHOT_VERSION);
+        return false;
+    }
+
+    const u32 NUM_TYPES = (u32)EntityType::NUM_ENTITY_TYPES;
+    u64 type_hashes[NUM_TYPES];
+    for (u32 t = 0; t < NUM_TYPES; t++) {
+        type_hashes[t] = hash(entity_type_names[t]);
+    }
+
+    EntitySystem *system = &GAMESTATE()->entity_system;
+    for (u32 s = 0; s < header.num_sections; s++) {
+        SnapshotSection section;
+        if (!read(&section, sizeof(section))) {
+            ERR("Entity snapshot ends in the middle of a section");
+            return false;
+        }
+        u32 t = std::find(type_hashes, type_hashes + NUM_TYPES, section.type_hash) - type_hashes;
+        if (t == NUM_TYPES) {
+            WARN("Skipping {} entities of an unknown type in the snapshot", section.num_entities);
+        }
+
+        // Where every field goes in the entity, nullptr for fields
+        // the type doesn't have anymore.
+        FieldList fields = {};
+        if (t != NUM_TYPES) fields = get_fields_for(EntityType(t));
+        // The count comes from the file, so it's checked before
+        // anything is allocated for it.
+        if ((u64)(end - cursor) / sizeof(SnapshotField) < section.num_fields) {
+            ERR("Entity snapshot ends in the middle of a section");
+            return false;
+        }
+        std::vector<SnapshotField> stored(section.num_fields);
+        std::vector<const Field *> targets(section.num_fields, nullptr);
+        for (u32 f = 0; f < section.num_fields; f++) {
+            if (!read(&stored[f], sizeof(SnapshotField))) {
+                ERR("Entity snapshot ends in the middle of a section");
+                return false;
+            }
+            for (int i = 0; i < fields.num_fields; i++) {
+                const Field *field = fields.list + i;
+                if (field->internal || hash(field->name) != stored[f].name_hash) continue;
+                if ((u32)field->size == stored[f].size) {
+                    targets[f] = field;
+                } else if (add) {
+                    WARN("Field '{}' of {} changed size, it isn't restored",
+                         field->name, entity_type_names[t]);
+                }
+            }
+        }
+
+        u64 ids_size = (u64)section.num_entities * sizeof(EntityID);
+        u64 columns_size = 0;
+        for (const SnapshotField &field : stored) {
+            columns_size += snapshot_pad((u64)field.size * section.num_entities);
+        }
+        if ((u64)(end - cursor) < ids_size + columns_size) {
+            ERR("Entity snapshot ends in the middle of a section");
+            return false;
+        }
+        const u8 *ids = cursor;
+        const u8 *columns = cursor + ids_size;
+        cursor = columns + columns_size;
+        if (!add || t == NUM_TYPES) continue;
+
+        for (u32 i = 0; i < section.num_entities; i++) {
+            u8 entity[MAX_ENTITY_SIZE];
+            emplace_entity((void *)entity, EntityType(t));
+            const u8 *column = columns;
+            for (u32 f = 0; f < section.num_fields; f++) {
+                if (targets[f]) {
+                    std::memcpy(entity + targets[f]->offset, column + (u64)stored[f].size * i, stored[f].size);
+                }
+                column += snapshot_pad((u64)stored[f].size * section.num_entities);
+            }
+            EntityID id;
+            std::memcpy(&id, ids + (u64)i * sizeof(EntityID), sizeof(EntityID));
+            system->add_unknown_type_with_id((BaseEntity *)entity, id);
+        }
+    }
+    if (add) system->id_counter = Math::max(system->id_counter, header.id_counter);
+    return true;
+}
+
+bool read_snapshot(const u8 *data, u64 size) {
+    // Checked in full first, so a broken snapshot leaves
+    // the world as it was.
+    if (!walk_snapshot(data, size, false)) return false;
+    GAMESTATE()->entity_system.remove_all();
+    return walk_snapshot(data, size, true);
+}
+
+bool save_snapshot(const char *path) {
+    std::vector<u8> snapshot = write_snapshot();
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        ERR("Failed to open {} for the snapshot", path);
+        return false;
+    }
+    defer { fclose(file); };
+    if (fwrite(snapshot.data(), 1, snapshot.size(), file) != snapshot.size()) {
+        ERR("Failed to write the snapshot to {}", path);
+        return false;
+    }
+    return true;
+}
+
+bool load_snapshot(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        ERR("Failed to open snapshot {}", path);
+        return false;
+    }
+    defer { fclose(file); };
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    std::vector<u8> snapshot(Math::max<long>(size, 0));
+    if (fread(snapshot.data(), 1, snapshot.size(), file) != snapshot.size()) {
+        ERR("Failed to read snapshot {}", path);
+        return false;
+    }
+    return read_snapshot(snapshot.data(), snapshot.size());
 }
 
 EntityType string_to_entity_type(const char *str) {
@@ -151,7 +468,7 @@ struct FileParser {
         return EntityType::NUM_ENTITY_TYPES;
     }
 
-    Field *parse_field(FieldList fields) {
+    const Field *parse_field(FieldList fields) {
         FileParser before_read = *this;
 
         char fieldname[32] = {};
@@ -315,7 +632,7 @@ void parse_entities_and_do(const char *data,
 
         parser.skip_whitespace();
         for (; parser.peek() && parser.peek() != '#'; parser.skip_whitespace()) {
-            Field *field = parser.parse_field(fields);
+            const Field *field = parser.parse_field(fields);
             if (!field) continue;
 
             std::size_t hash = field->typeinfo.hash_code();
@@ -367,3 +684,72 @@ TEST_CASE("parser-multiple", {
     ASSERT_EQ(calls, 2);
     return true;
 });
+
+TEST_CASE("entity snapshot", {
+    GAMESTATE()->logger.levels &= ~LogLevel::TRACE;
+    EntitySystem *system = &GAMESTATE()->entity_system;
+    system->remove_all();
+    Light l;
+    l.position = Vec3(1, 2, 3);
+    l.color = Color3(0, 1, 0);
+    l.draw_as_point = true;
+    EntityID light_id = system->add(l);
+    Block b;
+    b.scale = Vec3(1, 2, 1);
+    EntityID block_id = system->add(b);
+    u64 id_counter = system->id_counter;
+
+    std::vector<u8> snapshot = write_snapshot();
+    system->remove_all();
+    system->add(Block());
+
+    // A broken snapshot leaves the world alone.
+    ASSERT(!read_snapshot(snapshot.data(), snapshot.size() - 8), "Read a cut snapshot");
+    ASSERT_EQ(system->entities.size(), 1);
+    std::vector<u8> corrupt = snapshot;
+    u32 num_fields = 0xFFFFFFFF;
+    std::memcpy(corrupt.data() + sizeof(SnapshotHeader) + offsetof(SnapshotSection, num_fields), &num_fields, sizeof(u32));
+    ASSERT(!read_snapshot(corrupt.data(), corrupt.size()), "Read a corrupt snapshot");
+
+    ASSERT(read_snapshot(snapshot.data(), snapshot.size()), "Failed to read the snapshot");
+    ASSERT_EQ(system->entities.size(), 2);
+    // Only the block has a body, restoring again doesn't add one.
+    ASSERT_EQ(GAMESTATE()->physics_engine.bodies.size(), 1);
+    ASSERT(read_snapshot(snapshot.data(), snapshot.size()), "Failed to read the snapshot again");
+    ASSERT_EQ(GAMESTATE()->physics_engine.bodies.size(), 1);
+    Light *light = system->fetch<Light>(light_id);
+    ASSERT_LT(length(light->position - Vec3(1, 2, 3)), 0.01);
+    ASSERT_EQ(light->draw_as_point, true);
+    ASSERT_EQ(light->light_id, Light::NONE);
+    Block *block = system->fetch<Block>(block_id);
+    ASSERT_LT(length(block->scale - Vec3(1, 2, 1)), 0.01);
+    ASSERT(system->id_counter >= id_counter, "Reused IDs after the snapshot");
+    system->remove_all();
+    return true;
+});
+
+TEST_CASE("level-binary", {
+    Asset::load("assets-tests.bin");
+    AssetID id("TWO_ENTITIES");
+    int calls = 0;
+    auto callback = [&calls](BaseEntity *e) {
+        if (calls++ == 0) {
+            ASSERT_EQ(e->type, EntityType::LIGHT);
+            Light *l = (Light *)e;
+            ASSERT_LT(length(l->position - Vec3(1, 2, 3)), 0.01);
+            ASSERT_LT(length(Vec3(l->color.r, l->color.g, l->color.b) - Vec3(0, 1, 0)), 0.01);
+            ASSERT_EQ(l->draw_as_point, true);
+        } else {
+            ASSERT_EQ(e->type, EntityType::BLOCK);
+            Block *b = (Block *)e;
+            ASSERT_LT(length(b->scale - Vec3(1, 2, 1)), 0.01);
+        }
+    };
+    Asset::Level *level = Asset::fetch_level(id);
+    read_level_and_do(level, "TWO_ENTITIES", callback);
+    ASSERT_EQ(calls, 2);
+    ASSERT_EQ(level->num_assets, 2);
+    ASSERT_EQ(level->assets[0], AssetID("ALPHABET"));
+    ASSERT_EQ(level->assets[1], AssetID("TWO_BY_ONE"));
+    return true;
+});
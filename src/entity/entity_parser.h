@@ -1,6 +1,7 @@
 #include <vector>
 #include <functional>
 #include "entity.h"
+#include "../asset/asset.h"
 
 ///*
 using EntityParseCallback = std::function<void(BaseEntity *)>;
@@ -12,7 +13,39 @@ using EntityParseCallback = std::function<void(BaseEntity *)>;
 void parse_entities_and_do(const char *data, const char *filename, EntityParseCallback);
 
 ///*
-// Loads the specified level into the world.
+// Creates the entities in a level compiled by the asset packer,
+// the fields are copied straight into the entities. The lifetime
+// of the BaseEntity pointer is the same as for
+// parse_entities_and_do.
+void read_level_and_do(const Asset::Level *level, const char *filename, EntityParseCallback);
+
+///*
+// Loads the specified level into the world, the assets the
+// level declares are prefetched first.
 void load_level(AssetID level_id);
 
-// TODO(ed): Add a way to serialize entities.
+///* SNAPSHOT_VERSION
+// Bumped when the layout of the snapshots changes, older
+// snapshots aren't read. Changes to the entity types don't need
+// a bump, the fields are matched by name.
+const u32 SNAPSHOT_VERSION = 1;
+
+///*
+// Writes all entities in the entity system to a binary snapshot.
+// The entities are grouped by type and every field is written for
+// all the entities of the type at once. INTERNAL fields aren't
+// written, they are set up again when the entities are added.
+// Entities of types the type system doesn't know are written as
+// the type they say they are.
+std::vector<u8> write_snapshot();
+
+///*
+// Replaces all entities with the ones in the snapshot, they keep
+// their IDs. False if the snapshot can't be read, then nothing
+// is changed.
+bool read_snapshot(const u8 *data, u64 size);
+
+///*
+// Writes a snapshot to, and reads one from, a file.
+bool save_snapshot(const char *path);
+bool load_snapshot(const char *path);
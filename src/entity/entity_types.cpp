@@ -24,75 +24,13 @@ i32 format(char *buffer, u32 size, FormatHint args, EntityType type) {
     return 0;
 }
 
-namespace FieldName {
-FieldNameType asset_id = "asset_id";
-FieldNameType audio_id = "audio_id";
-FieldNameType color = "color";
-FieldNameType draw_as_point = "draw_as_point";
-FieldNameType entity_id = "entity_id";
-FieldNameType hit = "hit";
-FieldNameType last_input = "last_input";
-FieldNameType light_id = "light_id";
-FieldNameType position = "position";
-FieldNameType remove = "remove";
-FieldNameType rotation = "rotation";
-FieldNameType scale = "scale";
-FieldNameType sound_source_settings = "sound_source_settings";
-FieldNameType type = "type";
-FieldNameType velocity = "velocity";
-};
-
-Field gen_BaseEntity[] = {
-    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(BaseEntity, remove), 0, },
-    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(BaseEntity, entity_id), 1, },
-    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(BaseEntity, type), 1, }
-};
-Field gen_Block[] = {
-    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(Block, remove), 0, },
-    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(Block, entity_id), 1, },
-    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(Block, type), 1, },
-    { typeid(Vec3), FieldName::position, sizeof(Vec3), (int)offsetof(Block, position), 0, },
-    { typeid(Vec3), FieldName::scale, sizeof(Vec3), (int)offsetof(Block, scale), 0, },
-    { typeid(Quat), FieldName::rotation, sizeof(Quat), (int)offsetof(Block, rotation), 0, }
-};
-Field gen_Entity[] = {
-    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(Entity, remove), 0, },
-    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(Entity, entity_id), 1, },
-    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(Entity, type), 1, },
-    { typeid(Vec3), FieldName::position, sizeof(Vec3), (int)offsetof(Entity, position), 0, },
-    { typeid(Vec3), FieldName::scale, sizeof(Vec3), (int)offsetof(Entity, scale), 0, },
-    { typeid(Quat), FieldName::rotation, sizeof(Quat), (int)offsetof(Entity, rotation), 0, }
-};
-Field gen_Light[] = {
-    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(Light, remove), 0, },
-    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(Light, entity_id), 1, },
-    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(Light, type), 1, },
-    { typeid(Vec3), FieldName::position, sizeof(Vec3), (int)offsetof(Light, position), 0, },
-    { typeid(Vec3), FieldName::scale, sizeof(Vec3), (int)offsetof(Light, scale), 0, },
-    { typeid(Quat), FieldName::rotation, sizeof(Quat), (int)offsetof(Light, rotation), 0, },
-    { typeid(i32), FieldName::light_id, sizeof(i32), (int)offsetof(Light, light_id), 1, },
-    { typeid(Color3), FieldName::color, sizeof(Color3), (int)offsetof(Light, color), 0, },
-    { typeid(bool), FieldName::draw_as_point, sizeof(bool), (int)offsetof(Light, draw_as_point), 0, }
-};
-Field gen_Player[] = {
-    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(Player, remove), 0, },
-    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(Player, entity_id), 1, },
-    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(Player, type), 1, },
-    { typeid(Vec3), FieldName::position, sizeof(Vec3), (int)offsetof(Player, position), 0, },
-    { typeid(Vec3), FieldName::scale, sizeof(Vec3), (int)offsetof(Player, scale), 0, },
-    { typeid(Quat), FieldName::rotation, sizeof(Quat), (int)offsetof(Player, rotation), 0, },
-    { typeid(PlayerInput), FieldName::last_input, sizeof(PlayerInput), (int)offsetof(Player, last_input), 1, },
-    { typeid(Vec3), FieldName::velocity, sizeof(Vec3), (int)offsetof(Player, velocity), 0, },
-    { typeid(Physics::Manifold), FieldName::hit, sizeof(Physics::Manifold), (int)offsetof(Player, hit), 0, }
-};
-Field gen_SoundEntity[] = {
-    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(SoundEntity, remove), 0, },
-    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(SoundEntity, entity_id), 1, },
-    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(SoundEntity, type), 1, },
-    { typeid(AssetID), FieldName::asset_id, sizeof(AssetID), (int)offsetof(SoundEntity, asset_id), 0, },
-    { typeid(Audio::SoundSourceSettings), FieldName::sound_source_settings, sizeof(Audio::SoundSourceSettings), (int)offsetof(SoundEntity, sound_source_settings), 0, },
-    { typeid(AudioID), FieldName::audio_id, sizeof(AudioID), (int)offsetof(SoundEntity, audio_id), 0, }
-};
+FieldID field_id(FieldNameType name) {
+    uintptr_t at = (uintptr_t)name - (uintptr_t)field_name_table;
+    if (at >= sizeof(field_name_table) || at % sizeof(field_name_table[0])) {
+        return FieldID::NUM_FIELD_IDS;
+    }
+    return FieldID(at / sizeof(field_name_table[0]));
+}
 
 FieldList get_fields_for(EntityType type) {
     switch (type) {
@@ -139,58 +77,54 @@ void emplace_entity(void *buffer, EntityType type) {
     }
 }
 
+// The entities of a type are all of that exact type, so the
+// calls can be qualified. Entities of other types are called
+// virtually, after the known types. Types marked with
+// PARALLEL_UPDATE are updated on all the entity workers.
+void EntitySystem::update_entities() {
+    // BaseEntity::update does nothing.
+    // Block::update does nothing.
+    // Entity::update does nothing.
+    run_batch((u32)EntityType::LIGHT, update_batch<Light>);
+    run_batch((u32)EntityType::PLAYER, update_batch<Player>);
+    run_batch_parallel((u32)EntityType::SOUNDENTITY, update_batch<SoundEntity>);
+    run_batch((u32)EntityType::NUM_ENTITY_TYPES, update_batch<BaseEntity>);
+}
+
+void EntitySystem::draw_entities() {
+    // BaseEntity::draw does nothing.
+    run_batch((u32)EntityType::BLOCK, draw_batch<Block>);
+    // Entity::draw does nothing.
+    run_batch((u32)EntityType::LIGHT, draw_batch<Light>);
+    run_batch((u32)EntityType::PLAYER, draw_batch<Player>);
+    run_batch((u32)EntityType::SOUNDENTITY, draw_batch<SoundEntity>);
+    run_batch((u32)EntityType::NUM_ENTITY_TYPES, draw_batch<BaseEntity>);
+}
+
 EntityID EntitySystem::add_unknown_type(BaseEntity *e) {
+    return add_unknown_type_with_id(e, next_id());
+}
+
+EntityID EntitySystem::add_unknown_type_with_id(BaseEntity *e, EntityID id) {
     switch (e->type) {
     case EntityType::BASEENTITY:
-        return add<BaseEntity>(*(BaseEntity *) e);
+        return add_with_id<BaseEntity>(*(BaseEntity *) e, id);
     case EntityType::BLOCK:
-        return add<Block>(*(Block *) e);
+        return add_with_id<Block>(*(Block *) e, id);
     case EntityType::ENTITY:
-        return add<Entity>(*(Entity *) e);
+        return add_with_id<Entity>(*(Entity *) e, id);
     case EntityType::LIGHT:
-        return add<Light>(*(Light *) e);
+        return add_with_id<Light>(*(Light *) e, id);
     case EntityType::PLAYER:
-        return add<Player>(*(Player *) e);
+        return add_with_id<Player>(*(Player *) e, id);
     case EntityType::SOUNDENTITY:
-        return add<SoundEntity>(*(SoundEntity *) e);
+        return add_with_id<SoundEntity>(*(SoundEntity *) e, id);
     default:
         UNREACHABLE("Unknown entity type");
         return {};
     }
 }
 
-/*
- * Included from `tools/entity_types_type_of.cpp`
- */
-
-EntityType type_of(BaseEntity *e) {
-    return EntityType::BASEENTITY;
-}
-
-EntityType type_of(Block *e) {
-    return EntityType::BLOCK;
-}
-
-EntityType type_of(Entity *e) {
-    return EntityType::ENTITY;
-}
-
-EntityType type_of(Light *e) {
-    return EntityType::LIGHT;
-}
-
-EntityType type_of(Player *e) {
-    return EntityType::PLAYER;
-}
-
-EntityType type_of(SoundEntity *e) {
-    return EntityType::SOUNDENTITY;
-}
-
-/*
- * End of `tools/entity_types_type_of.cpp`
- */
-
 /*
  * Included from `tools/entity_types_event_callback.cpp`
  */
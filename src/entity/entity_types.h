@@ -26,25 +26,73 @@ enum class EntityType {
     NUM_ENTITY_TYPES,
 };
 
+///* FieldID
+// Every field name on the entity types, field_id gives
+// the FieldID of a FieldName::*.
+enum class FieldID {
+    asset_id,
+    audio_id,
+    color,
+    draw_as_point,
+    entity_id,
+    hit,
+    last_input,
+    light_id,
+    position,
+    remove,
+    rotation,
+    scale,
+    sound_source_settings,
+    type,
+    velocity,
+
+    NUM_FIELD_IDS,
+};
+
+// The FieldName::* point into this table, so a
+// name is found from where it points.
+inline constexpr char field_name_table[][22] = {
+    "asset_id",
+    "audio_id",
+    "color",
+    "draw_as_point",
+    "entity_id",
+    "hit",
+    "last_input",
+    "light_id",
+    "position",
+    "remove",
+    "rotation",
+    "scale",
+    "sound_source_settings",
+    "type",
+    "velocity"
+};
+
 using FieldNameType = const char *;
 namespace FieldName {
-extern FieldNameType asset_id;
-extern FieldNameType audio_id;
-extern FieldNameType color;
-extern FieldNameType draw_as_point;
-extern FieldNameType entity_id;
-extern FieldNameType hit;
-extern FieldNameType last_input;
-extern FieldNameType light_id;
-extern FieldNameType position;
-extern FieldNameType remove;
-extern FieldNameType rotation;
-extern FieldNameType scale;
-extern FieldNameType sound_source_settings;
-extern FieldNameType type;
-extern FieldNameType velocity;
+inline constexpr FieldNameType asset_id = field_name_table[(u32)FieldID::asset_id];
+inline constexpr FieldNameType audio_id = field_name_table[(u32)FieldID::audio_id];
+inline constexpr FieldNameType color = field_name_table[(u32)FieldID::color];
+inline constexpr FieldNameType draw_as_point = field_name_table[(u32)FieldID::draw_as_point];
+inline constexpr FieldNameType entity_id = field_name_table[(u32)FieldID::entity_id];
+inline constexpr FieldNameType hit = field_name_table[(u32)FieldID::hit];
+inline constexpr FieldNameType last_input = field_name_table[(u32)FieldID::last_input];
+inline constexpr FieldNameType light_id = field_name_table[(u32)FieldID::light_id];
+inline constexpr FieldNameType position = field_name_table[(u32)FieldID::position];
+inline constexpr FieldNameType remove = field_name_table[(u32)FieldID::remove];
+inline constexpr FieldNameType rotation = field_name_table[(u32)FieldID::rotation];
+inline constexpr FieldNameType scale = field_name_table[(u32)FieldID::scale];
+inline constexpr FieldNameType sound_source_settings = field_name_table[(u32)FieldID::sound_source_settings];
+inline constexpr FieldNameType type = field_name_table[(u32)FieldID::type];
+inline constexpr FieldNameType velocity = field_name_table[(u32)FieldID::velocity];
 };
 
+///*
+// The FieldID of a FieldName::*, NUM_FIELD_IDS for other strings.
+// Constant time, no strings are compared.
+FieldID field_id(FieldNameType name);
+
 static const char *entity_type_names[] = {
     "BaseEntity",
     "Block",
@@ -54,6 +102,18 @@ static const char *entity_type_names[] = {
     "SoundEntity"
 };
 
+///* entity_type_infos
+// The exact type of every entity type, entities of derived
+// types the type system doesn't know have another typeid.
+static const std::type_info *entity_type_infos[] = {
+    &typeid(BaseEntity),
+    &typeid(Block),
+    &typeid(Entity),
+    &typeid(Light),
+    &typeid(Player),
+    &typeid(SoundEntity)
+};
+
 i32 format(char *, u32, FormatHint, EntityType);
 
 struct Field {
@@ -66,11 +126,93 @@ struct Field {
 
 struct FieldList {
     int num_fields;
-    Field *list;
+    const Field *list;
+};
+
+inline constexpr Field gen_BaseEntity[] = {
+    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(BaseEntity, remove), 0, },
+    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(BaseEntity, entity_id), 1, },
+    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(BaseEntity, type), 1, }
+};
+inline constexpr Field gen_Block[] = {
+    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(Block, remove), 0, },
+    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(Block, entity_id), 1, },
+    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(Block, type), 1, },
+    { typeid(Vec3), FieldName::position, sizeof(Vec3), (int)offsetof(Block, position), 0, },
+    { typeid(Vec3), FieldName::scale, sizeof(Vec3), (int)offsetof(Block, scale), 0, },
+    { typeid(Quat), FieldName::rotation, sizeof(Quat), (int)offsetof(Block, rotation), 0, }
+};
+inline constexpr Field gen_Entity[] = {
+    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(Entity, remove), 0, },
+    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(Entity, entity_id), 1, },
+    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(Entity, type), 1, },
+    { typeid(Vec3), FieldName::position, sizeof(Vec3), (int)offsetof(Entity, position), 0, },
+    { typeid(Vec3), FieldName::scale, sizeof(Vec3), (int)offsetof(Entity, scale), 0, },
+    { typeid(Quat), FieldName::rotation, sizeof(Quat), (int)offsetof(Entity, rotation), 0, }
+};
+inline constexpr Field gen_Light[] = {
+    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(Light, remove), 0, },
+    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(Light, entity_id), 1, },
+    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(Light, type), 1, },
+    { typeid(Vec3), FieldName::position, sizeof(Vec3), (int)offsetof(Light, position), 0, },
+    { typeid(Vec3), FieldName::scale, sizeof(Vec3), (int)offsetof(Light, scale), 0, },
+    { typeid(Quat), FieldName::rotation, sizeof(Quat), (int)offsetof(Light, rotation), 0, },
+    { typeid(i32), FieldName::light_id, sizeof(i32), (int)offsetof(Light, light_id), 1, },
+    { typeid(Color3), FieldName::color, sizeof(Color3), (int)offsetof(Light, color), 0, },
+    { typeid(bool), FieldName::draw_as_point, sizeof(bool), (int)offsetof(Light, draw_as_point), 0, }
+};
+inline constexpr Field gen_Player[] = {
+    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(Player, remove), 0, },
+    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(Player, entity_id), 1, },
+    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(Player, type), 1, },
+    { typeid(Vec3), FieldName::position, sizeof(Vec3), (int)offsetof(Player, position), 0, },
+    { typeid(Vec3), FieldName::scale, sizeof(Vec3), (int)offsetof(Player, scale), 0, },
+    { typeid(Quat), FieldName::rotation, sizeof(Quat), (int)offsetof(Player, rotation), 0, },
+    { typeid(PlayerInput), FieldName::last_input, sizeof(PlayerInput), (int)offsetof(Player, last_input), 1, },
+    { typeid(Vec3), FieldName::velocity, sizeof(Vec3), (int)offsetof(Player, velocity), 0, },
+    { typeid(Physics::Manifold), FieldName::hit, sizeof(Physics::Manifold), (int)offsetof(Player, hit), 1, }
+};
+inline constexpr Field gen_SoundEntity[] = {
+    { typeid(bool), FieldName::remove, sizeof(bool), (int)offsetof(SoundEntity, remove), 0, },
+    { typeid(EntityID), FieldName::entity_id, sizeof(EntityID), (int)offsetof(SoundEntity, entity_id), 1, },
+    { typeid(EntityType), FieldName::type, sizeof(EntityType), (int)offsetof(SoundEntity, type), 1, },
+    { typeid(AssetID), FieldName::asset_id, sizeof(AssetID), (int)offsetof(SoundEntity, asset_id), 0, },
+    { typeid(Audio::SoundSourceSettings), FieldName::sound_source_settings, sizeof(Audio::SoundSourceSettings), (int)offsetof(SoundEntity, sound_source_settings), 0, },
+    { typeid(AudioID), FieldName::audio_id, sizeof(AudioID), (int)offsetof(SoundEntity, audio_id), 0, }
+};
+
+inline constexpr const Field *FIELD_TABLES[] = {
+    gen_BaseEntity,
+    gen_Block,
+    gen_Entity,
+    gen_Light,
+    gen_Player,
+    gen_SoundEntity
+};
+
+///* FIELD_SLOTS
+// Where the field is in the field list of the type, -1 if the
+// type doesn't have it. Indexed with EntityType and FieldID.
+inline constexpr i8 FIELD_SLOTS[][(u32)FieldID::NUM_FIELD_IDS] = {
+    { -1, -1, -1, -1, 1, -1, -1, -1, -1, 0, -1, -1, -1, 2, -1 }, // BaseEntity
+    { -1, -1, -1, -1, 1, -1, -1, -1, 3, 0, 5, 4, -1, 2, -1 }, // Block
+    { -1, -1, -1, -1, 1, -1, -1, -1, 3, 0, 5, 4, -1, 2, -1 }, // Entity
+    { -1, -1, 7, 8, 1, -1, -1, 6, 3, 0, 5, 4, -1, 2, -1 }, // Light
+    { -1, -1, -1, -1, 1, 8, 6, -1, 3, 0, 5, 4, -1, 2, 7 }, // Player
+    { 3, 5, -1, -1, 1, -1, -1, -1, -1, 0, -1, -1, 4, 2, -1 }, // SoundEntity
 };
 
 static constexpr int MAX_ENTITY_SIZE = std::max({sizeof(BaseEntity), sizeof(Block), sizeof(Entity), sizeof(Light), sizeof(Player), sizeof(SoundEntity)});
 
+///* ENTITY_TYPE_SIZES
+// The size of every entity type, in the order of EntityType.
+static constexpr u32 ENTITY_TYPE_SIZES[] = { sizeof(BaseEntity), sizeof(Block), sizeof(Entity), sizeof(Light), sizeof(Player), sizeof(SoundEntity) };
+
+///* ENTITY_TYPE_TRANSFORMS
+// Whether the type derives from Entity, so it has a position,
+// rotation and scale.
+static constexpr bool ENTITY_TYPE_TRANSFORMS[] = { false, true, true, true, true, false };
+
 ///*
 // Returns a list of fields on the specified struct type.
 FieldList get_fields_for(EntityType type);
@@ -86,27 +228,50 @@ void emplace_entity(void *buffer, EntityType type);
  */
 
 struct BaseEntity;
-EntityType type_of(BaseEntity *);
+constexpr EntityType type_of(BaseEntity *) {
+    return EntityType::BASEENTITY;
+}
 
 struct Block;
-EntityType type_of(Block *);
+constexpr EntityType type_of(Block *) {
+    return EntityType::BLOCK;
+}
 
 struct Entity;
-EntityType type_of(Entity *);
+constexpr EntityType type_of(Entity *) {
+    return EntityType::ENTITY;
+}
 
 struct Light;
-EntityType type_of(Light *);
+constexpr EntityType type_of(Light *) {
+    return EntityType::LIGHT;
+}
 
 struct Player;
-EntityType type_of(Player *);
+constexpr EntityType type_of(Player *) {
+    return EntityType::PLAYER;
+}
 
 struct SoundEntity;
-EntityType type_of(SoundEntity *);
+constexpr EntityType type_of(SoundEntity *) {
+    return EntityType::SOUNDENTITY;
+}
 
 /*
  * End of `tools/entity_types_type_of.h`
  */
 
+///*
+// The offset of the field on entities of type E, as a constant.
+// Entity types that don't have the field don't compile.
+template <typename E, FieldID F>
+constexpr int field_offset() {
+    constexpr EntityType type = type_of((E *)nullptr);
+    constexpr i8 slot = FIELD_SLOTS[(u32)type][(u32)F];
+    static_assert(slot != -1, "The entity type doesn't have the field");
+    return FIELD_TABLES[(u32)type][slot].offset;
+}
+
 struct EventCreateEntity {
     bool generate_id;
     EntityType type;
@@ -77,7 +77,8 @@ void init_game(GameState *gamestate, int width, int height) {
         n->connect_to_server(n->client_server_addr, n->autostart_port);
     }
 
-    Asset::load("assets.bin");
+    Asset::load("assets.bin", Asset::LoadMode::MAPPED);
+    Asset::set_budget(256 << 20, 512 << 20);
 
 #if IMGUI_ENABLE
     GAMESTATE()->imgui.screen_resolution = { width, height };
@@ -120,13 +121,21 @@ void init_game(GameState *gamestate, int width, int height) {
     b.mass = 0.0;
     GAMESTATE()->physics_engine.add_box(b);
 
-    load_level("SIMPLE_WORLD");
+    load_level(AssetIDs::SIMPLE_WORLD);
 }
 
 void reload_game(GameState *game) {
     _global_gs = game;
     GFX::reload(game);
     Asset::reload();
+    if (!game->asset_system.streaming) {
+        Asset::start_streaming();
+    }
+    game->audio_struct->start_streaming();
+    if (!game->entity_system.workers) {
+        u32 num_workers = Math::max(SDL_GetCPUCount() - 1, 0);
+        game->entity_system.start_workers(Math::min(num_workers, MAX_ENTITY_WORKERS));
+    }
 #ifdef IMGUI_ENABLE
     ImGui::SetCurrentContext((ImGuiContext *)game->imgui.context);
     ImPlot::SetCurrentContext((ImPlotContext *)game->imgui.implot_context);
@@ -169,6 +178,8 @@ void update() {
 void draw() {
     Performance::report();
     PERFORMANCE("Draw");
+    Asset::upload_streamed();
+    Asset::enforce_budget();
     if (GAMESTATE()->resized_window) {
         GAMESTATE()->resized_window = false;
         GFX::set_screen_resolution();
@@ -206,6 +217,7 @@ void draw() {
         Light *l = GAMESTATE()->entity_system.fetch<Light>(GAMESTATE()->lights[0]);
         if (GAMESTATE()->entity_system.have_ownership(l->entity_id)) {
             l->position = position + Vec3(0.5, 1.0 + sin(time()), 0.0);
+            GAMESTATE()->entity_system.moved(l->entity_id);
             // l->color = Vec3(sin(time()) * 0.5 + 0.5, cos(time()) * 0.5 + 0.5, 0.2);
         }
     }
@@ -214,6 +226,7 @@ void draw() {
         Light *l = GAMESTATE()->entity_system.fetch<Light>(GAMESTATE()->lights[1]);
         if (GAMESTATE()->entity_system.have_ownership(l->entity_id)) {
             l->position = position + Vec3(1.0 + cos(time()), 1.0, sin(time()));
+            GAMESTATE()->entity_system.moved(l->entity_id);
             // l->color = Vec3(0.5, 0.5, 0.9);
         }
     }
@@ -221,7 +234,7 @@ void draw() {
     shader.upload_lights(GFX::lighting()->light_positions,
                          GFX::lighting()->light_colors);
 
-    Asset::fetch_texture("RGBA")->bind(0);
+    Asset::fetch_texture(AssetIDs::RGBA)->bind(0);
     shader.upload_tex(0);
 
     GAMESTATE()->entity_system.draw();
@@ -314,6 +327,9 @@ void do_imgui_stuff() {
                     Performance::capture_begin();
                 }
             }
+            if (ImGui::MenuItem("Dump Asset Stats")) {
+                Asset::write_stats_csv(Performance::ASSET_STATS_FILE_NAME);
+            }
             if (ImGui::BeginMenu("Log")) {
                 bool trace = (GAMESTATE()->logger.levels & LogLevel::TRACE) != 0;
                 if (ImGui::MenuItem("TRACE", "", &trace)) {
@@ -443,8 +459,19 @@ GameState update_game(GameState *game, GSUM mode) { // Game entry point
     return *game;
 }
 
+void unload_game(GameState *game) {
+    _global_gs = game;
+    Asset::stop_streaming();
+    game->audio_struct->stop_streaming();
+    game->entity_system.stop_workers();
+}
+
 void shutdown_game(GameState *game) {
     _global_gs = game;
+    game->audio_struct->stop_all();
+    game->audio_struct->stop_streaming();
+    Asset::shutdown();
+    game->entity_system.stop_workers();
     GAMESTATE()->network.disconnect_from_server();
     GAMESTATE()->network.stop_server();
 }
@@ -102,6 +102,12 @@ u32 frame();
 extern "C" void reload_game(GameState *gamestate);
 using GameReloadFunc = void (*)(GameState *);
 
+///*
+// Called right before the game library is unloaded, stops
+// everything that runs code in the library on other threads.
+extern "C" void unload_game(GameState *gamestate);
+using GameUnloadFunc = void (*)(GameState *);
+
 #ifdef __clang__
 #pragma clang diagnostic ignored "-Wreturn-type-c-linkage"
 #endif
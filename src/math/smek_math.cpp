@@ -2,14 +2,8 @@
 #include "smek_math.h"
 #include "../test.h"
 
-u64 hash(const char *string) {
-    u64 hash = 5351;
-    while (*string) {
-        char c = (*string++);
-        hash = hash * c + c;
-    }
-    return hash;
-}
+// Has to match hash_string in tools/asset-gen.py.
+static_assert(AssetID("CUBE") == 138804672273ull, "AssetID isn't hashed like the asset packer");
 
 namespace Math {
 
@@ -2,19 +2,33 @@
 #include "types.h"
 #include <concepts>
 
+///*
+// Hashes a string, the same hash as the asset packer uses.
+// Strings known at compile time are hashed at compile time.
+constexpr u64 hash(const char *string) {
+    u64 hash = 5351;
+    while (*string) {
+        char c = (*string++);
+        hash = hash * c + c;
+    }
+    return hash;
+}
+
 ///* AssetID
 // A way to identify assets.
 //
-// The string is expected to be const so it potentially can be hashed during
-// compile time.
+// The assets in the pack have constants in asset_ids.h, which are
+// hashed at compile time. Use those instead of strings, then a
+// misspelled asset is a build error.
 struct AssetID {
-    AssetID(const char *);
-    AssetID(u64 id)
+    constexpr AssetID(const char *str)
+        : id(hash(str)) {}
+    constexpr AssetID(u64 id)
         : id(id) {}
-    AssetID()
+    constexpr AssetID()
         : id(NONE()) {}
 
-    static AssetID NONE() { return 0xFFFFFFFF; }
+    static constexpr AssetID NONE() { return 0xFFFFFFFF; }
 
     u64 id;
 
@@ -22,12 +36,21 @@ struct AssetID {
         return id == other;
     }
 
-    operator u64() const {
+    constexpr operator u64() const {
         return id;
     }
 };
 
-u64 hash(const char *string);
+///* AssetHandle
+// An AssetID resolved into a slot in the asset table, see
+// Asset::resolve. Fetching through a handle skips the lock
+// and the hash map as long as the slot is still the same
+// asset, otherwise it falls back to the AssetID.
+struct AssetHandle {
+    AssetID id;
+    u32 index;
+    u32 generation;
+};
 
 namespace Math {
 
@@ -180,11 +180,16 @@ void PhysicsEngine::add_box(AABody b) {
     bodies.push_back(b);
 }
 
+void PhysicsEngine::clear() {
+    bodies.clear();
+}
+
 void PhysicsEngine::update(real delta) {
+    EntityMap *entities = &GAMESTATE()->entity_system.entities;
     for (u32 i = 0; i < bodies.size();) {
         AABody *body = &bodies[i];
-        if (GAMESTATE()->entity_system.is_valid(body->entity)) {
-            Entity *entity = GAMESTATE()->entity_system.fetch<Entity>(body->entity);
+        Entity *entity = (Entity *)entities->find(body->entity);
+        if (entity) {
             body->position = entity->position;
             if (entity->type == EntityType::PLAYER) {
                 body->velocity = ((Player *)entity)->velocity;
@@ -241,11 +246,12 @@ void PhysicsEngine::update(real delta) {
     // Move the bodies to the end of the step.
     for (AABody &a : bodies) {
         a.integrate(delta);
-        Entity *entity = GAMESTATE()->entity_system.fetch<Entity>(a.entity);
+        Entity *entity = (Entity *)entities->find(a.entity);
         entity->position = a.position;
         if (entity->type == EntityType::PLAYER) {
             ((Player *)entity)->velocity = a.velocity;
         }
+        GAMESTATE()->entity_system.moved(a.entity);
     }
 }
 
@@ -57,6 +57,10 @@ struct PhysicsEngine {
 
     Manifold hitscan(Vec3 origin, Vec3 direction, EntityID sender = INVALID_ENTITY_ID);
     void add_box(AABody b);
+    ///* clear
+    // Removes all the bodies, for when all the entities
+    // are removed and their IDs might be used again.
+    void clear();
     void update(real delta);
     void draw();
 };
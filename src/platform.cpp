@@ -31,6 +31,7 @@
 struct GameLibrary {
     GameInitFunc init;
     GameReloadFunc reload;
+    GameUnloadFunc unload;
     GameUpdateFunc update;
     GameShutdownFunc shutdown;
     AudioCallbackFunc audio_callback;
@@ -106,7 +107,10 @@ bool load_gamelib() {
     dlclose(tmp); // If it isn't unloaded here, the same library is loaded.
 
     platform_audio_struct.lock();
-    if (game_lib.handle) { dlclose(game_lib.handle); }
+    if (game_lib.handle) {
+        game_lib.unload(&game_state);
+        dlclose(game_lib.handle);
+    }
 
     void *lib = dlopen(game_lib_path, RTLD_NOW);
     if (!lib) {
@@ -126,6 +130,10 @@ bool load_gamelib() {
     if (!game_lib.update) {
         UNREACHABLE("Failed to load \"reload_game\": {}", dlerror());
     }
+    game_lib.unload = (GameUnloadFunc)dlsym(lib, "unload_game");
+    if (!game_lib.unload) {
+        UNREACHABLE("Failed to load \"unload_game\": {}", dlerror());
+    }
     game_lib.shutdown = (GameShutdownFunc)dlsym(lib, "shutdown_game");
     if (!game_lib.update) {
         UNREACHABLE("Failed to load \"shutdown_game\": {}", dlerror());
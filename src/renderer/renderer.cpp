@@ -3,6 +3,8 @@
 #include "imgui/imgui.h"
 #include "opengl.h"
 #include "renderer.h"
+#include <cmath>
+#include <cstring>
 
 namespace GFX {
 
@@ -239,13 +241,61 @@ void push_circle(Vec3 center,
     push_line(center + last_offset, center + s * scale, c, line_size);
 }
 
+// Rounds to nearest, without denormals and NaNs which the vertex data never has.
+static u16 to_half(f32 f) {
+    u32 bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    u16 sign = (bits >> 16) & 0x8000;
+    i32 exponent = (i32)((bits >> 23) & 0xFF) - 127 + 15;
+    u32 mantissa = bits & 0x007FFFFF;
+    if (exponent <= 0) return sign;
+    if (exponent >= 31) return sign | 0x7C00;
+    u32 half = (exponent << 10) | (mantissa >> 13);
+    // Carrying into the exponent is the correct rounding.
+    if (mantissa & 0x1000) half++;
+    return sign | (u16)half;
+}
+
+static i16 to_snorm16(f32 f) {
+    return (i16)std::round(std::max(-1.0f, std::min(f, 1.0f)) * 32767.0f);
+}
+
+Mesh::Vertex Mesh::Vertex::pack(Vec3 position, Vec2 texture, Vec3 normal) {
+    Vertex vertex = {};
+    vertex.position = position;
+    vertex.texture[0] = to_half(texture.x);
+    vertex.texture[1] = to_half(texture.y);
+
+    // Octahedral encoding, decoded in master_shader.glsl.
+    f32 length = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+    if (length != 0) {
+        f32 x = normal.x / length;
+        f32 y = normal.y / length;
+        if (normal.z < 0) {
+            f32 folded_x = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+            f32 folded_y = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+            x = folded_x;
+            y = folded_y;
+        }
+        vertex.normal[0] = to_snorm16(x);
+        vertex.normal[1] = to_snorm16(y);
+    }
+    return vertex;
+}
+
 void Mesh::destroy() {
-    glDeleteVertexArrays(11, &vao);
+    glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &vbo);
+    if (ebo) glDeleteBuffers(1, &ebo);
 }
 
 Mesh Mesh::init(Vertex *verticies, u32 num_verticies) {
-    u32 vao = 0, vbo = 0;
+    return init(verticies, num_verticies, nullptr, 0, 0);
+}
+
+Mesh Mesh::init(Vertex *verticies, u32 num_verticies,
+                const void *indices, u32 num_indices, u32 index_size) {
+    u32 vao = 0, vbo = 0, ebo = 0;
 
     glGenVertexArrays(1, &vao);
     glGenBuffers(1, &vbo);
@@ -254,22 +304,39 @@ Mesh Mesh::init(Vertex *verticies, u32 num_verticies) {
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
     glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * num_verticies, verticies, GL_STATIC_DRAW);
 
+    u32 index_type = 0;
+    if (indices) {
+        ASSERT(index_size == 2 || index_size == 4, "Invalid index size {}", index_size);
+        index_type = index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+        // The element buffer binding is stored in the vertex array.
+        glGenBuffers(1, &ebo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_size * num_indices, indices, GL_STATIC_DRAW);
+    }
+
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, position));
 
     glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, texture));
+    glVertexAttribPointer(1, 2, GL_HALF_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, texture));
 
     glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, normal));
+    glVertexAttribPointer(2, 2, GL_SHORT, 1, sizeof(Vertex), (void *)offsetof(Vertex, normal));
     glBindVertexArray(0);
 
-    return { vao, vbo, num_verticies };
+    u32 draw_length = indices ? num_indices : num_verticies;
+    return { vao, vbo, ebo, draw_length, index_type };
 }
 
 void Mesh::draw() {
+    // Placeholders for assets that are still streaming in.
+    if (draw_length == 0) return;
     glBindVertexArray(vao);
-    glDrawArrays(GL_TRIANGLES, 0, draw_length);
+    if (index_type) {
+        glDrawElements(GL_TRIANGLES, draw_length, index_type, 0);
+    } else {
+        glDrawArrays(GL_TRIANGLES, 0, draw_length);
+    }
     glBindVertexArray(0);
 }
 
@@ -292,25 +359,25 @@ Skin Skin::init(Vertex *verticies, u32 num_verticies) {
     glVertexAttribPointer(0, 3, GL_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, position));
 
     glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, texture));
+    glVertexAttribPointer(1, 2, GL_HALF_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, texture));
 
     glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, normal));
+    glVertexAttribPointer(2, 2, GL_SHORT, 1, sizeof(Vertex), (void *)offsetof(Vertex, normal));
 
+    // Integer attribute, read as a uvec4 in the shader.
     glEnableVertexAttribArray(3);
-    glVertexAttribPointer(3, 2, GL_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, weight1));
+    glVertexAttribIPointer(3, 4, GL_UNSIGNED_BYTE, sizeof(Vertex), (void *)offsetof(Vertex, bones));
 
     glEnableVertexAttribArray(4);
-    glVertexAttribPointer(4, 2, GL_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, weight2));
-
-    glEnableVertexAttribArray(5);
-    glVertexAttribPointer(5, 2, GL_FLOAT, 0, sizeof(Vertex), (void *)offsetof(Vertex, weight3));
+    glVertexAttribPointer(4, 4, GL_UNSIGNED_SHORT, 1, sizeof(Vertex), (void *)offsetof(Vertex, weights));
     glBindVertexArray(0);
 
     return { vao, vbo, num_verticies };
 }
 
 void Skin::draw() {
+    // Placeholders for assets that are still streaming in.
+    if (draw_length == 0) return;
     glBindVertexArray(vao);
     glDrawArrays(GL_TRIANGLES, 0, draw_length);
     glBindVertexArray(0);
@@ -370,7 +437,10 @@ AnimatedMesh AnimatedMesh::init(AssetID skin, AssetID skeleton, AssetID animatio
     Asset::fetch_skeleton(skeleton);
     Asset::fetch_animation(animation);
 
-    return { skin, skeleton, animation, AnimatedMesh::STANDARD_FRAME_PER_SECOND };
+    return { Asset::resolve(skin),
+             Asset::resolve(skeleton),
+             Asset::resolve(animation),
+             AnimatedMesh::STANDARD_FRAME_PER_SECOND };
 }
 
 static Mat lerp_to_matrix(Transform a, Transform b, f32 blend) {
@@ -457,7 +527,7 @@ void Shader::use() { glUseProgram(program_id); }
 MasterShader MasterShader::init() {
 
     MasterShader shader;
-    shader.program_id = Asset::fetch_shader("MASTER_SHADER")->program_id;
+    shader.program_id = Asset::fetch_shader(AssetIDs::MASTER_SHADER)->program_id;
 
     FETCH_SHADER_PROP(t);
     FETCH_SHADER_PROP(sun_color);
@@ -468,6 +538,7 @@ MasterShader MasterShader::init() {
     FETCH_SHADER_PROP(model);
     FETCH_SHADER_PROP(model_norm);
     FETCH_SHADER_PROP(tex);
+    FETCH_SHADER_PROP(layer);
 
     FETCH_SHADER_PROP_FOR_LIST(bones);
 
@@ -503,6 +574,7 @@ MasterShader MasterShader::init() {
 
 F32_SHADER_PROP(MasterShader, t);
 U32_SHADER_PROP(MasterShader, tex);
+U32_SHADER_PROP(MasterShader, layer);
 
 MAT_SHADER_PROP(MasterShader, proj);
 MAT_SHADER_PROP(MasterShader, view);
@@ -521,19 +593,19 @@ void MasterShader::upload_lights(Vec3 *positions, Color3 *colors) const {
 }
 
 PostProcessShader post_process_shader() {
-    if (Asset::needs_reload("POSTPROCESS_SHADER"))
+    if (Asset::needs_reload(AssetIDs::POSTPROCESS_SHADER))
         GAMESTATE()->renderer.post_process_shader = PostProcessShader::init();
     return GAMESTATE()->renderer.post_process_shader;
 }
 
 MasterShader master_shader() {
-    if (Asset::needs_reload("MASTER_SHADER"))
+    if (Asset::needs_reload(AssetIDs::MASTER_SHADER))
         GAMESTATE()->renderer.master_shader = MasterShader::init();
     return GAMESTATE()->renderer.master_shader;
 }
 
 DebugShader debug_shader() {
-    if (Asset::needs_reload("DEBUG_SHADER"))
+    if (Asset::needs_reload(AssetIDs::DEBUG_SHADER))
         GAMESTATE()->renderer.debug_shader = DebugShader::init();
     return GAMESTATE()->renderer.debug_shader;
 }
@@ -555,7 +627,7 @@ Camera *gameplay_camera() {
 
 DebugShader DebugShader::init() {
     DebugShader shader;
-    shader.program_id = Asset::fetch_shader("DEBUG_SHADER")->program_id;
+    shader.program_id = Asset::fetch_shader(AssetIDs::DEBUG_SHADER)->program_id;
 
     FETCH_SHADER_PROP(proj);
     FETCH_SHADER_PROP(view);
@@ -570,7 +642,7 @@ MAT_SHADER_PROP(DebugShader, model);
 
 PostProcessShader PostProcessShader::init() {
     PostProcessShader shader;
-    shader.program_id = Asset::fetch_shader("POSTPROCESS_SHADER")->program_id;
+    shader.program_id = Asset::fetch_shader(AssetIDs::POSTPROCESS_SHADER)->program_id;
 
     FETCH_SHADER_PROP(t);
     FETCH_SHADER_PROP(tex);
@@ -650,48 +722,109 @@ Shader Shader::compile(const char *asset, const char *source) {
     return { program };
 }
 
-Texture Texture::upload(u32 width, u32 height, u32 components, u8 *data, Sampling sampling) {
+u64 Texture::data_size(u32 width, u32 height, u32 components, u32 num_levels, u32 num_layers) {
+    u64 size = 0;
+    for (u32 level = 0; level < num_levels; level++) {
+        size += (u64)Math::max<u32>(1, width >> level) * Math::max<u32>(1, height >> level);
+    }
+    return size * components * num_layers;
+}
+
+Texture Texture::upload(u32 width, u32 height, u32 components,
+                        u32 num_levels, u32 num_layers,
+                        u8 *data, Sampling sampling) {
+    ASSERT(num_levels > 0 && num_layers > 0, "A texture needs at least one level and layer");
     u32 texture = 0;
 #ifndef TESTS
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
 
     GLenum format = GL_RED;
-    if (components == 1) format = GL_RED;
-    else if (components == 2)
+    GLenum internal_format = GL_R8;
+    if (components == 1) {
+        format = GL_RED;
+        internal_format = GL_R8;
+    } else if (components == 2) {
         format = GL_RG;
-    else if (components == 3)
+        internal_format = GL_RG8;
+    } else if (components == 3) {
         format = GL_RGB;
-    else if (components == 4)
+        internal_format = GL_RGB8;
+    } else if (components == 4) {
         format = GL_RGBA;
-    else
+        internal_format = GL_RGBA8;
+    } else {
         UNREACHABLE("Invalid number of components ({})", components);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+    }
+
+    // The rows are packed tightly, which they aren't
+    // by default for RGB.
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    u8 *level_data = data;
+    for (u32 level = 0; level < num_levels; level++) {
+        u32 level_width = Math::max<u32>(1, width >> level);
+        u32 level_height = Math::max<u32>(1, height >> level);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internal_format,
+                     level_width, level_height, num_layers,
+                     0, format, GL_UNSIGNED_BYTE, level_data);
+        level_data += (u64)level_width * level_height * components * num_layers;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+
     GLenum gl_sampling = GL_LINEAR;
-    if (sampling == Sampling::LINEAR) gl_sampling = GL_LINEAR;
-    else if (sampling == Sampling::NEAREST)
+    GLenum gl_min_sampling = GL_LINEAR;
+    if (sampling == Sampling::LINEAR) {
+        gl_sampling = GL_LINEAR;
+        gl_min_sampling = num_levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR;
+    } else if (sampling == Sampling::NEAREST) {
         gl_sampling = GL_NEAREST;
-    else
+        gl_min_sampling = num_levels > 1 ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST;
+    } else {
         UNREACHABLE("Unsupported sampling ({})", components);
+    }
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, gl_sampling);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, gl_sampling);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, gl_min_sampling);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, gl_sampling);
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 #endif
-    return { .texture_id = texture, .width = width, .height = height, .components = components };
+    return {
+        .texture_id = texture,
+        .width = width,
+        .height = height,
+        .components = components,
+        .num_levels = num_levels,
+        .num_layers = num_layers,
+        .layers = nullptr,
+    };
 }
 
 void Texture::bind(u32 texture_slot) {
     ASSERT_LT(texture_slot, 80);
     glActiveTexture(GL_TEXTURE0 + texture_slot);
-    glBindTexture(GL_TEXTURE_2D, texture_id);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_id);
     glActiveTexture(GL_TEXTURE0 + 79); // Hardcoded since it's the "minimum maximum".
 }
 
+u32 Texture::layer(AssetID name) const {
+    for (u32 i = 0; layers && i < num_layers; i++) {
+        if (layers[i] == name) return i;
+    }
+    WARN("No layer {} in the texture", name);
+    return 0;
+}
+
 void Texture::destroy() {
+    // The name can be reused by the next texture.
+    if (GAMESTATE()->renderer.bound_texture == texture_id) {
+        GAMESTATE()->renderer.bound_texture = 0;
+    }
     glDeleteTextures(1, &texture_id);
+    delete[] layers;
+    layers = nullptr;
 }
 
 bool init(GameState *gs, i32 width, i32 height) {
@@ -726,10 +859,10 @@ bool init(GameState *gs, i32 width, i32 height) {
     }
 
     Mesh::Vertex a, b, c, d;
-    a = { { -1., -1., +0. }, { 0., 0. }, {} };
-    b = { { +1., -1., +0. }, { 1., 0. }, {} };
-    c = { { +1., +1., +0. }, { 1., 1. }, {} };
-    d = { { -1., +1., +0. }, { 0., 1. }, {} };
+    a = Mesh::Vertex::pack({ -1., -1., +0. }, { 0., 0. }, {});
+    b = Mesh::Vertex::pack({ +1., -1., +0. }, { 1., 0. }, {});
+    c = Mesh::Vertex::pack({ +1., +1., +0. }, { 1., 1. }, {});
+    d = Mesh::Vertex::pack({ -1., +1., +0. }, { 0., 1. }, {});
 
     Mesh::Vertex verticies[] = { a, b, c, a, c, d };
     gs->renderer.quad = Mesh::init(verticies, LEN(verticies));
@@ -778,17 +911,33 @@ void set_screen_resolution(i32 width, i32 height) {
     GAMESTATE()->renderer.set_screen_resolution(width, height);
 }
 
-void push_mesh(AssetID mesh, AssetID texture, Vec3 position, Quat rotation, Vec3 scale) {
+static void push_mesh(Mesh *mesh, Texture *texture, u32 layer, Vec3 position, Quat rotation, Vec3 scale) {
     MasterShader shader = master_shader();
-    Asset::fetch_texture(texture)->bind(1);
+    if (GAMESTATE()->renderer.bound_texture != texture->texture_id) {
+        texture->bind(1);
+        GAMESTATE()->renderer.bound_texture = texture->texture_id;
+    }
     shader.upload_tex(1);
+    shader.upload_layer(layer);
 
     Mat model = Mat::translate(position) * Mat::from(rotation) * Mat::scale(scale);
     shader.upload_model(model);
     Mat model_norm = model.invert().transpose();
     model_norm.gfx_dump();
     shader.upload_model_norm(model_norm);
-    Asset::fetch_mesh(mesh)->draw();
+    mesh->draw();
+}
+
+void push_mesh(AssetID mesh, AssetID texture, Vec3 position, Quat rotation, Vec3 scale) {
+    push_mesh(Asset::fetch_mesh(mesh), Asset::fetch_texture(texture), 0, position, rotation, scale);
+}
+
+void push_mesh(AssetHandle mesh, AssetHandle texture, Vec3 position, Quat rotation, Vec3 scale) {
+    push_mesh(Asset::fetch_mesh(mesh), Asset::fetch_texture(texture), 0, position, rotation, scale);
+}
+
+void push_mesh(AssetHandle mesh, AssetHandle texture, u32 layer, Vec3 position, Quat rotation, Vec3 scale) {
+    push_mesh(Asset::fetch_mesh(mesh), Asset::fetch_texture(texture), layer, position, rotation, scale);
 }
 
 void set_camera_mode(bool debug_mode) {
@@ -806,6 +955,7 @@ bool reload(GameState *gs) {
         ERR("Failed to reload OpenGL function.");
         return false;
     }
+    gs->renderer.bound_texture = 0;
 
     return true;
 }
@@ -909,3 +1059,22 @@ void resolve_to_screen(RenderTexture texture) {
 }
 
 } // namespace GFX
+
+#include "../test.h"
+
+TEST_CASE("texture data size", {
+    return GFX::Texture::data_size(4, 2, 4, 3, 2) == (8 + 2 + 1) * 4 * 2
+           && GFX::Texture::data_size(1, 8, 3, 4, 1) == (8 + 4 + 2 + 1) * 3;
+});
+
+TEST_CASE("mesh vertex pack texture", {
+    GFX::Mesh::Vertex v = GFX::Mesh::Vertex::pack(Vec3(), Vec2(0.5, 1.0), Vec3(0, 0, 1));
+    return v.texture[0] == 0x3800 && v.texture[1] == 0x3C00;
+});
+
+TEST_CASE("mesh vertex pack normal", {
+    GFX::Mesh::Vertex up = GFX::Mesh::Vertex::pack(Vec3(), Vec2(), Vec3(1, 0, 0));
+    GFX::Mesh::Vertex down = GFX::Mesh::Vertex::pack(Vec3(), Vec2(), Vec3(0, 0, -1));
+    return up.normal[0] == 32767 && up.normal[1] == 0
+        && down.normal[0] == 32767 && down.normal[1] == 32767;
+});
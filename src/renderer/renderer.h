@@ -66,30 +66,45 @@ struct Camera {
 };
 
 struct Mesh {
+    ///*
+    // 20 bytes, the texture coordinates are half floats and
+    // the normal is octahedral encoded as two snorm16.
     struct Vertex {
         Vec3 position;
-        Vec2 texture;
-        Vec3 normal;
+        u16 texture[2];
+        i16 normal[2];
+
+        static Vertex pack(Vec3 position, Vec2 texture, Vec3 normal);
     };
 
-    u32 vao, vbo;
+    u32 vao, vbo, ebo;
     u32 draw_length;
+    // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT for indexed
+    // meshes, 0 if the vertices are drawn in order.
+    u32 index_type;
 
     static Mesh init(Vertex *vericies, u32 num_verticies);
 
+    ///*
+    // An indexed mesh, index_size is 2 or 4 bytes.
+    static Mesh init(Vertex *verticies, u32 num_verticies,
+                     const void *indices, u32 num_indices, u32 index_size);
+
     void destroy();
 
     void draw();
 };
 
 struct Skin {
+    ///*
+    // 32 bytes, packed like Mesh::Vertex with up to four
+    // bones per vertex. The weights are unorm16 and sum to one.
     struct Vertex {
         Vec3 position;
-        Vec2 texture;
-        Vec3 normal;
-        Vec2 weight1;
-        Vec2 weight2;
-        Vec2 weight3;
+        u16 texture[2];
+        i16 normal[2];
+        u8 bones[4];
+        u16 weights[4];
     };
 
     u32 vao, vbo;
@@ -158,9 +173,9 @@ struct Animation {
 
 struct AnimatedMesh {
     static constexpr float STANDARD_FRAME_PER_SECOND = 1.0 / 60.0;
-    AssetID skin;
-    AssetID skeleton;
-    AssetID animation;
+    AssetHandle skin;
+    AssetHandle skeleton;
+    AssetHandle animation;
 
     // f32 time; // Add this in to let the animation be stepped through.
     f32 seconds_to_frame;
@@ -211,6 +226,7 @@ struct Shader {
 struct MasterShader : public Shader {
     F32_SHADER_PROP(t);
     U32_SHADER_PROP(tex);
+    U32_SHADER_PROP(layer);
 
     MAT_SHADER_PROP(proj);
     MAT_SHADER_PROP(view);
@@ -254,12 +270,20 @@ struct DebugShader : public Shader {
 #undef MAT_SHADER_PROP
 #undef MATS_SHADER_PROP
 
+///* Texture
+// Always an array texture, a texture from a single image has one
+// layer. The data has all the mip levels, from the largest to the
+// smallest, with all the layers of a level after each other.
 struct Texture {
     u32 texture_id;
 
     u32 width;
     u32 height;
     u32 components;
+    u32 num_levels;
+    u32 num_layers;
+    // The hashed names of the layers, owned by the texture.
+    AssetID *layers;
 
     enum class Sampling {
         LINEAR,
@@ -269,7 +293,16 @@ struct Texture {
     void bind(u32 texture_slot = 0);
     void destroy();
 
-    static Texture upload(u32 width, u32 height, u32 components, u8 *data, Sampling sampling);
+    // The index of the layer with the name, or 0 if there
+    // is no such layer.
+    u32 layer(AssetID name) const;
+
+    // How many bytes of data the texture is uploaded from.
+    static u64 data_size(u32 width, u32 height, u32 components, u32 num_levels, u32 num_layers);
+
+    static Texture upload(u32 width, u32 height, u32 components,
+                          u32 num_levels, u32 num_layers,
+                          u8 *data, Sampling sampling);
 };
 
 struct RenderTexture {
@@ -364,6 +397,10 @@ struct Renderer {
 
     u32 first_empty;
     std::vector<DebugPrimitive> primitives;
+
+    // What push_mesh last bound, so draws with the
+    // same texture don't bind it again.
+    u32 bound_texture;
 };
 
 ///*
@@ -384,8 +421,11 @@ void set_screen_resolution();
 void set_screen_resolution(i32 width, i32 height);
 
 ///*
-// A convenience function for drawing meshes.
+// A convenience function for drawing meshes, with a layer of
+// the texture. Draws with the same texture share one binding.
 void push_mesh(AssetID mesh, AssetID texture, Vec3 position, Quat rotation, Vec3 scale);
+void push_mesh(AssetHandle mesh, AssetHandle texture, Vec3 position, Quat rotation, Vec3 scale);
+void push_mesh(AssetHandle mesh, AssetHandle texture, u32 layer, Vec3 position, Quat rotation, Vec3 scale);
 
 ///*
 // Returns the lighting struct.
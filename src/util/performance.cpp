@@ -4,6 +4,8 @@
 
 #ifdef IMGUI_ENABLE
 #include "imgui/implot.h"
+#include <algorithm>
+#include <cstring>
 #endif
 
 namespace Performance {
@@ -236,6 +238,99 @@ void performance_capture_gui() {
     }
 }
 
+// A sortable table with the load stats of every asset.
+void asset_stats_gui() {
+    ImGui::Text("> Assets");
+    ImGui::SameLine();
+    if (ImGui::Button("Dump CSV")) {
+        Asset::write_stats_csv(ASSET_STATS_FILE_NAME);
+    }
+
+    enum Column {
+        NAME,
+        TYPE,
+        LOADS,
+        BYTES_READ,
+        DECODE_MS,
+        UPLOAD_MS,
+        CPU_BYTES,
+        GPU_BYTES,
+
+        NUM_COLUMNS,
+    };
+
+    ImGuiTableFlags flags = ImGuiTableFlags_Sortable
+                            | ImGuiTableFlags_RowBg
+                            | ImGuiTableFlags_Borders
+                            | ImGuiTableFlags_Resizable
+                            | ImGuiTableFlags_ScrollY;
+    if (!ImGui::BeginTable("Assets", NUM_COLUMNS, flags, Vec2(0.0, 300.0))) return;
+    ImGui::TableSetupScrollFreeze(0, 1);
+    ImGui::TableSetupColumn("Name", ImGuiTableColumnFlags_DefaultSort, 0.0, NAME);
+    ImGui::TableSetupColumn("Type", 0, 0.0, TYPE);
+    ImGui::TableSetupColumn("Loads", 0, 0.0, LOADS);
+    ImGui::TableSetupColumn("Read", 0, 0.0, BYTES_READ);
+    ImGui::TableSetupColumn("Decode ms", 0, 0.0, DECODE_MS);
+    ImGui::TableSetupColumn("Upload ms", 0, 0.0, UPLOAD_MS);
+    ImGui::TableSetupColumn("CPU", 0, 0.0, CPU_BYTES);
+    ImGui::TableSetupColumn("GPU", 0, 0.0, GPU_BYTES);
+    ImGui::TableHeadersRow();
+
+    std::vector<Asset::AssetReport> reports = Asset::collect_stats();
+    if (ImGuiTableSortSpecs *specs = ImGui::TableGetSortSpecs(); specs && specs->SpecsCount) {
+        const ImGuiTableColumnSortSpecs *spec = specs->Specs;
+        auto key = [spec](const Asset::AssetReport &a, const Asset::AssetReport &b) {
+            switch (spec->ColumnUserID) {
+            case NAME:
+                return std::strcmp(a.name, b.name) < 0;
+            case TYPE:
+                return a.type < b.type;
+            case LOADS:
+                return a.stats.loads < b.stats.loads;
+            case BYTES_READ:
+                return a.stats.bytes_read < b.stats.bytes_read;
+            case DECODE_MS:
+                return a.stats.decode_ms < b.stats.decode_ms;
+            case UPLOAD_MS:
+                return a.stats.upload_ms < b.stats.upload_ms;
+            case CPU_BYTES:
+                return a.cpu_size < b.cpu_size;
+            case GPU_BYTES:
+                return a.gpu_size < b.gpu_size;
+            default:
+                UNREACHABLE("Unknown asset stats column {}", spec->ColumnUserID);
+            }
+            return false;
+        };
+        if (spec->SortDirection == ImGuiSortDirection_Descending) {
+            std::stable_sort(reports.rbegin(), reports.rend(), key);
+        } else {
+            std::stable_sort(reports.begin(), reports.end(), key);
+        }
+    }
+
+    for (const Asset::AssetReport &report : reports) {
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(report.name);
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(Asset::asset_type_names[report.type]);
+        ImGui::TableNextColumn();
+        ImGui::Text("%u", report.stats.loads);
+        ImGui::TableNextColumn();
+        ImGui::Text("%llu", (unsigned long long)report.stats.bytes_read);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.3f", report.stats.decode_ms);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.3f", report.stats.upload_ms);
+        ImGui::TableNextColumn();
+        ImGui::Text("%llu", (unsigned long long)report.cpu_size);
+        ImGui::TableNextColumn();
+        ImGui::Text("%llu", (unsigned long long)report.gpu_size);
+    }
+    ImGui::EndTable();
+}
+
 f32 frame_time[HISTORY_LENGTH] = {};
 void report() {
     dump_frame_to_capture_file();
@@ -357,6 +452,8 @@ void report() {
             }
         }
     }
+
+    asset_stats_gui();
     ImGui::End();
 }
 #else // Without IMGUI
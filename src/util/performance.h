@@ -67,6 +67,11 @@ i32 capture_frames_left();
 
 void report();
 
+///* ASSET_STATS_FILE_NAME
+// Where the load stats of the assets are dumped,
+// see Asset::write_stats_csv.
+const char ASSET_STATS_FILE_NAME[] = "asset-stats.csv";
+
 #define _b_performance(name, line)                                  \
     auto _PERFORMANCE_BLOCK_##line = Performance::begin_time_block( \
         name,                                                       \
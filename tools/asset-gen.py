@@ -34,6 +34,7 @@ for formats as https://docs.python.org/3/library/struct.html.
 Format of binary file:
 - File header
 - Asset headers
+- Name index
 - Asset names
 - Asset data
 
@@ -42,20 +43,58 @@ Format of file header:
 - Q Adress of first header-byte
 - Q Adress of first name-byte
 - Q Adress of first data-byte
+- Q Adress of first index-byte
+- Q Index capacity (a power of two)
 
 Format of asset header:
 - I Type (texture, font, sprite etc)
+- I Flags (FLAG_COMPRESSED, FLAG_STREAMED)
 - Q Name hash
-- Q Data hash
+- Q Data hash (of the uncompressed data)
 - Q Name size                     [bytes]
 - Q Name offset (first asset = 0) [bytes]
-- Q Data size                     [bytes]
+- Q Data size (as stored)         [bytes]
 - Q Data offset (first asset = 0) [bytes]
 - P Name pointer
 
 The names are a number of character-bytes (ASCII)
 with length as specified by the asset header.
 
+The name index is an open-addressing hash table from
+name hash to header slot, so the game can find assets
+without building a table of its own. Every entry is:
+
+- Q Name hash
+- I Header slot (EMPTY_INDEX_SLOT if the entry is empty)
+- I Padding
+
+An asset starts probing at index_bucket(name hash) and
+moves to the next entry, wrapping around, until the
+name hash or an empty entry is found. The index is at
+most half full.
+
+Assets of the types in COMPRESSED_TYPES are compressed if it
+makes them smaller, and get FLAG_COMPRESSED. Assets with
+FLAG_STREAMED are read a piece at a time while they are used,
+and are never compressed. The data is
+split into blocks of COMPRESSION_BLOCK_SIZE bytes, each
+compressed on its own in the LZ4 block format, and stored as:
+
+- Q Uncompressed size [bytes]
+- I Block size        [bytes]
+- I Number of blocks
+- For every block:
+  - I  Compressed size [bytes]
+  - B> Compressed data
+
+A block that doesn't get smaller is stored as is, which is
+the case when the compressed size equals the block size.
+
+The name block and the data of every asset start on a
+DATA_ALIGNMENT-byte boundary, so the game can point
+straight into a memory mapped file. The padding is not
+counted in the sizes.
+
 Format of asset data is arbitrary. In addition to
 the formats specified by `struct`-documentation,
 this data format specifies "variable amount" as >.
@@ -65,16 +104,23 @@ format:
     - I  Pixel width
     - I  Pixel height
     - I  Color channels
+    - I  Number of mip levels
+    - I  Number of layers
     - P  Data pointer
+    - Q> Layer name hashes
     - B> Data
 
 In this case, the length of the data can be
-calculated with width * height * channels. A
+calculated from the size, channels, levels and
+layers. A
 variable amount of data should never be sent
 without a means of calculating the length before
 reading it, which means you should not depend on,
 for example, a terminating 0x00.
 """
+import functools
+import importlib.util
+import os
 import re
 import sys
 import struct
@@ -83,12 +129,19 @@ from glob import glob
 from PIL import Image
 from collections import defaultdict
 
-FILE_HEADER_FMT = "QQQQ"
-ASSET_HEADER_FMT = "IQQQQQQP"
+FILE_HEADER_FMT = "QQQQQQ"
+ASSET_HEADER_FMT = "IIQQQQQQP"
 
 HEADER_OFFSET = struct.calcsize(FILE_HEADER_FMT)
 HEADER_SIZE = struct.calcsize(ASSET_HEADER_FMT)
 
+INDEX_ENTRY_FMT = "QII"
+INDEX_ENTRY_SIZE = struct.calcsize(INDEX_ENTRY_FMT)
+EMPTY_INDEX_SLOT = 0xFFFFFFFF
+MIN_INDEX_CAPACITY = 16
+
+DATA_ALIGNMENT = 8
+
 TYPE_NONE = 0
 TYPE_TEXTURE = 1
 TYPE_STRING = 2
@@ -100,12 +153,60 @@ TYPE_SKELETON = 7
 TYPE_ANIMATION = 8
 TYPE_LEVEL = 9
 
+FLAG_COMPRESSED = 1 << 0
+FLAG_STREAMED = 1 << 1
+
+COMPRESSED_TYPES = {
+    TYPE_TEXTURE,
+    TYPE_MODEL,
+    TYPE_SOUND,
+    TYPE_SKINNED,
+    TYPE_ANIMATION,
+}
+COMPRESSION_BLOCK_SIZE = 1 << 16
+
+# Has to match Asset::SampleFormat.
+SAMPLE_FORMAT_I16 = 0
+SAMPLE_FORMAT_IMA_ADPCM = 1
+# Sounds at least this long are stored as IMA-ADPCM, shorter
+# ones are usually effects where the artifacts are heard.
+ADPCM_MIN_SECONDS = 2.0
+# Bytes per channel in an IMA-ADPCM block, the header holds
+# the first frame and the rest are two frames per byte.
+ADPCM_BLOCK_SIZE = 256
+ADPCM_FRAMES_PER_BLOCK = (ADPCM_BLOCK_SIZE - 4) * 2 + 1
+# Sounds at least this long are streamed from the pack while
+# they play, instead of being loaded up front.
+STREAM_MIN_SECONDS = 8.0
+
+IMA_INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8]
+IMA_STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767,
+]
+
+# Limits of the LZ4 block format.
+LZ4_MIN_MATCH = 4
+LZ4_MAX_OFFSET = 0xFFFF
+LZ4_LAST_LITERALS = 5
+LZ4_MATCH_SAFE_DISTANCE = 12
+
 
 def ll(x):
     """Overflow unsigned long."""
     return x % (2**64)
 
 
+def align(x):
+    """Round up to the next multiple of DATA_ALIGNMENT."""
+    return (x + DATA_ALIGNMENT - 1) // DATA_ALIGNMENT * DATA_ALIGNMENT
+
+
 def hash_string(string):
     h = 5351
     for c in string:
@@ -114,12 +215,97 @@ def hash_string(string):
 
 
 def hash_bytes(bytes):
-    h = 5351
+    """64 bit FNV-1a, only used to see if the data changed.
+
+    The name hash can't be used, every zero byte resets it."""
+    h = 0xCBF29CE484222325
     for b in bytes:
-        h = ll(ll(h * b) + b)
+        h = ll((h ^ b) * 0x100000001B3)
     return h
 
 
+def lz4_compress_block(src):
+    """Compress a block in the LZ4 block format.
+
+    A simple greedy compressor, it doesn't compress as
+    well as the real thing but any LZ4 decoder reads it."""
+    n = len(src)
+    out = bytearray()
+
+    def write_length(length):
+        while length >= 255:
+            out.append(255)
+            length -= 255
+        out.append(length)
+
+    def write_sequence(literals, match_length):
+        token_literals = min(len(literals), 15)
+        token_match = min(match_length - LZ4_MIN_MATCH, 15) if match_length else 0
+        out.append(token_literals << 4 | token_match)
+        if len(literals) >= 15:
+            write_length(len(literals) - 15)
+        out.extend(literals)
+
+    last_seen = {}
+    anchor = 0
+    i = 0
+    while i < n - LZ4_MATCH_SAFE_DISTANCE:
+        key = src[i:i + LZ4_MIN_MATCH]
+        candidate = last_seen.get(key)
+        last_seen[key] = i
+        if candidate is None or i - candidate > LZ4_MAX_OFFSET:
+            i += 1
+            continue
+
+        match_length = LZ4_MIN_MATCH
+        max_length = n - LZ4_LAST_LITERALS - i
+        while match_length < max_length and src[candidate + match_length] == src[i + match_length]:
+            match_length += 1
+
+        write_sequence(src[anchor:i], match_length)
+        out.extend(struct.pack("<H", i - candidate))
+        if match_length - LZ4_MIN_MATCH >= 15:
+            write_length(match_length - LZ4_MIN_MATCH - 15)
+        i += match_length
+        anchor = i
+
+    write_sequence(src[anchor:], 0)
+    return bytes(out)
+
+
+def compress(data):
+    """Compress asset data in blocks, see the module documentation."""
+    blocks = []
+    for start in range(0, len(data), COMPRESSION_BLOCK_SIZE):
+        block = data[start:start + COMPRESSION_BLOCK_SIZE]
+        packed = lz4_compress_block(block)
+        if len(packed) >= len(block):
+            packed = block
+        blocks.append(struct.pack("I", len(packed)) + packed)
+    return struct.pack("QII", len(data), COMPRESSION_BLOCK_SIZE, len(blocks)) + b"".join(blocks)
+
+
+def index_bucket(name_hash, capacity):
+    """Fibonacci hashing, has to match the game."""
+    bits = capacity.bit_length() - 1
+    return ll(name_hash * 0x9E3779B97F4A7C15) >> (64 - bits)
+
+
+def build_index(name_hashes):
+    """Build the name index, name_hashes are in header order."""
+    capacity = MIN_INDEX_CAPACITY
+    while capacity < 2 * len(name_hashes):
+        capacity *= 2
+
+    index = [(0, EMPTY_INDEX_SLOT)] * capacity
+    for slot, name_hash in enumerate(name_hashes):
+        bucket = index_bucket(name_hash, capacity)
+        while index[bucket][1] != EMPTY_INDEX_SLOT:
+            bucket = (bucket + 1) % capacity
+        index[bucket] = (name_hash, slot)
+    return capacity, b"".join(struct.pack(INDEX_ENTRY_FMT, h, s, 0) for h, s in index)
+
+
 def default_header():
     """Return a default header.
 
@@ -128,6 +314,7 @@ def default_header():
     # the ordering here matters and has to match the format string
     return {
         "type": TYPE_NONE,
+        "flags": 0,
         "name_hash": 0,
         "data_hash": 0,
         "name_size": 0,
@@ -139,20 +326,30 @@ def default_header():
     }
 
 
-def sprite_asset(path, verbose):
-    """Load an image.
+# The filters the mip levels can be made with, see --mip-filter.
+MIP_FILTERS = {
+    "none": None,
+    "nearest": Image.NEAREST,
+    "box": Image.BOX,
+    "bilinear": Image.BILINEAR,
+    "bicubic": Image.BICUBIC,
+    "lanczos": Image.LANCZOS,
+}
+mip_filter = "box"
 
-    Data format:
-    - I  Pixel width
-    - I  Pixel height
-    - I  Color channels
-    - P  Data pointer
-    - B> Data
-    """
 
-    im = Image.open(path)
-    w, h = im.size
+def mip_sizes(w, h):
+    """The size of every level in the mip chain, down to 1x1."""
+    sizes = [(w, h)]
+    while MIP_FILTERS[mip_filter] is not None and sizes[-1] != (1, 1):
+        w, h = sizes[-1]
+        sizes.append((max(1, w // 2), max(1, h // 2)))
+    return sizes
 
+
+def read_image(path):
+    """Returns the image and its number of channels, or (None, None)."""
+    im = Image.open(path)
     mode = im.mode
     if mode == "RGB":
         c = 3
@@ -161,18 +358,99 @@ def sprite_asset(path, verbose):
     else:
         print(f"Image mode {mode} not supported")
         return None, None
+    return im, c
+
+
+def texture_data(images, c, layer_names):
+    """Pack the images as the layers of a texture.
+
+    Data format:
+    - I  Pixel width
+    - I  Pixel height
+    - I  Color channels
+    - I  Number of mip levels
+    - I  Number of layers
+    - P  Data pointer
+    - Q> Layer name hashes
+    - B> Data
 
+    Every level is half the size of the one before, rounded
+    down, until 1x1. A level has all the layers after each other,
+    and the levels are stored from the largest to the smallest.
+    Each level is resized from the full image, so the errors
+    don't add up.
+    """
+    w, h = images[0].size
+    sizes = mip_sizes(w, h)
     data = []
-    for pixel in im.getdata():
-        data += [*pixel]
+    for size in sizes:
+        for im in images:
+            level = im if size == im.size else im.resize(size, MIP_FILTERS[mip_filter])
+            for pixel in level.getdata():
+                data += [*pixel]
+
+    fmt = "IIIIIP{}Q{}B".format(len(images), len(data))
+    hashes = [hash_string(name) for name in layer_names]
+    return fmt, struct.pack(fmt, w, h, c, len(sizes), len(images), 0, *hashes, *data)
+
 
-    fmt = "IIIP{}B".format(len(data))
+def sprite_asset(path, verbose):
+    """Load an image, as a texture with one layer."""
+
+    im, c = read_image(path)
+    if not im:
+        return None, None
+
+    fmt, data = texture_data([im], c, [asset_name(path)])
 
     header = default_header()
     header["type"] = TYPE_TEXTURE
     header["data_size"] = struct.calcsize(fmt)
 
-    yield header, struct.pack(fmt, w, h, c, 0, *data), ""
+    yield header, data, ""
+
+
+def layers_asset(path, verbose):
+    """Load the images listed in the file as the layers of one texture.
+
+    Every line is the path to an image, relative to the file,
+    empty lines and lines starting with # are skipped. The images
+    have to be the same size and have the same number of channels.
+    A layer is looked up with the hashed name of its image, named
+    like an asset. The images are not packed on their own.
+    """
+    images = []
+    names = []
+    c = None
+    for image_path in layer_paths(path):
+        im, channels = read_image(image_path)
+        if not im:
+            return None, None
+        if images and (im.size != images[0].size or channels != c):
+            print(f"Layer {image_path} doesn't match the first layer of {path}")
+            return None, None
+        images.append(im)
+        names.append(asset_name(image_path))
+        c = channels
+    if not images:
+        print(f"No layers in {path}")
+        return None, None
+
+    fmt, data = texture_data(images, c, names)
+
+    header = default_header()
+    header["type"] = TYPE_TEXTURE
+    header["data_size"] = struct.calcsize(fmt)
+
+    yield header, data, ""
+
+
+def layer_paths(path):
+    """The images listed in a layers file."""
+    directory = os.path.dirname(path)
+    with open(path) as f:
+        lines = [line.strip() for line in f]
+    return [os.path.join(directory, line) for line in lines if line and not line.startswith("#")]
 
 
 def string_asset(path, verbose):
@@ -193,23 +471,137 @@ def string_asset(path, verbose):
 
     yield header, struct.pack(fmt, len(data)+1, 0, str.encode(data, "ascii")), ""
 
+# How the field types of the entities are stored in a level,
+# they have to match the C++ types.
+LEVEL_FIELD_FORMATS = {
+    "i64": "q", "i32": "i", "i16": "h", "i8": "b",
+    "u64": "Q", "u32": "I", "u16": "H", "u8": "B",
+    "f32": "f", "f64": "d", "real": "f",
+    "bool": "?",
+    "Vec2": "2f", "Vec3": "3f", "Vec4": "4f",
+    "Color3": "3f", "Color4": "4f",
+    "H": "4f", "Quat": "4f",
+    "AssetID": "Q",
+}
+
+
+@functools.lru_cache(maxsize=None)
+def entity_structs():
+    """The entity types and their fields, as typesystem-gen.py finds them."""
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "typesystem-gen.py")
+    spec = importlib.util.spec_from_file_location("typesystem_gen", path)
+    typesystem_gen = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(typesystem_gen)
+    return typesystem_gen.find_entity_structs()
+
+
+def compile_level(path):
+    """Compile the text format of a level into entity records, and
+    the hashes of the assets the level uses.
+
+    The text format is:
+        @ <asset name>
+        # <type>
+        <field> <value?>
+
+    The assets are the ones named with @, and the ones in AssetID
+    fields. Errors are fatal, so a broken level doesn't make it
+    into the game.
+    """
+    structs = entity_structs()
+
+    def error(line_number, message):
+        print(f"{path}:{line_number}: {message}")
+        sys.exit(1)
+
+    entities = []
+    assets = []
+    for line_number, line in enumerate(open(path, "r"), 1):
+        line = line.strip()
+        if not line:
+            continue
+        if line.startswith("@"):
+            name = line[1:].strip()
+            if not name:
+                error(line_number, "Missing asset name")
+            assets.append(hash_string(name))
+            continue
+        if line.startswith("#"):
+            entity_type = line[1:].strip()
+            if entity_type not in structs:
+                error(line_number, f"Unknown entity type '{entity_type}'")
+            entities.append((entity_type, []))
+            continue
+        if not entities:
+            error(line_number, "Field before the first entity")
+
+        entity_type, fields = entities[-1]
+        name, *values = line.split()
+        field = next((f for f in structs[entity_type].fields if f["NAME"] == name), None)
+        if field is None:
+            error(line_number, f"No field '{name}' on {entity_type}")
+        if "INTERNAL" in field:
+            error(line_number, f"Field '{name}' is marked as internal and cannot be set")
+        fmt = LEVEL_FIELD_FORMATS.get(field["TYPE"])
+        if fmt is None:
+            error(line_number, f"Field '{name}' has unsupported type '{field['TYPE']}'")
+
+        num_values = len(struct.unpack(fmt, bytes(struct.calcsize(fmt))))
+        if len(values) != num_values:
+            error(line_number, f"Field '{name}' takes {num_values} values, got {len(values)}")
+        try:
+            if field["TYPE"] == "AssetID":
+                values = [hash_string(v) for v in values]
+                assets += values
+            elif fmt[-1] in "fd":
+                values = [float(v) for v in values]
+            elif fmt == "?":
+                values = [int(v) != 0 for v in values]
+            else:
+                values = [int(v) for v in values]
+        except ValueError:
+            error(line_number, f"Failed to parse the value of '{name}'")
+        fields.append((name, struct.pack(fmt, *values)))
+    return entities, list(dict.fromkeys(assets))
+
+
 def level_asset(path, verbose):
-    """Load an ASCII text file.
+    """Load a .lvl-file, compiled into entity records.
 
     Data format:
-    - Q  Number of characters
+    - Q  Number of entities
+    - Q  Size of the records [bytes]
+    - Q  Number of assets
     - P  Data pointer
-    - s> Data
+    - P  Assets pointer
+    - *> Records, for every entity:
+      - Q  Type name hash
+      - I  Number of fields
+      - I  Padding
+      - *> For every field:
+        - Q  Field name hash
+        - I  Size [bytes]
+        - I  Padding
+        - *> Value, as the C++ type, padded to 8 bytes
+    - Q> Name hashes of the assets the level uses
     """
+    entities, assets = compile_level(path)
+    records = b""
+    for entity_type, fields in entities:
+        records += struct.pack("QII", hash_string(entity_type), len(fields), 0)
+        for name, value in fields:
+            records += struct.pack("QII", hash_string(name), len(value), 0)
+            records += value + bytes(align(len(value)) - len(value))
+    if verbose:
+        print(f"  {len(entities)} entities, {len(assets)} assets, {len(records)} bytes")
 
-    data = "".join(open(path, "r").readlines()).rstrip()
-    fmt = "QP{}s".format(len(data) + 1)
+    fmt = "QQQPP{}s{}Q".format(len(records), len(assets))
 
     header = default_header()
     header["type"] = TYPE_LEVEL
     header["data_size"] = struct.calcsize(fmt)
 
-    yield header, struct.pack(fmt, len(data)+1, 0, str.encode(data, "ascii")), ""
+    yield header, struct.pack(fmt, len(entities), len(records), len(assets), 0, 0, records, *assets), ""
 
 def shader_asset(path, verbose):
     """Load a shader.
@@ -221,14 +613,218 @@ def shader_asset(path, verbose):
     yield header, data, ""
 
 
+# Vertex cache optimization, after "Linear-Speed Vertex Cache
+# Optimisation" by Tom Forsyth.
+VERTEX_CACHE_SIZE = 32
+CACHE_DECAY_POWER = 1.5
+LAST_TRIANGLE_SCORE = 0.75
+VALENCE_BOOST_SCALE = 2.0
+VALENCE_BOOST_POWER = 0.5
+
+# Clusters are only reordered for overdraw if it makes
+# the vertex cache at most this much worse.
+OVERDRAW_CACHE_THRESHOLD = 1.05
+
+
+def vertex_score(cache_position, remaining):
+    if remaining == 0:
+        return -1.0
+    score = 0.0
+    if cache_position < 0:
+        pass
+    elif cache_position < 3:
+        score = LAST_TRIANGLE_SCORE
+    else:
+        scaler = 1.0 / (VERTEX_CACHE_SIZE - 3)
+        score = (1.0 - (cache_position - 3) * scaler) ** CACHE_DECAY_POWER
+    return score + VALENCE_BOOST_SCALE * remaining ** -VALENCE_BOOST_POWER
+
+
+def optimize_vertex_cache(indices, num_vertices):
+    """Reorder the triangles so the vertices are reused while
+    they are still in the post-transform cache."""
+    num_triangles = len(indices) // 3
+    vertex_triangles = [[] for _ in range(num_vertices)]
+    for t in range(num_triangles):
+        for v in indices[3 * t:3 * t + 3]:
+            vertex_triangles[v].append(t)
+
+    remaining = [len(ts) for ts in vertex_triangles]
+    cache_position = [-1] * num_vertices
+    vertex_scores = [vertex_score(-1, r) for r in remaining]
+    triangle_scores = [sum(vertex_scores[v] for v in indices[3 * t:3 * t + 3]) for t in range(num_triangles)]
+    emitted = [False] * num_triangles
+
+    cache = []
+    out = []
+    next_unemitted = 0
+    best = max(range(num_triangles), key=lambda t: triangle_scores[t], default=None)
+    while best is not None:
+        emitted[best] = True
+        triangle = indices[3 * best:3 * best + 3]
+        out += triangle
+
+        for v in triangle:
+            remaining[v] -= 1
+            vertex_triangles[v].remove(best)
+            if v in cache:
+                cache.remove(v)
+        cache = triangle + cache
+
+        touched = set(cache)
+        for v in cache[VERTEX_CACHE_SIZE:]:
+            cache_position[v] = -1
+        cache = cache[:VERTEX_CACHE_SIZE]
+        for i, v in enumerate(cache):
+            cache_position[v] = i
+
+        best = None
+        best_score = -1.0
+        for v in touched:
+            vertex_scores[v] = vertex_score(cache_position[v], remaining[v])
+        for v in touched:
+            for t in vertex_triangles[v]:
+                score = sum(vertex_scores[u] for u in indices[3 * t:3 * t + 3])
+                triangle_scores[t] = score
+                if score > best_score:
+                    best, best_score = t, score
+
+        if best is None:
+            # Nothing left around the cache, start somewhere new.
+            while next_unemitted < num_triangles and emitted[next_unemitted]:
+                next_unemitted += 1
+            if next_unemitted < num_triangles:
+                best = next_unemitted
+    return out
+
+
+def cache_misses(indices):
+    """The number of vertex cache misses, with a FIFO cache."""
+    cache = []
+    misses = 0
+    for v in indices:
+        if v not in cache:
+            misses += 1
+            cache = [v] + cache[:VERTEX_CACHE_SIZE - 1]
+    return misses
+
+
+def optimize_overdraw(indices, positions):
+    """Split the cache optimized triangles into clusters where the
+    cache starts over, and draw the clusters facing outwards first
+    so they hide more of what is drawn after them."""
+    num_triangles = len(indices) // 3
+    clusters = []
+    cache = []
+    for t in range(num_triangles):
+        triangle = indices[3 * t:3 * t + 3]
+        misses = sum(1 for v in triangle if v not in cache)
+        if misses == 3 or not clusters:
+            clusters.append([])
+        clusters[-1].append(t)
+        for v in triangle:
+            if v not in cache:
+                cache = [v] + cache[:VERTEX_CACHE_SIZE - 1]
+
+    def sub(a, b): return [x - y for x, y in zip(a, b)]
+    def cross(a, b): return [a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]]
+    def dot(a, b): return sum(x * y for x, y in zip(a, b))
+
+    mesh_center = [sum(p[i] for p in positions) / max(len(positions), 1) for i in range(3)]
+
+    def outwardness(cluster):
+        center = [0.0, 0.0, 0.0]
+        normal = [0.0, 0.0, 0.0]
+        for t in cluster:
+            a, b, c = (positions[v] for v in indices[3 * t:3 * t + 3])
+            # The length of the cross product weights by area.
+            normal = [n + x for n, x in zip(normal, cross(sub(b, a), sub(c, a)))]
+            center = [m + (x + y + z) / 3 for m, x, y, z in zip(center, a, b, c)]
+        center = [m / len(cluster) for m in center]
+        return dot(sub(center, mesh_center), normal)
+
+    clusters.sort(key=outwardness, reverse=True)
+    out = []
+    for cluster in clusters:
+        for t in cluster:
+            out += indices[3 * t:3 * t + 3]
+
+    if cache_misses(out) > OVERDRAW_CACHE_THRESHOLD * cache_misses(indices):
+        return indices
+    return out
+
+
+def optimize_vertex_fetch(indices, vertices):
+    """Reorder the vertices in the order they are first used,
+    so the vertex fetches walk through memory in order."""
+    remap = {}
+    out_vertices = []
+    for v in indices:
+        if v not in remap:
+            remap[v] = len(out_vertices)
+            out_vertices.append(vertices[v])
+    return [remap[v] for v in indices], out_vertices
+
+
+def snorm16(f):
+    return max(-32767, min(32767, round(f * 32767)))
+
+
+def unorm16(f):
+    return max(0, min(65535, round(f * 65535)))
+
+
+def octahedral(normal):
+    """Map a normal onto the octahedron and unfold it into a square.
+
+    Returns two snorm16, decoded by decode_normal in master_shader.glsl.
+    """
+    x, y, z = normal
+    length = abs(x) + abs(y) + abs(z)
+    if length == 0:
+        return 0, 0
+    x, y = x / length, y / length
+    if z < 0:
+        x, y = (1 - abs(y)) * (1 if x >= 0 else -1), (1 - abs(x)) * (1 if y >= 0 else -1)
+    return snorm16(x), snorm16(y)
+
+
+# Matches GFX::Mesh::Vertex, position, half float texture, octahedral normal.
+MESH_VERTEX_FMT = "3f2e2h"
+# Matches GFX::Skin::Vertex, as a mesh vertex plus 4 bone indices and unorm weights.
+SKIN_VERTEX_FMT = "3f2e2h4B4H"
+
+
+def mesh_vertex(position, texture, normal):
+    return [*position, *texture, *octahedral(normal)]
+
+
+def skin_vertex(position, texture, normal, weights):
+    weights = sorted(weights, key=lambda w: -w[1])[:4]
+    weights += [(0, 0.0)] * (4 - len(weights))
+    total = sum(w for _, w in weights) or 1.0
+    bones = [int(b) for b, _ in weights]
+    assert all(0 <= b < 256 for b in bones), "Bone index doesn't fit in a byte"
+    quantized = [unorm16(w / total) for _, w in weights]
+    # Rounding error goes to the largest weight so they sum to one.
+    quantized[0] += 65535 - sum(quantized)
+    return mesh_vertex(position, texture, normal) + bones + quantized
+
+
 def model_asset(path, verbose):
     """Load a .obj model-file.
 
+    Faces are triangulated, vertices that are the same are
+    merged and the triangles are reordered for the vertex
+    cache and overdraw.
+
     Data format:
-    - I  Points per face
-    - I  Number of faces
-    - P  Data pointer
-    - f> Data
+    - I  Number of vertices
+    - I  Number of indices
+    - I  Index size (2 or 4) [bytes]
+    - I  Padding
+    - *> Vertices (3f position, 2e texture, 2h octahedral normal)
+    - H> or I> Indices
 
     Not included but present in file:
     - s   material library
@@ -252,91 +848,191 @@ def model_asset(path, verbose):
         elif line.startswith("vn "):
             normal_vertices.append([float(f) for f in line[3:].split(" ")])
         elif line.startswith("f "):
-            faces.append([[int(i) for i in v.split("/")] for v in line[2:].split(" ")])
+            faces.append([tuple(int(i) for i in v.split("/")) for v in line[2:].split(" ")])
         else:
             if verbose: print("  Unable to parse line '{}' in file {}".format(line, path))
             continue
 
-    points_per_face = len(faces[0])
-    num_faces = len(faces)
-
-    data = []
+    unique = {}
+    mesh_vertices = []
+    indices = []
     for face in faces:
-        for p in range(points_per_face):
-            data += vertices[face[p][0]-1]
-            data += texture_vertices[face[p][1]-1]
-            data += normal_vertices[face[p][2]-1]
+        # Fans, in case there are faces that aren't triangles.
+        for p in range(1, len(face) - 1):
+            for corner in (face[0], face[p], face[p + 1]):
+                if corner not in unique:
+                    unique[corner] = len(mesh_vertices)
+                    v, vt, vn = corner
+                    mesh_vertices.append(vertices[v-1] + texture_vertices[vt-1] + normal_vertices[vn-1])
+                indices.append(unique[corner])
+
+    indices = optimize_vertex_cache(indices, len(mesh_vertices))
+    indices = optimize_overdraw(indices, [v[0:3] for v in mesh_vertices])
+    indices, mesh_vertices = optimize_vertex_fetch(indices, mesh_vertices)
+    if verbose:
+        print(f"  {len(mesh_vertices)} vertices (was {len(indices)}), "
+              f"{cache_misses(indices) / (len(indices) // 3):.2f} cache misses per triangle")
 
-    fmt = "IIP{}f".format(len(data))
+    index_size = 2 if len(mesh_vertices) <= 0xFFFF else 4
+    index_fmt = "H" if index_size == 2 else "I"
+    data = [f for v in mesh_vertices for f in mesh_vertex(v[0:3], v[3:5], v[5:8])]
+    fmt = "IIII" + MESH_VERTEX_FMT * len(mesh_vertices) + "{}{}".format(len(indices), index_fmt)
 
     header = default_header()
     header["type"] = TYPE_MODEL
     header["data_size"] = struct.calcsize(fmt)
 
-    yield header, struct.pack(fmt, points_per_face, num_faces, 0, *data), ""
+    yield header, struct.pack(fmt, len(mesh_vertices), len(indices), index_size, 0, *data, *indices), ""
+
+
+def ima_decode_sample(nibble, predictor, index):
+    """Decode one IMA-ADPCM nibble, the same as the audio mixer does."""
+    step = IMA_STEP_TABLE[index]
+    diff = step >> 3
+    if nibble & 1: diff += step >> 2
+    if nibble & 2: diff += step >> 1
+    if nibble & 4: diff += step
+    if nibble & 8: diff = -diff
+    predictor = max(-32768, min(32767, predictor + diff))
+    index = max(0, min(88, index + IMA_INDEX_TABLE[nibble & 7]))
+    return predictor, index
+
+
+def ima_encode_sample(sample, predictor, index):
+    """Encode a sample as the nibble that gets the decoder closest to it."""
+    step = IMA_STEP_TABLE[index]
+    diff = sample - predictor
+    nibble = 0
+    if diff < 0:
+        nibble = 8
+        diff = -diff
+    if diff >= step:
+        nibble |= 4
+        diff -= step
+    if diff >= step >> 1:
+        nibble |= 2
+        diff -= step >> 1
+    if diff >= step >> 2:
+        nibble |= 1
+    return (nibble, *ima_decode_sample(nibble, predictor, index))
+
+
+def ima_adpcm_encode(samples, channels):
+    """Encode interleaved 16 bit samples as IMA-ADPCM.
+
+    The blocks are laid out like in WAV-files. Every channel starts
+    with a header (h predictor, B step index, B padding), then the
+    channels take turns with 4 bytes (8 samples) of nibbles, low
+    nibble first. Decoding can start at any block.
+    """
+    frames = len(samples) // channels
+    frames_per_block = ADPCM_FRAMES_PER_BLOCK
+    index = [0] * channels
+    out = bytearray()
+    for start in range(0, frames, frames_per_block):
+        block = bytearray(ADPCM_BLOCK_SIZE * channels)
+        predictor = []
+        for c in range(channels):
+            predictor.append(samples[start * channels + c])
+            struct.pack_into("hBB", block, 4 * c, predictor[c], index[c], 0)
+        for n in range(frames_per_block - 1):
+            frame = start + 1 + n
+            group, k = divmod(n, 8)
+            for c in range(channels):
+                # The last block is padded with the last sample.
+                sample = samples[frame * channels + c] if frame < frames else predictor[c]
+                nibble, predictor[c], index[c] = ima_encode_sample(sample, predictor[c], index[c])
+                block[4 * channels + (group * channels + c) * 4 + k // 2] |= nibble << (4 * (k & 1))
+        out += block
+    return bytes(out)
 
 
 def wav_asset(path, verbose):
     """Load a .wav-file.
 
+    The samples are stored as 16 bit integers, or as IMA-ADPCM
+    for sounds longer than ADPCM_MIN_SECONDS. Sounds longer
+    than STREAM_MIN_SECONDS get FLAG_STREAMED.
+
     Data format:
     - I  Channels
     - I  Sample rate
-    - I  Number of samples
+    - I  Number of samples (in all channels)
+    - I  Sample format (SAMPLE_FORMAT_*)
+    - I  Block size [bytes], for IMA-ADPCM
+    - I  Frames per block, for IMA-ADPCM
     - P  Data pointer
-    - f> Data
+    - h> or IMA-ADPCM blocks, Data
     """
     with wave.open(path, "rb") as file:
         sample_rate = file.getframerate()
         sample_width = file.getsampwidth()
         channels = file.getnchannels()
+        num_frames = file.getnframes()
 
-        def read_frames(fmt, size_bytes):
-            data = []
-
-            if fmt.isupper():
-                sign_bit = 0
-                sign_mov = 0.5
-            else:
-                sign_bit = 1
-                sign_mov = 0
-
-            div = 2**(8 * size_bytes - sign_bit) - 1
-
-            frames = file.readframes(file.getnframes())
-            if channels == 2:
-                data = struct.unpack("{}{}".format(file.getnframes()*2, fmt), frames)
-            elif channels == 1:
-                data = struct.unpack("{}{}".format(file.getnframes(), fmt), frames)
-            else:
-                print("Unsupport number of channels ({}) in file '{}'".format(channels, path))
-                sys.exit(1)
-
-            return [d/div - sign_mov for d in data]
+        if channels not in (1, 2):
+            print("Unsupport number of channels ({}) in file '{}'".format(channels, path))
+            sys.exit(1)
 
         types = { 1: "B", 2: "h", 4: "i" }
         if sample_width not in types:
             print("Unsupported bit depth {} for file '{}'", 8*sample_width, path)
             sys.exit(1)
 
-        data = read_frames(types[sample_width], sample_width)
-        fmt = "IIIP{}f".format(len(data))
+        frames = file.readframes(num_frames)
+        data = struct.unpack("{}{}".format(num_frames * channels, types[sample_width]), frames)
+        # Everything is converted to signed 16 bit.
+        if sample_width == 1:
+            data = [(d - 128) << 8 for d in data]
+        elif sample_width == 4:
+            data = [d >> 16 for d in data]
+
+        if num_frames >= ADPCM_MIN_SECONDS * sample_rate:
+            sample_format = SAMPLE_FORMAT_IMA_ADPCM
+            block_size = ADPCM_BLOCK_SIZE * channels
+            frames_per_block = ADPCM_FRAMES_PER_BLOCK
+            samples = ima_adpcm_encode(data, channels)
+        else:
+            sample_format = SAMPLE_FORMAT_I16
+            block_size = 0
+            frames_per_block = 0
+            samples = struct.pack("{}h".format(len(data)), *data)
+        if verbose:
+            print(f"  {len(data) * 4} bytes as floats, stored in {len(samples)}")
+
+        fmt = "IIIIIIP{}s".format(len(samples))
         header = default_header()
         header["type"] = TYPE_SOUND
+        if num_frames >= STREAM_MIN_SECONDS * sample_rate:
+            header["flags"] |= FLAG_STREAMED
         header["data_size"] = struct.calcsize(fmt)
-        yield header, struct.pack(fmt, channels, sample_rate, len(data), 0, *data), ""
+        yield header, struct.pack(fmt, channels, sample_rate, len(data), sample_format,
+                                  block_size, frames_per_block, 0, samples), ""
 
 
 def skinned_asset(path, verbose):
     """Read a skinned mesh in the .edan format.
 
     Returns 2+N assets: 1 mesh, 1 skeleton and N animations.
+
+    Skin data format:
+    - I  Number of vertices
+    - I  Padding
+    - *> Vertices (SKIN_VERTEX_FMT)
     """
     flatmap = lambda x, y: list(map(x, y))
 
     def parse_geo(line):
-        data = flatmap(float, line.split())
-        return [len(data)] + data, TYPE_SKINNED, f"I{len(data)}f", "SKIN_"
+        floats = flatmap(float, line.split())
+        data = []
+        # Position, normal, texture and three (bone, weight) pairs,
+        # in the order blender_exporter.py writes them.
+        for i in range(0, len(floats), 14):
+            v = floats[i:i + 14]
+            weights = [(v[8], v[9]), (v[10], v[11]), (v[12], v[13])]
+            data += skin_vertex(v[0:3], v[6:8], v[3:6], weights)
+        num_vertices = len(floats) // 14
+        return [num_vertices, 0] + data, TYPE_SKINNED, "II" + SKIN_VERTEX_FMT * num_vertices, "SKIN_"
 
     def parse_arm(line):
         bones = []
@@ -390,6 +1086,7 @@ def skinned_asset(path, verbose):
 EXTENSIONS = {
     "png": sprite_asset,
     "jpg": sprite_asset,
+    "layers": layers_asset,
     "txt": string_asset,
     "glsl": shader_asset,
     "obj": model_asset,
@@ -399,7 +1096,49 @@ EXTENSIONS = {
 }
 
 
-def pack(asset_files, out_file, verbose=False):
+def write_id_header(names, header_file):
+    """Write a C++ header with a constexpr AssetID for every asset.
+
+    The IDs are hashed by the compiler, so the header only changes
+    when assets are added, removed or renamed.
+    """
+    for name in names:
+        if name[0].isdigit():
+            print(f"Asset name {name} can't be used as an identifier")
+            sys.exit(1)
+    lines = [
+        "// clang-format off",
+        "/*",
+        " * Do not edit this file directly! It is generated from",
+        " * the assets in `res/` by `tools/asset-gen.py`.",
+        " */",
+        "",
+        "#pragma once",
+        "#include \"../math/smek_math.h\"",
+        "",
+        "namespace AssetIDs {",
+        "",
+        *(f"constexpr AssetID {name}(\"{name}\");" for name in sorted(names)),
+        "",
+        "} // namespace AssetIDs",
+        "",
+    ]
+    with open(header_file, "w") as f:
+        f.write("\n".join(lines))
+
+
+def asset_name(path, prefix=""):
+    """The name of the asset in the file, also used for the layers of textures."""
+    return re.sub(r"[^A-Z0-9]", "_",
+                  prefix +
+                  "".join(path
+                          .split("/")[-1]
+                          .split(".")[:-1])
+                  .upper())
+
+
+def pack(asset_files, out_file, verbose=False, compression=True):
+    """Pack the assets into out_file, returns the names of the packed assets."""
     print("=== PACKING INTO {} ===".format(out_file))
     seen_name_hashes = set()
 
@@ -410,19 +1149,20 @@ def pack(asset_files, out_file, verbose=False):
     data = []
     names = []
 
+    # The layers of textures are only packed as part of them.
+    layer_files = set()
+    for asset in asset_files:
+        if asset.endswith(".layers"):
+            layer_files.update(os.path.normpath(p) for p in layer_paths(asset))
+
     for asset in asset_files:
-        if asset.count(".") != 1:
+        if asset.count(".") != 1 or os.path.normpath(asset) in layer_files:
             continue
         ext = asset.split(".")[-1]
         if ext in EXTENSIONS:
             for asset_header, asset_data, asset_prefix in EXTENSIONS[ext](asset, verbose):
                 if not (asset_header and asset_data): continue
-                name = re.sub(r"[^A-Z0-9]", "_",
-                              asset_prefix +
-                              "".join((asset)
-                                    .split("/")[-1]
-                                    .split(".")[:-1])
-                              .upper())
+                name = asset_name(asset, asset_prefix)
                 print(asset + " -> ", end="")
 
                 name_hash = hash_string(name)
@@ -437,35 +1177,58 @@ def pack(asset_files, out_file, verbose=False):
 
                 asset_header["name_hash"] = name_hash
                 asset_header["data_hash"] = hash_bytes(asset_data)
+                if (compression and asset_header["type"] in COMPRESSED_TYPES
+                        and not asset_header["flags"] & FLAG_STREAMED):
+                    packed = compress(asset_data)
+                    if len(packed) < len(asset_data):
+                        if verbose:
+                            print(f"  compressed {len(asset_data)} -> {len(packed)} bytes")
+                        asset_data = packed
+                        asset_header["flags"] |= FLAG_COMPRESSED
+                        asset_header["data_size"] = len(packed)
                 asset_header["name_size"] = len(name)+1
                 asset_header["name_offset"] = cur_name_offset
                 asset_header["data_offset"] = cur_asset_offset
-                cur_asset_offset += asset_header["data_size"]
+                cur_asset_offset += align(asset_header["data_size"])
                 cur_name_offset += asset_header["name_size"]
                 headers.append(asset_header)
                 names.append(name)
-                data.append(asset_data)
+                data.append(asset_data + bytes(align(len(asset_data)) - len(asset_data)))
         else:
             print("Extension {} not supported".format(ext))
 
+    asset_names = names
     names = [struct.pack("{}s".format(len(name)+1), str.encode(name, "ascii") + b'\0') for name in names]
 
-    name_offset = HEADER_OFFSET + HEADER_SIZE * len(headers)
-    data_offset = name_offset + sum([len(name) for name in names])
+    headers = sorted(headers, key=lambda x: x["name_hash"])
+    index_offset = HEADER_OFFSET + HEADER_SIZE * len(headers)
+    index_capacity, index = build_index([h["name_hash"] for h in headers])
+
+    name_offset = index_offset + len(index)
+    names_size = sum([len(name) for name in names])
+    data_offset = align(name_offset + names_size)
+    names.append(bytes(data_offset - name_offset - names_size))
 
     if verbose:
         print("=== PACKING THE FOLLOWING ASSETS ===")
-        print("\n".join(names))
-    with open(out_file, "wb") as f:
-        f.write(struct.pack(FILE_HEADER_FMT, len(headers), HEADER_OFFSET, name_offset, data_offset))
-        for h in sorted(headers, key=lambda x: x["name_hash"]):
+        print("\n".join(asset_names))
+    # Written to the side and moved into place, so a running
+    # game that has the old file mapped keeps a valid file.
+    tmp_file = out_file + ".tmp"
+    with open(tmp_file, "wb") as f:
+        f.write(struct.pack(FILE_HEADER_FMT, len(headers), HEADER_OFFSET, name_offset, data_offset,
+                            index_offset, index_capacity))
+        for h in headers:
             f.write(struct.pack(ASSET_HEADER_FMT, *h.values()))
             if verbose:
                 print("Writing header {} as {}".format(h, [hex(val) for val in [*h.values()]]))
+        f.write(index)
         for n in names:
             f.write(n)
         for d in data:
             f.write(d)
+    os.replace(tmp_file, out_file)
+    return asset_names
 
 
 if __name__ == "__main__":
@@ -474,6 +1237,9 @@ if __name__ == "__main__":
     parser.add_argument("-f", "--files", nargs="+", help="The data files to parse")
     parser.add_argument("-o", "--out", help="The result file to store in", default="assets")
     parser.add_argument("-v", "--verbose", action="store_true", help="Makes the output verbose and noisy")
+    parser.add_argument("-u", "--uncompressed", action="store_true", help="Stores all assets without compression")
+    parser.add_argument("-m", "--mip-filter", choices=MIP_FILTERS.keys(), default=mip_filter, help="The filter the mip levels of textures are made with, none skips them")
+    parser.add_argument("-H", "--header", help="Writes a C++ header with the IDs of the assets in the main pack")
     parser.add_argument("-e", "--extensions", action="store_true", help="Prints out the valid extensions, ovrrides all other options")
     args = parser.parse_args()
 
@@ -491,6 +1257,8 @@ if __name__ == "__main__":
 
     output_file = args.out
     verbose = args.verbose
+    compression = not args.uncompressed
+    mip_filter = args.mip_filter
 
     if auto_mode:
         asset_files = defaultdict(list)
@@ -500,8 +1268,10 @@ if __name__ == "__main__":
                 global_asset_files.append(f)
             else:
                 asset_files["{}-{}".format(output_file, "-".join(f.split("/")[1:-1]))].append(f)
-        pack(global_asset_files, output_file + ".bin", verbose)
+        names = pack(global_asset_files, output_file + ".bin", verbose, compression)
         for out, assets in asset_files.items():
-            pack(assets, out + ".bin")
+            pack(assets, out + ".bin", compression=compression)
     else:
-        pack(sources, output_file, verbose)
+        names = pack(sources, output_file, verbose, compression)
+    if args.header:
+        write_id_header(names, args.header)
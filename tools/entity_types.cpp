@@ -19,11 +19,13 @@ $type_formats
     return 0;
 }
 
-namespace FieldName {
-$all_field_names_impl
-};
-
-$fields_data
+FieldID field_id(FieldNameType name) {
+    uintptr_t at = (uintptr_t)name - (uintptr_t)field_name_table;
+    if (at >= sizeof(field_name_table) || at % sizeof(field_name_table[0])) {
+        return FieldID::NUM_FIELD_IDS;
+    }
+    return FieldID(at / sizeof(field_name_table[0]));
+}
 
 FieldList get_fields_for(EntityType type) {
     switch (type) {
@@ -42,7 +44,23 @@ $emplace_switch
     }
 }
 
+// The entities of a type are all of that exact type, so the
+// calls can be qualified. Entities of other types are called
+// virtually, after the known types. Types marked with
+// PARALLEL_UPDATE are updated on all the entity workers.
+void EntitySystem::update_entities() {
+$update_dispatch
+}
+
+void EntitySystem::draw_entities() {
+$draw_dispatch
+}
+
 EntityID EntitySystem::add_unknown_type(BaseEntity *e) {
+    return add_unknown_type_with_id(e, next_id());
+}
+
+EntityID EntitySystem::add_unknown_type_with_id(BaseEntity *e, EntityID id) {
     switch (e->type) {
 $add_switch
     default:
@@ -51,15 +69,6 @@ $add_switch
     }
 }
 
-/*
- * Included from `tools/entity_types_type_of.cpp`
- */
-
-$type_ofs
-/*
- * End of `tools/entity_types_type_of.cpp`
- */
-
 /*
  * Included from `tools/entity_types_event_callback.cpp`
  */
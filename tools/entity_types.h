@@ -21,15 +21,42 @@ $types
     NUM_ENTITY_TYPES,
 };
 
+///* FieldID
+// Every field name on the entity types, field_id gives
+// the FieldID of a FieldName::*.
+enum class FieldID {
+$field_ids
+
+    NUM_FIELD_IDS,
+};
+
+// The FieldName::* point into this table, so a
+// name is found from where it points.
+inline constexpr char field_name_table[][$max_field_name] = {
+$field_name_table
+};
+
 using FieldNameType = const char *;
 namespace FieldName {
 $all_field_names
 };
 
+///*
+// The FieldID of a FieldName::*, NUM_FIELD_IDS for other strings.
+// Constant time, no strings are compared.
+FieldID field_id(FieldNameType name);
+
 static const char *entity_type_names[] = {
 $type_names
 };
 
+///* entity_type_infos
+// The exact type of every entity type, entities of derived
+// types the type system doesn't know have another typeid.
+static const std::type_info *entity_type_infos[] = {
+$type_infos
+};
+
 i32 format(char *, u32, FormatHint, EntityType);
 
 struct Field {
@@ -42,11 +69,33 @@ struct Field {
 
 struct FieldList {
     int num_fields;
-    Field *list;
+    const Field *list;
+};
+
+$fields_data
+
+inline constexpr const Field *FIELD_TABLES[] = {
+$field_tables
+};
+
+///* FIELD_SLOTS
+// Where the field is in the field list of the type, -1 if the
+// type doesn't have it. Indexed with EntityType and FieldID.
+inline constexpr i8 FIELD_SLOTS[][(u32)FieldID::NUM_FIELD_IDS] = {
+$field_slots
 };
 
 static constexpr int MAX_ENTITY_SIZE = std::max({$type_sizes});
 
+///* ENTITY_TYPE_SIZES
+// The size of every entity type, in the order of EntityType.
+static constexpr u32 ENTITY_TYPE_SIZES[] = { $type_sizes };
+
+///* ENTITY_TYPE_TRANSFORMS
+// Whether the type derives from Entity, so it has a position,
+// rotation and scale.
+static constexpr bool ENTITY_TYPE_TRANSFORMS[] = { $type_transforms };
+
 ///*
 // Returns a list of fields on the specified struct type.
 FieldList get_fields_for(EntityType type);
@@ -66,6 +115,17 @@ $type_ofs
  * End of `tools/entity_types_type_of.h`
  */
 
+///*
+// The offset of the field on entities of type E, as a constant.
+// Entity types that don't have the field don't compile.
+template <typename E, FieldID F>
+constexpr int field_offset() {
+    constexpr EntityType type = type_of((E *)nullptr);
+    constexpr i8 slot = FIELD_SLOTS[(u32)type][(u32)F];
+    static_assert(slot != -1, "The entity type doesn't have the field");
+    return FIELD_TABLES[(u32)type][slot].offset;
+}
+
 struct EventCreateEntity {
     bool generate_id;
     EntityType type;
@@ -1,3 +0,0 @@
-EntityType type_of($entity_type *e) {
-    return EntityType::$entity_type_enum;
-}
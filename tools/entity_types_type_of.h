@@ -1,2 +1,4 @@
 struct $entity_type;
-EntityType type_of($entity_type *);
+constexpr EntityType type_of($entity_type *) {
+    return EntityType::$entity_type_enum;
+}
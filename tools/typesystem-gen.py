@@ -173,7 +173,11 @@ class MetaDataExtractor(Visitor):
 def to_enum(name):
     return name.upper()
 
-if __name__ == "__main__":
+def find_entity_structs():
+    """Return a (name: Struct)-dictionary of all entity types, with their inherited fields.
+
+    Also used by asset-gen.py to compile levels.
+    """
     lexer = lark.Lark.open("tools/struct.lark", start="structs")
     base_entity = "BaseEntity"
     #TODO(gu) parse entire files instead of one at a time
@@ -206,6 +210,11 @@ if __name__ == "__main__":
         while parent:
             struct.fields = parent.fields + struct.fields
             parent = parent.parent
+    return entity_structs
+
+
+if __name__ == "__main__":
+    entity_structs = find_entity_structs()
 
     def gen_fields_data(name, fields):
         def gen():
@@ -218,7 +227,15 @@ if __name__ == "__main__":
                            f"{int('INTERNAL' in field)}, "
                            "}")
             return ",\n    ".join(out)
-        return f"Field gen_{name}[] = {{\n    {gen()}\n}};"
+        return f"inline constexpr Field gen_{name}[] = {{\n    {gen()}\n}};"
+
+    def gen_field_slots(name, fields):
+        """The position of every field name in the field table of the type, -1 if it doesn't have it."""
+        slots = []
+        for field_name in all_field_names:
+            names = [field['NAME'] for field in fields]
+            slots.append(str(names.index(field_name)) if field_name in names else "-1")
+        return f"{' '*4}{{ {', '.join(slots)} }}, // {name}"
 
     def gen_fields_switch(names):
         out = []
@@ -235,10 +252,38 @@ if __name__ == "__main__":
         out.append(f"{' '*8}return;")
         return (f"\n").join(out)
 
+    def has_transform(struct):
+        """Whether the struct has a position, rotation and scale."""
+        return struct.name == "Entity" or struct.parents_contain("Entity")
+
+    def overrides(struct, method):
+        """Whether the struct or a parent, other than BaseEntity, declares the method."""
+        declaration = re.compile(rf"\bvoid\s+{method}\s*\(\s*\)")
+        while struct and struct.name != "BaseEntity":
+            if declaration.search(struct.source):
+                return True
+            struct = struct.parent
+        return False
+
+    def parallel_update(struct):
+        """Whether the struct is marked with PARALLEL_UPDATE, so its updates can run on any thread."""
+        return re.search(r"\bstatic\s+constexpr\s+bool\s+PARALLEL_UPDATE\s*=\s*true\b", struct.source) is not None
+
+    def gen_dispatch(method):
+        out = []
+        for name, struct in entity_structs.items():
+            if not overrides(struct, method):
+                out.append(f"{' '*4}// {name}::{method} does nothing.")
+                continue
+            run = "run_batch_parallel" if method == "update" and parallel_update(struct) else "run_batch"
+            out.append(f"{' '*4}{run}((u32)EntityType::{to_enum(name)}, {method}_batch<{name}>);")
+        out.append(f"{' '*4}run_batch((u32)EntityType::NUM_ENTITY_TYPES, {method}_batch<BaseEntity>);")
+        return "\n".join(out)
+
     def gen_add_unkown_type(name):
         out = []
         out.append(f"{' '*4}case EntityType::{to_enum(name)}:")
-        out.append(f"{' '*8}return add<{name}>(*({name} *) e);")
+        out.append(f"{' '*8}return add_with_id<{name}>(*({name} *) e, id);")
         return (f"\n").join(out)
 
     all_field_names = set()
@@ -256,12 +301,23 @@ if __name__ == "__main__":
                                      for field in struct.fields])
                     for name, struct in entity_structs.items() }
 
+    fields_data = [gen_fields_data(name, struct.fields) for name, struct in entity_structs.items()]
+
     template_kwords_h = {
-            "all_field_names": "\n".join([f"extern FieldNameType {name};" for name in all_field_names]),
+            "field_ids": "\n".join([f"    {name}," for name in all_field_names]),
+            "field_name_table": ",\n".join([f"{' '*4}\"{name}\"" for name in all_field_names]),
+            "max_field_name": str(max(len(name) for name in all_field_names) + 1),
+            "all_field_names": "\n".join([f"inline constexpr FieldNameType {name} = field_name_table[(u32)FieldID::{name}];"
+                                          for name in all_field_names]),
+            "fields_data": "\n".join(fields_data),
+            "field_tables": ",\n".join([f"{' '*4}gen_{name}" for name in entity_structs.keys()]),
+            "field_slots": "\n".join([gen_field_slots(name, struct.fields) for name, struct in entity_structs.items()]),
             "types": "\n".join([f"    {to_enum(t)}," for t in entity_structs.keys()]),
             "type_sizes": ", ".join([f"sizeof({t})" for t in entity_structs.keys()]),
+            "type_transforms": ", ".join([str(has_transform(s)).lower() for s in entity_structs.values()]),
             "type_names": ",\n".join([f"{' '*4}\"{t}\"" for t in entity_structs.keys()]),
-            "type_ofs": "\n".join([template_type_of_h.substitute(entity_type=t) for t in entity_structs.keys()]),
+            "type_infos": ",\n".join([f"{' '*4}&typeid({t})" for t in entity_structs.keys()]),
+            "type_ofs": "\n".join([template_type_of_h.substitute(entity_type=t, entity_type_enum=to_enum(t)) for t in entity_structs.keys()]),
             "event_entity_bytes_union": "\n".join([f"{' '*8}u8 {to_enum(t)}[sizeof({t}) - sizeof(void *)];" for t in entity_structs.keys()]),
             "entity_events_prototypes": "\n".join([f"Event entity_event({name} entity, bool generate_id = false);\n" +
                                                    f"Event entity_event({name} *entity, bool generate_id = false);"
@@ -273,9 +329,6 @@ if __name__ == "__main__":
         with open("src/entity/entity_types.h", "w") as out_file:
             out_file.write(template.substitute(template_kwords_h))
 
-    with open("tools/entity_types_type_of.cpp", "r") as template_file:
-        template_type_of_cpp = Template(template_file.read())
-
     with open("tools/entity_types_event_callback.cpp", "r") as template_file:
         template_event_callback = Template(template_file.read())
 
@@ -290,20 +343,18 @@ if __name__ == "__main__":
                                                        entity_type_enum=to_enum(name))
                      for name in entity_structs.keys()]
 
-    fields_data = [gen_fields_data(name, struct.fields) for name, struct in entity_structs.items()]
     fields_switch = gen_fields_switch(entity_structs.keys())
 
     emplace_switch = "\n".join([gen_emplace(name) for name in entity_structs.keys()])
     add_switch = "\n".join([gen_add_unkown_type(name) for name in entity_structs.keys()])
 
     template_kwords_cpp = {
-            "all_field_names_impl": "\n".join([f"FieldNameType {name} = \"{name}\";" for name in all_field_names]),
-            "type_ofs": "\n".join([template_type_of_cpp.substitute(entity_type=t, entity_type_enum=to_enum(t)) for t in entity_structs.keys()]),
             "type_formats": "\n".join([f"{' '*4}case EntityType::{to_enum(t)}: return snprintf(buffer, size, \"{t}\");" for t in entity_structs.keys()]),
-            "fields_data": "\n".join(fields_data),
             "fields_switch": fields_switch,
             "emplace_switch": emplace_switch,
             "add_switch": add_switch,
+            "update_dispatch": gen_dispatch("update"),
+            "draw_dispatch": gen_dispatch("draw"),
             "callbacks": "".join(callbacks),
             "entity_events": "\n".join(entity_events),
     }